@@ -0,0 +1,71 @@
+#pragma once
+
+// Heap accounting for the host harnesses. malloc and friends are interposed
+// on glibc's allocator, so allocations made by C and C++ code are counted.
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <malloc.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+struct AllocStats {
+  uint64_t num_allocs;
+  uint64_t num_frees;
+  size_t live_bytes;
+  size_t peak_bytes;
+};
+
+AllocStats alloc_stats = {};
+
+static void count_alloc(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  alloc_stats.num_allocs++;
+  alloc_stats.live_bytes += malloc_usable_size(ptr);
+  alloc_stats.peak_bytes =
+      std::max(alloc_stats.peak_bytes, alloc_stats.live_bytes);
+}
+
+static void count_free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  alloc_stats.num_frees++;
+  alloc_stats.live_bytes -= malloc_usable_size(ptr);
+}
+
+extern "C" {
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  count_alloc(ptr);
+  return ptr;
+}
+
+void *calloc(size_t num, size_t size) {
+  void *ptr = __libc_calloc(num, size);
+  count_alloc(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  count_free(ptr);
+  void *new_ptr = __libc_realloc(ptr, size);
+  count_alloc(new_ptr);
+  return new_ptr;
+}
+
+void free(void *ptr) {
+  count_free(ptr);
+  __libc_free(ptr);
+}
+}
+
+// Reset the peak to the current live bytes, to measure a section of code
+void reset_alloc_peak() { alloc_stats.peak_bytes = alloc_stats.live_bytes; }
@@ -0,0 +1,930 @@
+// Load generator: a fleet of virtual stations posting to a rest_server.
+//
+// Every virtual station follows the request sequence of the station code:
+// setup_station() posts its token, setup_sensors() puts its sensors and gets
+// their ids, and send_data() posts the queued frames every send interval,
+// whole frames up to max_measurements_per_post values. The documents are
+// built by the functions of rest_json.h from copies of the station's sensor
+// objects, so the bodies are those of the station. Stations run on a single
+// epoll event loop, each with at most one request in flight like the
+// blocking HTTPClient, and reuse their connection like the core's client.
+//
+//   pio run -e native_fleet
+//   .pio/build/native_fleet/program --port 8000 --stations 2000
+//
+// Options:
+//   --host H             server address (127.0.0.1)
+//   --port N             server port (80)
+//   --stations N         virtual stations (1000)
+//   --duration-s N       run time after the first station starts (60)
+//   --ramp-s N           stations start evenly spread over N s (10)
+//   --send-interval-s N  send_data() period (5)
+//   --p1-fraction F      fraction of the stations with a P1 meter (0.25)
+//   --p1-interval-s N    P1 report interval, 1 for every telegram (60)
+//   --max-in-flight N    requests in flight, the others wait (1024)
+//   --timeout-ms N       request timeout (5000)
+//   --report-s N         progress line on stderr every N s (10, 0 off)
+//   --close              open a new connection for every request
+//
+// The other stations have an AM2320, or an AM2320, a CCS811 and an HDC1080.
+// Tokens and hostnames are derived from the station number, so a second run
+// finds the stations of the first one. Results are printed as "key: value"
+// lines. Exits with 1 if no station could post measurements.
+#include "fuzz/fuzz_world.h"
+
+#include "AM2320Sensor.h"
+#include "CCS811Sensor.h"
+#include "HDC1080Sensor.h"
+#include "P1Sensor.h"
+#include "rest_json.h"
+#include <ArduinoJson.h>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <queue>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+typedef struct {
+  const char *host;
+  const char *port;
+  uint32_t num_stations;
+  uint32_t duration_s;
+  uint32_t ramp_s;
+  uint32_t send_interval_s;
+  double p1_fraction;
+  uint32_t p1_interval_s;
+  uint32_t max_in_flight;
+  uint32_t timeout_ms;
+  uint32_t report_s;
+  bool close;
+} FleetOptions;
+
+FleetOptions options = {
+    "127.0.0.1", "80", 1000, 60, 10, 5, 0.25, (uint32_t)p1_report_interval_s,
+    1024,        5000, 10,   false};
+
+const char *stations_endpoint = "/api/stations";
+
+///// Sensors
+// Each station has copies of the sensor objects of the station code, which
+// register their magnitudes, keep their server ids and format their values.
+// The fleet only makes up the values.
+const uint8_t max_station_sensors = 3;
+
+bool is_p1(const Sensor &sensor) {
+  return strcmp(sensor.name, p1_sensor.name) == 0;
+}
+
+// Magnitudes of a sensor, as its setup_json() registers them
+uint8_t count_magnitudes(Sensor &sensor) {
+  DynamicJsonDocument sensor_json(sensor.capacity + 200);
+  JsonObject object = sensor_json.to<JsonObject>();
+  sensor.setup_json(object);
+  return object[JSON_KEY(magnitudes)].size();
+}
+
+///// Clock
+typedef std::chrono::steady_clock Clock;
+Clock::time_point start_time;
+
+uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                               start_time)
+      .count();
+}
+
+///// Stations
+enum class Phase : uint8_t { station, put_sensors, get_sensors, running };
+enum class Request : uint8_t {
+  post_station,
+  put_sensors,
+  get_sensors,
+  post_measurements
+};
+const uint8_t num_request_kinds = 4;
+const char *request_names[num_request_kinds] = {"post_station", "put_sensors",
+                                                "get_sensors", "measurements"};
+
+struct Station {
+  uint32_t index;
+  Phase phase = Phase::station;
+  uint8_t num_sensors = 0;
+  Sensor *sensors[max_station_sensors];
+  uint8_t num_magnitudes[max_station_sensors];
+  uint16_t station_id = 0;
+  std::string endpoint;
+
+  SensorFrameBuffer<4080> buffer;
+  time_t next_sample[max_station_sensors];
+  uint16_t batch_end = 0, batch_values = 0;
+
+  int fd = -1;
+  bool in_flight = false;
+  uint32_t num_posts = 0;
+};
+
+std::vector<Station> stations;
+
+void make_token(const Station &station, char *token, size_t size) {
+  // Stand-in for sha1(mac), 40 hex digits
+  uint64_t hash = 0xcbf29ce484222325ull ^ station.index;
+  for (size_t i = 0; i + 1 < size && i < 40; i += 8) {
+    hash = (hash ^ (hash >> 29)) * 0x100000001b3ull;
+    snprintf(token + i, size - i, "%08x", (unsigned)(hash >> 24));
+  }
+}
+
+void setup_station(Station &station) {
+  const bool has_p1 =
+      floor((station.index + 1) * options.p1_fraction) >
+      floor(station.index * options.p1_fraction);
+  if (has_p1) {
+    station.sensors[station.num_sensors++] = new P1Sensor(p1_sensor);
+  } else if (station.index % 2 == 0) {
+    station.sensors[station.num_sensors++] = new AMS2320Sensor(am2320_sensor);
+  } else {
+    station.sensors[station.num_sensors++] = new AMS2320Sensor(am2320_sensor);
+    station.sensors[station.num_sensors++] = new CCS811Sensor(ccs811_sensor);
+    station.sensors[station.num_sensors++] = new HDC1080Sensor(hdc1080_sensor);
+  }
+  for (uint8_t i = 0; i < station.num_sensors; i++) {
+    station.num_magnitudes[i] = count_magnitudes(*station.sensors[i]);
+  }
+}
+
+uint32_t sample_period_s(const Sensor &sensor) {
+  return is_p1(sensor) ? options.p1_interval_s : sensor.period_s;
+}
+
+// Values moving a little around a typical reading of each magnitude
+int32_t sample_value(const Station &station, uint8_t sensor, uint8_t magnitude,
+                     time_t epoch) {
+  const double typical[] = {21.5, 48, 600, 120};
+  const double phase = station.index * 0.37 + magnitude + sensor;
+  const double wave = sin(epoch / 300.0 + phase);
+  Sensor &station_sensor = *station.sensors[sensor];
+  const uint8_t decimals = station_sensor.magnitude_decimals(magnitude);
+  if (is_p1(station_sensor)) {
+    // Counters in kWh or m3 grow, power in kW moves
+    return to_fixed(magnitude < 5 ? 1000 + epoch / 3600.0 : 0.5 + 0.3 * wave,
+                    decimals);
+  }
+  return to_fixed(typical[(2 * sensor + magnitude) % 4] * (1 + 0.05 * wave),
+                  decimals);
+}
+
+// Queue the frames of the samples taken until now, like queue_frame()
+void sample(Station &station, time_t now) {
+  for (uint8_t i = 0; i < station.num_sensors; i++) {
+    const uint32_t period_s = sample_period_s(*station.sensors[i]);
+    const uint8_t magnitudes = station.num_magnitudes[i];
+    for (; station.next_sample[i] <= now; station.next_sample[i] += period_s) {
+      SensorFrame frame = {};
+      frame.epoch = station.next_sample[i];
+      frame.sensor_id = station.sensors[i]->id;
+      for (uint8_t first = 0; first < magnitudes; first += max_frame_values) {
+        frame.first_magnitude = first;
+        frame.num_values = min<uint8_t>(magnitudes - first, max_frame_values);
+        for (uint8_t j = 0; j < frame.num_values; j++) {
+          frame.values[j] = sample_value(station, i, first + j, frame.epoch);
+        }
+        station.buffer.push(frame);
+      }
+    }
+  }
+}
+
+///// Request bodies
+// Serialized into http_body like on the station, then copied
+void serialize(const JsonDocument &json, std::string &body) {
+  body.assign(http_body, serialize_body(json));
+}
+
+void station_body(const Station &station, std::string &body) {
+  char token[41], hostname[16];
+  make_token(station, token, sizeof(token));
+  snprintf(hostname, sizeof(hostname), "fleet-%05u", station.index);
+  ArenaJsonDocument station_json(station_json_capacity);
+  build_station_json(station_json, token, "fleet", hostname);
+  serialize(station_json, body);
+}
+
+void sensors_body(const Station &station, std::string &body) {
+  ArenaJsonDocument sensors_json(
+      sensors_json_capacity(station.sensors, station.num_sensors));
+  build_sensors_json(sensors_json, station.sensors, station.num_sensors);
+  serialize(sensors_json, body);
+}
+
+// The next batch of send_data()
+void measurements_body(Station &station, std::string &body) {
+  station.batch_end = station.buffer.batch_end(max_measurements_per_post,
+                                               station.batch_values);
+  ArenaJsonDocument list_measurement(
+      measurements_json_capacity(station.batch_values));
+  build_measurements_json(list_measurement, station.buffer, station.batch_end,
+                          station.sensors, station.num_sensors);
+  serialize(list_measurement, body);
+}
+
+// Like setup_sensors(), parsed in place in http_body
+bool parse_sensors(Station &station, const std::string &body) {
+  if (body.size() >= sizeof(http_body)) {
+    return false;
+  }
+  memcpy(http_body, body.c_str(), body.size() + 1);
+  ArenaJsonDocument sensors_json(
+      sensors_response_capacity(station.sensors, station.num_sensors));
+  if (deserializeJson(sensors_json, http_body, body.size())) {
+    return false;
+  }
+  for (uint8_t i = 0; i < station.num_sensors; i++) {
+    station.sensors[i]->id = 0;
+  }
+  parse_sensors_json(sensors_json.as<JsonArray>(), station.sensors,
+                     station.num_sensors);
+  for (uint8_t i = 0; i < station.num_sensors; i++) {
+    if (station.sensors[i]->id == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+///// Statistics
+struct RequestStats {
+  uint64_t num_requests = 0;
+  uint64_t num_ok = 0;
+  uint64_t num_http_errors = 0;
+  uint64_t num_failures = 0;
+  uint64_t bytes_sent = 0, bytes_received = 0;
+  std::vector<uint32_t> latency_us;
+};
+
+RequestStats request_stats[num_request_kinds];
+uint64_t status_classes[6] = {};
+uint64_t num_connects = 0, num_connect_errors = 0, num_timeouts = 0;
+uint64_t num_resets = 0, num_reconnects = 0;
+uint64_t measurements_accepted = 0;
+uint32_t max_in_flight = 0;
+std::vector<uint32_t> queue_wait_us;
+
+uint32_t percentile(std::vector<uint32_t> &values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+///// Connections
+struct Connection {
+  Station *station;
+  Request kind;
+  std::string out;
+  size_t sent = 0;
+  std::string in;
+  bool connecting = false;
+  bool reused = false;
+  uint64_t queued_us = 0, start_us = 0;
+};
+
+int epoll_fd = -1;
+sockaddr_storage server_address;
+socklen_t server_address_length = 0;
+// By descriptor, the request in flight and the station using it
+std::vector<Connection *> connections;
+std::vector<Station *> fd_stations;
+uint32_t num_in_flight = 0;
+std::deque<std::pair<Station *, uint64_t>> waiting;
+
+// Due actions of the stations, earliest first
+typedef std::pair<uint64_t, uint32_t> Action;
+std::priority_queue<Action, std::vector<Action>, std::greater<Action>> actions;
+
+void schedule(const Station &station, uint64_t at_us) {
+  actions.push(Action(at_us, station.index));
+}
+
+void close_station_fd(Station &station) {
+  if (station.fd < 0) {
+    return;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, station.fd, nullptr);
+  connections[station.fd] = nullptr;
+  fd_stations[station.fd] = nullptr;
+  close(station.fd);
+  station.fd = -1;
+}
+
+bool open_connection(Station &station) {
+  const int fd = socket(server_address.ss_family,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  num_connects++;
+  if (connect(fd, (const sockaddr *)&server_address, server_address_length) <
+          0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return false;
+  }
+  station.fd = fd;
+  if ((size_t)fd >= connections.size()) {
+    connections.resize(fd + 1, nullptr);
+    fd_stations.resize(fd + 1, nullptr);
+  }
+  fd_stations[fd] = &station;
+  return true;
+}
+
+void write_request(Connection &connection, const char *method,
+                   const std::string &uri, const std::string &body) {
+  char header[512];
+  const bool has_body = strcmp(method, "GET") != 0;
+  const int length = snprintf(
+      header, sizeof(header),
+      "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ESP8266HTTPClient\r\n"
+      "Connection: %s\r\nAccept-Encoding: identity;q=1,chunked;q=0.1,*;q=0"
+      "\r\n",
+      method, uri.c_str(), options.host,
+      options.close ? "close" : "keep-alive");
+  connection.out.assign(header, length);
+  if (has_body) {
+    snprintf(header, sizeof(header),
+             "Content-Type: application/json\r\nContent-Length: %zu\r\n",
+             body.size());
+    connection.out += header;
+  }
+  connection.out += "\r\n";
+  connection.out += body;
+}
+
+// Send a request of the station's current phase on its connection
+bool start_request(Station &station, uint64_t queued_us) {
+  Connection *connection = new Connection();
+  connection->station = &station;
+  connection->queued_us = queued_us;
+  connection->start_us = now_us();
+  connection->reused = station.fd >= 0;
+  if (station.fd < 0 && !open_connection(station)) {
+    num_connect_errors++;
+    delete connection;
+    return false;
+  }
+  connection->connecting = !connection->reused;
+
+  std::string body;
+  switch (station.phase) {
+  case Phase::station:
+    connection->kind = Request::post_station;
+    station_body(station, body);
+    write_request(*connection, "POST", stations_endpoint, body);
+    break;
+  case Phase::put_sensors:
+    connection->kind = Request::put_sensors;
+    sensors_body(station, body);
+    write_request(*connection, "PUT", station.endpoint + "/sensors", body);
+    break;
+  case Phase::get_sensors:
+    connection->kind = Request::get_sensors;
+    write_request(*connection, "GET", station.endpoint + "/sensors", body);
+    break;
+  case Phase::running:
+    connection->kind = Request::post_measurements;
+    measurements_body(station, body);
+    write_request(*connection, "POST", station.endpoint + "/measurements",
+                  body);
+    break;
+  }
+
+  connections[station.fd] = connection;
+  epoll_event event = {};
+  event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+  event.data.fd = station.fd;
+  if (epoll_ctl(epoll_fd, connection->reused ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                station.fd, &event) < 0) {
+    close_station_fd(station);
+    delete connection;
+    num_connect_errors++;
+    return false;
+  }
+  station.in_flight = true;
+  num_in_flight++;
+  max_in_flight = max(max_in_flight, num_in_flight);
+  return true;
+}
+
+// Run the station's next request now or when a slot is free
+void run_station(Station &station, uint64_t due_us) {
+  if (station.phase == Phase::running) {
+    sample(station, time(nullptr));
+    if (station.buffer.isEmpty()) {
+      schedule(station, due_us + options.send_interval_s * 1000000ull);
+      return;
+    }
+  }
+  if (num_in_flight >= options.max_in_flight) {
+    waiting.push_back(std::make_pair(&station, due_us));
+    return;
+  }
+  if (!start_request(station, due_us)) {
+    // Like retry() on the station
+    schedule(station, now_us() + 1000000);
+  }
+}
+
+// Parsed response, false while incomplete
+bool parse_response(const std::string &in, bool closed, int &code,
+                    std::string &location, std::string &body) {
+  const size_t header_end = in.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    return false;
+  }
+  if (sscanf(in.c_str(), "HTTP/1.%*d %d", &code) != 1) {
+    code = -1;
+    return true;
+  }
+  long content_length = -1;
+  bool chunked = false;
+  for (size_t line = in.find("\r\n") + 2; line < header_end;) {
+    const size_t line_end = in.find("\r\n", line);
+    const std::string header = in.substr(line, line_end - line);
+    const char *value = strchr(header.c_str(), ':');
+    if (value != nullptr) {
+      value++;
+      while (*value == ' ') {
+        value++;
+      }
+      if (strncasecmp(header.c_str(), "content-length:", 15) == 0) {
+        content_length = atol(value);
+      } else if (strncasecmp(header.c_str(), "location:", 9) == 0) {
+        location = value;
+      } else if (strncasecmp(header.c_str(), "transfer-encoding:", 18) == 0) {
+        chunked = strstr(value, "chunked") != nullptr;
+      }
+    }
+    line = line_end + 2;
+  }
+
+  const size_t body_start = header_end + 4;
+  if (code == 204 || code == 304) {
+    body.clear();
+    return true;
+  }
+  if (chunked) {
+    body.clear();
+    size_t pos = body_start;
+    while (true) {
+      const size_t size_end = in.find("\r\n", pos);
+      if (size_end == std::string::npos) {
+        return closed;
+      }
+      const size_t size = strtoul(in.c_str() + pos, nullptr, 16);
+      if (size == 0) {
+        return true;
+      }
+      if (in.size() < size_end + 2 + size + 2) {
+        return closed;
+      }
+      body.append(in, size_end + 2, size);
+      pos = size_end + 2 + size + 2;
+    }
+  }
+  if (content_length >= 0) {
+    if (in.size() < body_start + content_length) {
+      return closed;
+    }
+    body = in.substr(body_start, content_length);
+    return true;
+  }
+  body = in.substr(body_start);
+  return closed;
+}
+
+void count_request(const Connection &connection, int code) {
+  RequestStats &stats = request_stats[(uint8_t)connection.kind];
+  stats.num_requests++;
+  stats.bytes_sent += connection.out.size();
+  stats.bytes_received += connection.in.size();
+  stats.latency_us.push_back(now_us() - connection.start_us);
+  queue_wait_us.push_back(connection.start_us - connection.queued_us);
+  if (code < 0) {
+    stats.num_failures++;
+    return;
+  }
+  status_classes[min(code / 100, 5)]++;
+}
+
+// Move the station on after a response, code -1 if the request failed
+void finish(Connection *connection, int code, const std::string &location,
+            const std::string &body) {
+  Station &station = *connection->station;
+  RequestStats &stats = request_stats[(uint8_t)connection->kind];
+  count_request(*connection, code);
+  station.in_flight = false;
+  num_in_flight--;
+  if (station.fd >= 0) {
+    connections[station.fd] = nullptr;
+  }
+  if (code < 0 || options.close) {
+    close_station_fd(station);
+  }
+
+  const uint64_t now = now_us();
+  bool ok = false;
+  switch (connection->kind) {
+  case Request::post_station:
+    ok = (code == 200 || code == 201) && !location.empty();
+    if (ok) {
+      station.station_id = atoi(location.c_str());
+      station.endpoint = std::string(stations_endpoint) + "/" + location;
+      station.phase = Phase::put_sensors;
+    }
+    schedule(station, ok ? now : now + 1000000);
+    break;
+  case Request::put_sensors:
+    ok = code == 204;
+    if (ok) {
+      station.phase = Phase::get_sensors;
+    }
+    schedule(station, ok ? now : now + 1000000);
+    break;
+  case Request::get_sensors:
+    ok = code == 200 && parse_sensors(station, body);
+    if (ok) {
+      station.phase = Phase::running;
+      for (uint8_t i = 0; i < station.num_sensors; i++) {
+        station.next_sample[i] = time(nullptr);
+      }
+    } else {
+      station.phase = Phase::put_sensors;
+    }
+    schedule(station, ok ? now + options.send_interval_s * 1000000ull
+                         : now + 1000000);
+    break;
+  case Request::post_measurements:
+    ok = code == 201;
+    if (ok) {
+      measurements_accepted += station.batch_values;
+      station.buffer.discard_until(station.batch_end);
+      station.num_posts++;
+    }
+    schedule(station, connection->queued_us +
+                          options.send_interval_s * 1000000ull);
+    break;
+  }
+  if (ok) {
+    stats.num_ok++;
+  } else if (code >= 0) {
+    stats.num_http_errors++;
+  }
+  delete connection;
+
+  if (!waiting.empty() && num_in_flight < options.max_in_flight) {
+    const std::pair<Station *, uint64_t> next = waiting.front();
+    waiting.pop_front();
+    run_station(*next.first, next.second);
+  }
+}
+
+// A reused connection closed by the server before answering is retried once
+// on a new one, the other failures count
+void fail(Connection *connection, uint64_t &counter) {
+  Station &station = *connection->station;
+  if (connection->reused && connection->in.empty()) {
+    num_reconnects++;
+    close_station_fd(station);
+    station.in_flight = false;
+    num_in_flight--;
+    const uint64_t queued_us = connection->queued_us;
+    delete connection;
+    if (!start_request(station, queued_us)) {
+      num_connect_errors++;
+      schedule(station, now_us() + 1000000);
+    }
+    return;
+  }
+  counter++;
+  finish(connection, -1, std::string(), std::string());
+}
+
+void on_event(int fd, uint32_t events) {
+  Connection *connection = fd < (int)connections.size() ? connections[fd]
+                                                          : nullptr;
+  if (connection == nullptr) {
+    // An idle kept-alive connection closed by the server
+    if (fd < (int)fd_stations.size() && fd_stations[fd] != nullptr) {
+      close_station_fd(*fd_stations[fd]);
+    }
+    return;
+  }
+  if (connection->connecting && (events & (EPOLLOUT | EPOLLERR))) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      connection->reused = false;
+      fail(connection, num_connect_errors);
+      return;
+    }
+    connection->connecting = false;
+  }
+  if ((events & EPOLLOUT) && connection->sent < connection->out.size()) {
+    const ssize_t n =
+        send(fd, connection->out.data() + connection->sent,
+             connection->out.size() - connection->sent, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN) {
+      fail(connection, num_resets);
+      return;
+    }
+    connection->sent += max<ssize_t>(n, 0);
+    if (connection->sent == connection->out.size()) {
+      epoll_event event = {};
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.fd = fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+  }
+  if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+    return;
+  }
+  bool closed = false;
+  char buffer[4096];
+  while (true) {
+    const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n > 0) {
+      connection->in.append(buffer, n);
+      continue;
+    }
+    if (n == 0) {
+      closed = true;
+    } else if (errno != EAGAIN) {
+      fail(connection, num_resets);
+      return;
+    }
+    break;
+  }
+  int code;
+  std::string location, body;
+  if (parse_response(connection->in, closed, code, location, body)) {
+    if (closed) {
+      close_station_fd(*connection->station);
+    }
+    finish(connection, code, location, body);
+  } else if (closed) {
+    fail(connection, num_resets);
+  }
+}
+
+void check_timeouts() {
+  const uint64_t now = now_us();
+  // fail() can open connections and grow the table
+  for (size_t fd = 0; fd < connections.size(); fd++) {
+    Connection *connection = connections[fd];
+    if (connection != nullptr &&
+        now - connection->start_us > options.timeout_ms * 1000ull) {
+      connection->reused = false;
+      fail(connection, num_timeouts);
+    }
+  }
+}
+
+///// Report
+uint64_t last_report_us = 0, last_report_requests = 0;
+
+uint64_t total_requests() {
+  uint64_t total = 0;
+  for (const RequestStats &stats : request_stats) {
+    total += stats.num_requests;
+  }
+  return total;
+}
+
+void print_progress() {
+  const uint64_t now = now_us();
+  uint32_t num_running = 0;
+  for (const Station &station : stations) {
+    num_running += station.phase == Phase::running;
+  }
+  const uint64_t requests = total_requests();
+  std::vector<uint32_t> &latency =
+      request_stats[(uint8_t)Request::post_measurements].latency_us;
+  fprintf(stderr,
+          "t=%.0fs running=%u in_flight=%u waiting=%zu req/s=%.1f "
+          "measurements=%llu p99_ms=%.1f failures=%llu\n",
+          now / 1e6, num_running, num_in_flight, waiting.size(),
+          (requests - last_report_requests) * 1e6 / (now - last_report_us),
+          (unsigned long long)measurements_accepted,
+          percentile(latency, 0.99) / 1000.0,
+          (unsigned long long)(num_connect_errors + num_timeouts + num_resets));
+  last_report_us = now;
+  last_report_requests = requests;
+}
+
+void print_report(double run_s) {
+  uint32_t num_running = 0, num_posting = 0;
+  for (const Station &station : stations) {
+    num_running += station.phase == Phase::running;
+    num_posting += station.num_posts > 0;
+  }
+  const uint64_t requests = total_requests();
+  printf("stations: %u\n", options.num_stations);
+  printf("stations_running: %u\n", num_running);
+  printf("stations_posting: %u\n", num_posting);
+  printf("run_seconds: %.3f\n", run_s);
+  printf("requests: %llu\n", (unsigned long long)requests);
+  printf("requests_per_s: %.1f\n", requests / run_s);
+  printf("measurements_accepted: %llu\n",
+         (unsigned long long)measurements_accepted);
+  printf("measurements_per_s: %.1f\n", measurements_accepted / run_s);
+  for (uint8_t i = 0; i < num_request_kinds; i++) {
+    RequestStats &stats = request_stats[i];
+    const char *name = request_names[i];
+    printf("%s_requests: %llu\n", name,
+           (unsigned long long)stats.num_requests);
+    printf("%s_ok: %llu\n", name, (unsigned long long)stats.num_ok);
+    printf("%s_http_errors: %llu\n", name,
+           (unsigned long long)stats.num_http_errors);
+    printf("%s_failures: %llu\n", name,
+           (unsigned long long)stats.num_failures);
+    printf("%s_error_rate: %.4f\n", name,
+           stats.num_requests ? (double)(stats.num_requests - stats.num_ok) /
+                                    stats.num_requests
+                              : 0.0);
+    printf("%s_bytes_per_request: %.1f\n", name,
+           stats.num_requests ? (double)stats.bytes_sent / stats.num_requests
+                              : 0.0);
+    printf("%s_p50_ms: %.2f\n", name, percentile(stats.latency_us, 0.5) / 1e3);
+    printf("%s_p90_ms: %.2f\n", name, percentile(stats.latency_us, 0.9) / 1e3);
+    printf("%s_p99_ms: %.2f\n", name,
+           percentile(stats.latency_us, 0.99) / 1e3);
+    printf("%s_max_ms: %.2f\n", name, percentile(stats.latency_us, 1) / 1e3);
+  }
+  for (uint8_t i = 1; i < 6; i++) {
+    printf("http_%uxx: %llu\n", i, (unsigned long long)status_classes[i]);
+  }
+  printf("connects: %llu\n", (unsigned long long)num_connects);
+  printf("reconnects: %llu\n", (unsigned long long)num_reconnects);
+  printf("connect_errors: %llu\n", (unsigned long long)num_connect_errors);
+  printf("timeouts: %llu\n", (unsigned long long)num_timeouts);
+  printf("resets: %llu\n", (unsigned long long)num_resets);
+  printf("max_in_flight: %u\n", max_in_flight);
+  printf("queue_wait_p99_ms: %.2f\n", percentile(queue_wait_us, 0.99) / 1e3);
+  printf("queue_wait_max_ms: %.2f\n", percentile(queue_wait_us, 1) / 1e3);
+}
+
+///// Setup
+bool parse_options(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *option = argv[i];
+    if (strcmp(option, "--close") == 0) {
+      options.close = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      return false;
+    }
+    const char *value = argv[++i];
+    uint32_t *number = nullptr;
+    if (strcmp(option, "--host") == 0) {
+      options.host = value;
+    } else if (strcmp(option, "--port") == 0) {
+      options.port = value;
+    } else if (strcmp(option, "--p1-fraction") == 0) {
+      options.p1_fraction = atof(value);
+    } else if (strcmp(option, "--stations") == 0) {
+      number = &options.num_stations;
+    } else if (strcmp(option, "--duration-s") == 0) {
+      number = &options.duration_s;
+    } else if (strcmp(option, "--ramp-s") == 0) {
+      number = &options.ramp_s;
+    } else if (strcmp(option, "--send-interval-s") == 0) {
+      number = &options.send_interval_s;
+    } else if (strcmp(option, "--p1-interval-s") == 0) {
+      number = &options.p1_interval_s;
+    } else if (strcmp(option, "--max-in-flight") == 0) {
+      number = &options.max_in_flight;
+    } else if (strcmp(option, "--timeout-ms") == 0) {
+      number = &options.timeout_ms;
+    } else if (strcmp(option, "--report-s") == 0) {
+      number = &options.report_s;
+    } else {
+      return false;
+    }
+    if (number != nullptr) {
+      *number = strtoul(value, nullptr, 10);
+    }
+  }
+  return options.num_stations > 0 && options.send_interval_s > 0 &&
+         options.p1_interval_s > 0 && options.max_in_flight > 0;
+}
+
+bool resolve_server() {
+  addrinfo hints = {}, *result;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(options.host, options.port, &hints, &result) != 0) {
+    return false;
+  }
+  memcpy(&server_address, result->ai_addr, result->ai_addrlen);
+  server_address_length = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+// One descriptor per station and a few spare
+void raise_fd_limit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = min<rlim_t>(limit.rlim_max, options.num_stations + 64);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (!parse_options(argc, argv)) {
+    fprintf(stderr,
+            "usage: %s [--host H] [--port N] [--stations N] [--duration-s N] "
+            "[--ramp-s N] [--send-interval-s N] [--p1-fraction F] "
+            "[--p1-interval-s N] [--max-in-flight N] [--timeout-ms N] "
+            "[--report-s N] [--close]\n",
+            argv[0]);
+    return 2;
+  }
+  if (!resolve_server()) {
+    fprintf(stderr, "Can't resolve %s:%s\n", options.host, options.port);
+    return 2;
+  }
+  raise_fd_limit();
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  start_time = Clock::now();
+  stations.resize(options.num_stations);
+  for (uint32_t i = 0; i < options.num_stations; i++) {
+    stations[i].index = i;
+    setup_station(stations[i]);
+    schedule(stations[i],
+             (uint64_t)options.ramp_s * 1000000 * i / options.num_stations);
+  }
+
+  const uint64_t end_us = (uint64_t)options.duration_s * 1000000;
+  uint64_t last_timeout_check_us = 0;
+  epoll_event events[256];
+  while (true) {
+    uint64_t now = now_us();
+    while (!actions.empty() && actions.top().first <= now && now < end_us) {
+      const Action action = actions.top();
+      actions.pop();
+      run_station(stations[action.second], action.first);
+    }
+    // After the end, only the requests in flight are waited for
+    if (now >= end_us && num_in_flight == 0) {
+      break;
+    }
+    if (now >= end_us + options.timeout_ms * 1000ull) {
+      break;
+    }
+
+    int timeout_ms = 10;
+    if (!actions.empty() && actions.top().first > now) {
+      timeout_ms = min<uint64_t>(10, (actions.top().first - now) / 1000);
+    }
+    const int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int i = 0; i < n; i++) {
+      on_event(events[i].data.fd, events[i].events);
+    }
+
+    now = now_us();
+    if (now - last_timeout_check_us > 100000) {
+      check_timeouts();
+      last_timeout_check_us = now;
+    }
+    if (options.report_s > 0 &&
+        now - last_report_us >= options.report_s * 1000000ull) {
+      print_progress();
+    }
+  }
+
+  print_report(now_us() / 1e6);
+  uint32_t num_failures = 0;
+  if (measurements_accepted == 0) {
+    printf("FAIL no measurements were accepted\n");
+    num_failures++;
+  }
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+// libFuzzer target: the P1 port of a station.
+//
+// The input is what the meter writes to the UART. It goes through the receive
+// ring into P1Sensor::measure(), like on the station: the telegram parser, the
+// OBIS decoding, the report intervals and the queued frames. Each input gets
+// a new P1Sensor, so runs don't depend on each other.
+//
+//   clang++ -std=gnu++11 -g -O1 -fsanitize=fuzzer,address,undefined
+//     -Ihost/sim -Ihost -Iinclude -I<ArduinoJson>/src -I<CircularBuffer>
+//     -DARDUINOJSON_ENABLE_ARDUINO_STRING=1 -DNUM_SENSORS=5
+//     host/fuzz/fuzz_p1.cpp -o fuzz_p1
+//   ./fuzz_p1 -dict=host/fuzz/p1.dict fuzz_corpus host/fuzz/corpus/p1
+//     host/corpus
+//
+// pio run -e native_fuzz_p1 -t exec replays the seed corpus instead, with
+// host/fuzz/replay_main.cpp and the sanitizers of gcc.
+#include "fuzz_world.h"
+
+#include "P1Sensor.h"
+
+// Replayed by replay_main.cpp when it is given no inputs
+extern const char *const fuzz_seed_dirs[] = {"host/fuzz/corpus/p1",
+                                             "host/corpus", nullptr};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // The UART and its receive ring, once
+  static const bool is_setup = p1_sensor.setup();
+  P1Sensor sensor("P1", 0.2, 0, 0);
+
+  // Fill the ring up to its size at a time, as the loop reads it
+  for (size_t pos = 0; pos < size;) {
+    const size_t end = min(size, pos + P1_RX_BUFFER_SIZE - 1);
+    for (; pos < end; pos++) {
+      Serial.sim_receive(data[pos]);
+    }
+    sensor.measure();
+    fuzz_now_us += 1000000;
+  }
+  (void)is_setup;
+  return 0;
+}
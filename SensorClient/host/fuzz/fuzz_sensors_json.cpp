@@ -0,0 +1,49 @@
+// libFuzzer target: the GET sensors response read by setup_sensors().
+//
+// The input is the response body. It is copied into http_body, parsed in
+// place into a document of the capacity setup_sensors() uses and handed to
+// the parse_json() of all the sensors through parse_sensors_json(), so a
+// response of any shape must leave the station running.
+//
+//   clang++ -std=gnu++11 -g -O1 -fsanitize=fuzzer,address,undefined
+//     -Ihost/sim -Ihost -Iinclude -I<ArduinoJson>/src -I<CircularBuffer>
+//     -DARDUINOJSON_ENABLE_ARDUINO_STRING=1 -DNUM_SENSORS=5
+//     host/fuzz/fuzz_sensors_json.cpp -o fuzz_sensors_json
+//   ./fuzz_sensors_json -dict=host/fuzz/sensors_json.dict
+//     fuzz_corpus host/fuzz/corpus/sensors_json
+//
+// pio run -e native_fuzz_json -t exec replays the seed corpus instead, with
+// host/fuzz/replay_main.cpp and the sanitizers of gcc.
+#include "fuzz_world.h"
+
+#include "AM2320Sensor.h"
+#include "CCS811Sensor.h"
+#include "HDC1080Sensor.h"
+#include "HP303BSensor.h"
+#include "P1Sensor.h"
+#include "rest_json.h"
+
+Sensor *const sensors[] = {&am2320_sensor, &ccs811_sensor, &hdc1080_sensor,
+                           &hp303b_sensor, &p1_sensor};
+const uint8_t num_sensors = sizeof(sensors) / sizeof(sensors[0]);
+
+// Replayed by replay_main.cpp when it is given no inputs
+extern const char *const fuzz_seed_dirs[] = {"host/fuzz/corpus/sensors_json",
+                                             nullptr};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // read_body() turns away the responses that don't fit
+  if (size >= sizeof(http_body)) {
+    return 0;
+  }
+  memcpy(http_body, data, size);
+  http_body[size] = '\0';
+
+  ArenaJsonDocument sensors_json_response(
+      sensors_response_capacity(sensors, num_sensors));
+
+  deserializeJson(sensors_json_response, http_body, size);
+  parse_sensors_json(sensors_json_response.as<JsonArray>(), sensors,
+                     num_sensors);
+  return 0;
+}
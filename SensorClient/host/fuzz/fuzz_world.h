@@ -0,0 +1,49 @@
+#pragma once
+
+// An inert world for the host programs that build the sensor headers against
+// the stand-in libraries of host/sim: the fuzz targets, the I2C tests and the
+// fleet load generator. The clock only moves when the station code waits, no
+// I2C device answers, serial output is dropped and the heap is never short.
+// Include in exactly one translation unit.
+#include "Arduino.h"
+#include "LittleFS.h"
+#include "Wire.h"
+#include "ezTime.h"
+#include "sim.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+FS LittleFS;
+TwoWire Wire;
+Timezone UTC;
+Timezone *defaultTZ = &UTC;
+uint32_t sim_uart_conf0[2];
+
+uint64_t fuzz_now_us = 0;
+
+uint64_t sim_now_us() { return fuzz_now_us; }
+void sim_advance_us(uint64_t us) { fuzz_now_us += us; }
+uint32_t sim_epoch() { return sim_start_epoch + fuzz_now_us / 1000000; }
+
+bool sim_i2c_write(uint8_t address, const uint8_t *data, size_t len) {
+  return false;
+}
+size_t sim_i2c_read(uint8_t address, uint8_t *data, size_t len) { return 0; }
+
+bool sim_ccs811_read(uint16_t *eco2, uint16_t *etvoc, uint16_t *raw) {
+  return false;
+}
+bool sim_ccs811_set_baseline(uint16_t baseline) { return false; }
+uint16_t sim_ccs811_baseline() { return 0; }
+
+SimHttpResponse sim_http_request(const char *method, const char *uri,
+                                 const uint8_t *payload, size_t size) {
+  return {-1, nullptr, nullptr};
+}
+
+void sim_serial_write(const uint8_t *data, size_t len) {}
+
+uint32_t sim_free_heap() { return 40 * 1024; }
+
+// A restart is a crash loop on the station
+[[noreturn]] void sim_restart() { abort(); }
@@ -0,0 +1,84 @@
+// Runs a fuzz target over files and directories of inputs, for compilers
+// without libFuzzer, by default over the seed corpus of the target. Prints the
+// number of inputs, a crash is reported by the sanitizers the target is built
+// with.
+//
+//   g++ -fsanitize=address,undefined ... host/fuzz/fuzz_p1.cpp
+//     host/fuzz/replay_main.cpp -o replay_p1
+//   ./replay_p1 host/fuzz/corpus/p1 host/corpus
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern const char *const fuzz_seed_dirs[];
+
+uint32_t num_inputs = 0;
+
+bool run_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + length);
+  }
+  fclose(file);
+  // A copy of exactly the input's size, so reads past it are caught
+  uint8_t *input = new uint8_t[data.size()];
+  memcpy(input, data.data(), data.size());
+  LLVMFuzzerTestOneInput(input, data.size());
+  delete[] input;
+  num_inputs++;
+  return true;
+}
+
+bool run_path(const char *path) {
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    return false;
+  }
+  if (!S_ISDIR(info.st_mode)) {
+    return run_file(path);
+  }
+  DIR *dir = opendir(path);
+  if (dir == nullptr) {
+    return false;
+  }
+  bool ok = true;
+  while (const dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
+    ok = run_file(file_path) && ok;
+  }
+  closedir(dir);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  uint32_t num_failures = 0;
+  std::vector<const char *> paths(argv + 1, argv + argc);
+  if (paths.empty()) {
+    for (const char *const *dir = fuzz_seed_dirs; *dir != nullptr; dir++) {
+      paths.push_back(*dir);
+    }
+  }
+  for (const char *path : paths) {
+    if (!run_path(path)) {
+      printf("FAIL %s: can't read\n", path);
+      num_failures++;
+    }
+  }
+  printf("inputs: %u\n", num_inputs);
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// Scripted I2C bus for the host tests of the sensor drivers. A script lists
+// the transactions a driver must make, in order: the bytes it writes or the
+// bytes a read returns, and whether the device acknowledges. Each transaction
+// is checked against the next step of the script and its time is kept, so a
+// test can check the delays between the phases of a read too.
+#include "i2c_scheduler.h"
+
+enum class I2COp : uint8_t { write, read };
+
+typedef struct {
+  I2COp op;
+  uint8_t address;
+  uint8_t len;
+  bool ack;
+  uint8_t data[24];
+} I2CStep;
+
+class MockI2CBus : public I2CBus {
+public:
+  static const uint8_t max_steps = 64;
+
+  void play(const I2CStep *steps, uint8_t num_steps) {
+    this->steps = steps;
+    this->num_steps = num_steps < max_steps ? num_steps : max_steps;
+    position = 0;
+    mismatch = -1;
+  }
+
+  bool write(uint8_t address, const uint8_t *data, uint8_t len) {
+    const I2CStep *step = next(I2COp::write, address, len);
+    if (step == nullptr) {
+      return false;
+    }
+    if (len > 0 && memcmp(step->data, data, len) != 0) {
+      mismatch = position - 1;
+      return false;
+    }
+    return step->ack;
+  }
+
+  bool read(uint8_t address, uint8_t *data, uint8_t len) {
+    const I2CStep *step = next(I2COp::read, address, len);
+    if (step == nullptr || !step->ack) {
+      return false;
+    }
+    memcpy(data, step->data, len);
+    return true;
+  }
+
+  // All the steps were played, as the script says
+  bool finished() const { return position == num_steps && mismatch < 0; }
+
+  uint8_t position = 0;
+  // Index of the first transaction that didn't match its step, -1 if none
+  int16_t mismatch = -1;
+  // millis() of each transaction
+  uint32_t step_ms[max_steps];
+
+private:
+  const I2CStep *steps = nullptr;
+  uint8_t num_steps = 0;
+
+  const I2CStep *next(I2COp op, uint8_t address, uint8_t len) {
+    if (position == num_steps) {
+      if (mismatch < 0) {
+        mismatch = position;
+      }
+      return nullptr;
+    }
+    const I2CStep &step = steps[position];
+    step_ms[position++] = millis();
+    if (step.op != op || step.address != address || step.len != len) {
+      if (mismatch < 0) {
+        mismatch = position - 1;
+      }
+      return nullptr;
+    }
+    return &step;
+  }
+};
@@ -0,0 +1,354 @@
+// Host tests of the I2C scheduler and the sensor drivers.
+//
+// The drivers run against MockI2CBus, which replays the register traffic of
+// the devices recorded in the scripts below and checks every transaction the
+// driver makes, with the inert world of the fuzz targets around them. The
+// clock advances 100 us per scheduler update, so the delays between the
+// phases of a read are checked to the ms.
+//
+//   pio run -e native_i2c -t exec
+//   g++ -std=gnu++11 -Ihost/sim -Ihost -Iinclude -I<ArduinoJson>/src
+//     -I<CircularBuffer> host/i2c_replay.cpp
+//
+// Results are printed as "key: value" lines. Exits with 1 if a check fails.
+#include "fuzz/fuzz_world.h"
+
+#include "AM2320Sensor.h"
+#include "CCS811Sensor.h"
+#include "HP303BSensor.h"
+#include "i2c_mock.h"
+#include <initializer_list>
+
+uint32_t num_failures = 0;
+
+void check(bool ok, const char *what, const char *context) {
+  if (!ok) {
+    printf("FAIL %s: %s\n", context, what);
+    num_failures++;
+  }
+}
+
+void check_script(const MockI2CBus &bus, const char *context) {
+  if (!bus.finished()) {
+    printf("FAIL %s: transaction %d of %u doesn't follow the script\n",
+           context, bus.mismatch, bus.position);
+    num_failures++;
+  }
+}
+
+// Update the scheduler for duration_ms
+void run(I2CScheduler &scheduler, uint32_t duration_ms) {
+  const uint64_t end_us = sim_now_us() + (uint64_t)duration_ms * 1000;
+  while (sim_now_us() < end_us) {
+    scheduler.update();
+    sim_advance_us(100);
+  }
+}
+
+// The newest frame of sensor_buffer, false if it is empty
+bool newest_frame(SensorFrame &frame) {
+  for (uint16_t pos = 0; pos < sensor_buffer.end();) {
+    pos = sensor_buffer.read(pos, frame);
+  }
+  return !sensor_buffer.isEmpty();
+}
+
+// Scripts built step by step
+I2CStep script[MockI2CBus::max_steps];
+uint8_t script_length = 0;
+
+void expect(I2COp op, uint8_t address, std::initializer_list<uint8_t> data,
+            bool ack = true) {
+  I2CStep &step = script[script_length++];
+  step = {op, address, (uint8_t)data.size(), ack, {}};
+  memcpy(step.data, data.begin(), data.size());
+}
+
+void expect_read_register(uint8_t address, uint8_t reg,
+                          std::initializer_list<uint8_t> data) {
+  expect(I2COp::write, address, {reg});
+  expect(I2COp::read, address, data);
+}
+
+void play_script(MockI2CBus &bus) {
+  bus.play(script, script_length);
+  script_length = 0;
+}
+
+///// Scheduler
+// Starts a conversion with a write and reads its 2 byte result
+class TestDevice : public I2CDevice {
+public:
+  TestDevice(const char *name, uint8_t address, uint32_t conversion_ms,
+             I2CBus &bus)
+      : I2CDevice(name, bus), address{address}, conversion_ms{conversion_ms} {}
+
+  uint32_t trigger() {
+    const uint8_t start = 0x01;
+    bus.write(address, &start, 1);
+    return conversion_ms;
+  }
+
+  uint32_t collect() {
+    uint8_t result[2];
+    bus.read(address, result, sizeof(result));
+    return i2c_done;
+  }
+
+private:
+  uint8_t address;
+  uint32_t conversion_ms;
+};
+
+void check_scheduler() {
+  MockI2CBus bus;
+  TestDevice slow("slow", 0x10, 5, bus), fast("fast", 0x20, 2, bus);
+  I2CScheduler scheduler;
+  scheduler.add(&slow);
+  scheduler.add(&fast);
+  scheduler.add(&slow);
+
+  // Both are triggered before any is collected, the fast one is collected
+  // first
+  const I2CStep steps[] = {
+      {I2COp::write, 0x10, 1, true, {0x01}},
+      {I2COp::write, 0x20, 1, true, {0x01}},
+      {I2COp::read, 0x20, 2, true, {0x12, 0x34}},
+      {I2COp::read, 0x10, 2, true, {0x56, 0x78}},
+  };
+  bus.play(steps, 4);
+  check(scheduler.request(&slow) && scheduler.request(&fast), "request",
+        "scheduler");
+  check(!scheduler.request(&slow), "second request while busy", "scheduler");
+  scheduler.update();
+  check(bus.position == 1, "more than one phase per update", "scheduler");
+  run(scheduler, 20);
+
+  check_script(bus, "scheduler");
+  check(bus.step_ms[2] - bus.step_ms[1] == 2, "fast conversion time",
+        "scheduler");
+  check(bus.step_ms[3] - bus.step_ms[0] == 5, "slow conversion time",
+        "scheduler");
+  check(slow.state == I2CDevice::idle && fast.state == I2CDevice::idle,
+        "devices left busy", "scheduler");
+  check(slow.num_reads == 1 && fast.num_reads == 1, "reads", "scheduler");
+  check(scheduler.request(&slow), "request after the read", "scheduler");
+}
+
+///// AM2320
+// The sensor doesn't acknowledge the wake up call. The response of the read
+// command is the function code, the length, humidity and temperature (sign
+// and magnitude) in 0.1 units and the CRC-16/MODBUS, LSB first.
+const uint8_t am2320_address = 0x5C;
+const I2CStep am2320_wake = {I2COp::write, am2320_address, 0, false, {}};
+const I2CStep am2320_command = {
+    I2COp::write, am2320_address, 3, true, {0x03, 0x00, 0x04}};
+
+void check_am2320_read(const char *context, const I2CStep &response,
+                       bool valid) {
+  MockI2CBus bus;
+  AMS2320Sensor am2320("AM2320", 10, 0, 0, bus);
+  am2320.id = 1;
+  I2CScheduler scheduler;
+  scheduler.add(&am2320);
+
+  const I2CStep steps[] = {am2320_wake, am2320_command, response};
+  bus.play(steps, 3);
+  const uint16_t num_frames = sensor_buffer.size();
+  const uint8_t num_errors = num_measurement_errors;
+  scheduler.request(&am2320);
+  run(scheduler, 20);
+
+  check_script(bus, context);
+  check(bus.step_ms[1] - bus.step_ms[0] == 1, "wake up time", context);
+  check(bus.step_ms[2] - bus.step_ms[1] == 2, "read command time", context);
+  check(am2320.state == I2CDevice::idle, "read not finished", context);
+  if (!valid) {
+    check(sensor_buffer.size() == num_frames, "invalid read queued", context);
+    check(num_measurement_errors == num_errors + 1, "error not counted",
+          context);
+    return;
+  }
+  SensorFrame frame;
+  check(sensor_buffer.size() == num_frames + 1 && newest_frame(frame),
+        "no frame queued", context);
+  check(frame.sensor_id == 1 && frame.first_magnitude == 0 &&
+            frame.num_values == 2,
+        "frame header", context);
+  check(frame.values[0] == -5300, "temperature", context);
+  check(frame.values[1] == 55100, "humidity", context);
+}
+
+void check_am2320() {
+  // 55.1 %, -5.3 C
+  check_am2320_read(
+      "am2320",
+      {I2COp::read, am2320_address, 8, true,
+       {0x03, 0x04, 0x02, 0x27, 0x80, 0x35, 0xE1, 0x8C}},
+      true);
+  check_am2320_read(
+      "am2320 crc",
+      {I2COp::read, am2320_address, 8, true,
+       {0x03, 0x04, 0x02, 0x27, 0x80, 0x36, 0xE1, 0x8C}},
+      false);
+  // An exception response, with a valid CRC
+  check_am2320_read(
+      "am2320 function code",
+      {I2COp::read, am2320_address, 8, true,
+       {0x83, 0x04, 0x02, 0x27, 0x80, 0x35, 0xFE, 0x4C}},
+      false);
+  check_am2320_read("am2320 read nack",
+                    {I2COp::read, am2320_address, 8, false, {}}, false);
+
+  // A NACK of the read command ends the read without reading
+  MockI2CBus bus;
+  AMS2320Sensor am2320("AM2320", 10, 0, 0, bus);
+  I2CScheduler scheduler;
+  scheduler.add(&am2320);
+  I2CStep command_nack = am2320_command;
+  command_nack.ack = false;
+  const I2CStep steps[] = {am2320_wake, command_nack};
+  bus.play(steps, 2);
+  const uint8_t num_errors = num_measurement_errors;
+  scheduler.request(&am2320);
+  run(scheduler, 20);
+  check_script(bus, "am2320 command nack");
+  check(am2320.state == I2CDevice::idle, "read not finished",
+        "am2320 command nack");
+  check(num_measurement_errors == num_errors + 1, "error not counted",
+        "am2320 command nack");
+}
+
+///// HP303B
+// Coefficients c0 = 204, c1 = -261, c00 = 80469, c10 = -54769, c01 = -2422,
+// c11 = 1298, c20 = -10640, c21 = 225, c30 = -1393 and the FIFO results,
+// 24 bit two's complement with the LSB set for pressure.
+const uint8_t hp303b_address = 0x77;
+const uint8_t hp303b_fifo_reg = 0x00;
+#define HP303B_T1 0x25, 0x3B, 0x40 // 2440000, 21.02 C
+#define HP303B_T2 0x25, 0x62, 0x50 // 2450000, 20.69 C
+#define HP303B_P1 0xF9, 0xE5, 0x7F // -400001
+#define HP303B_P2 0xF9, 0xE1, 0x97 // -401001
+#define HP303B_EMPTY 0x80, 0x00, 0x00
+
+void expect_hp303b_setup() {
+  expect_read_register(hp303b_address, 0x0D, {0x10});
+  expect_read_register(hp303b_address, 0x08, {0xC0});
+  expect_read_register(hp303b_address, 0x10,
+                       {0x0C, 0xCE, 0xFB, 0x13, 0xA5, 0x5F, 0x2A, 0x0F, 0xF6,
+                        0x8A, 0x05, 0x12, 0xD6, 0x70, 0x00, 0xE1, 0xFA, 0x8F});
+  expect_read_register(hp303b_address, 0x28, {0x00});
+  expect(I2COp::write, hp303b_address, {0x0E, 0xA5});
+  expect(I2COp::write, hp303b_address, {0x0F, 0x96});
+  expect(I2COp::write, hp303b_address, {0x62, 0x02});
+  expect(I2COp::write, hp303b_address, {0x0E, 0x00});
+  expect(I2COp::write, hp303b_address, {0x0F, 0x00});
+  // 64x pressure, 8x temperature, P shift with the FIFO, flush, start
+  expect(I2COp::write, hp303b_address, {0x06, 0x06});
+  expect(I2COp::write, hp303b_address, {0x07, 0x03});
+  expect(I2COp::write, hp303b_address, {0x09, 0x06});
+  expect(I2COp::write, hp303b_address, {0x0C, 0x80});
+  expect(I2COp::write, hp303b_address, {0x08, 0x07});
+}
+
+void check_hp303b() {
+  MockI2CBus bus;
+  HP303BSensor hp303b("HP303B", 10, 0, 0, bus);
+  hp303b.id = 2;
+  expect_hp303b_setup();
+  play_script(bus);
+  check(hp303b.setup(), "setup", "hp303b setup");
+  check_script(bus, "hp303b setup");
+
+  // A pressure result before any temperature can't be compensated
+  const uint16_t num_frames = sensor_buffer.size();
+  const uint8_t num_errors = num_measurement_errors;
+  expect_read_register(hp303b_address, 0x0B, {0x00});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_P1});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_EMPTY});
+  play_script(bus);
+  hp303b.measure();
+  run(i2c_scheduler, 5);
+  check_script(bus, "hp303b first drain");
+  check(sensor_buffer.size() == num_frames, "pressure without temperature",
+        "hp303b first drain");
+  check(num_measurement_errors == num_errors + 1, "missing temperature",
+        "hp303b first drain");
+
+  // Each pressure result is compensated with the temperature before it, the
+  // frame has the averages
+  expect_read_register(hp303b_address, 0x0B, {0x00});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_T1});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_P1});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_T2});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_P2});
+  expect_read_register(hp303b_address, hp303b_fifo_reg, {HP303B_EMPTY});
+  play_script(bus);
+  hp303b.measure();
+  run(i2c_scheduler, 5);
+  check_script(bus, "hp303b drain");
+  SensorFrame frame;
+  check(sensor_buffer.size() == num_frames + 1 && newest_frame(frame),
+        "no frame queued", "hp303b drain");
+  check(frame.sensor_id == 2 && frame.first_magnitude == 0 &&
+            frame.num_values == 2,
+        "frame header", "hp303b drain");
+  // 20.8557 C and 99157.34 Pa in double precision
+  check(abs(frame.values[0] - 2086) <= 1, "temperature", "hp303b drain");
+  check(abs(frame.values[1] - 99157) <= 1, "pressure", "hp303b drain");
+  printf("hp303b_temperature: %d\n", frame.values[0]);
+  printf("hp303b_pressure: %d\n", frame.values[1]);
+}
+
+///// CCS811
+// Without the nINT pin the driver polls the STATUS register, the results are
+// read by the library once DATA_READY (0x08) is set.
+void check_ccs811() {
+  MockI2CBus bus;
+  CCS811Sensor ccs811("CCS811", 10, 0, 0, bus);
+  I2CScheduler scheduler;
+  scheduler.add(&ccs811);
+
+  for (uint8_t i = 0; i < 3; i++) {
+    expect_read_register(0x5A, 0x00, {0x90});
+  }
+  play_script(bus);
+  const uint16_t num_frames = sensor_buffer.size();
+  const uint8_t num_errors = num_measurement_errors;
+  scheduler.request(&ccs811);
+  run(scheduler, 250);
+  check_script(bus, "ccs811 status");
+  check(bus.step_ms[2] - bus.step_ms[0] == 100 &&
+            bus.step_ms[4] - bus.step_ms[2] == 100,
+        "poll period", "ccs811 status");
+  check(sensor_buffer.size() == num_frames &&
+            num_measurement_errors == num_errors,
+        "no data isn't an error", "ccs811 status");
+
+  // A STATUS read that isn't acknowledged ends the read as an error, the
+  // result isn't read with a stale status
+  MockI2CBus nack_bus;
+  CCS811Sensor nack_ccs811("CCS811", 10, 0, 0, nack_bus);
+  I2CScheduler nack_scheduler;
+  nack_scheduler.add(&nack_ccs811);
+  expect(I2COp::write, 0x5A, {0x00});
+  expect(I2COp::read, 0x5A, {0x98}, false);
+  play_script(nack_bus);
+  nack_scheduler.request(&nack_ccs811);
+  run(nack_scheduler, 250);
+  check_script(nack_bus, "ccs811 status nack");
+  check(sensor_buffer.size() == num_frames &&
+            num_measurement_errors == num_errors + 1,
+        "failed read isn't an error", "ccs811 status nack");
+}
+
+int main() {
+  check_scheduler();
+  check_am2320();
+  check_hp303b();
+  check_ccs811();
+
+  printf("frames: %u\n", sensor_buffer.size());
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,374 @@
+// Micro-benchmarks of the JSON paths of the measurement upload.
+//
+// Encodes batches of 1 to max_measurements_per_post measurements like
+// send_data(), with build_measurements_json() into the arena document and
+// serialize_body() into http_body, and with a direct encoder writing the same
+// body into a fixed buffer without a document. Decodes the GET sensors
+// response of 1 to 16 sensors like setup_sensors(), in place in http_body with
+// the arena document, and from a String that is copied into a heap document.
+// Every alternative is checked to give the same body or ids as the code of
+// the station.
+//
+//   pio run -e native_json -t exec
+//   .pio/build/native_json/program --baseline json_bench.txt
+//
+// Results are printed as "key: value" lines, one group per case, e.g.
+// encode_send_data_n32_ns_per_record. With --baseline FILE, a previous
+// output, a case fails if it now takes more bytes or allocations than there.
+// Times are only compared with --time-tolerance F, failing above the baseline
+// times 1 + F, as they vary a lot between runs on shared machines. Exits with
+// 1 if a check fails.
+#include "fuzz/fuzz_world.h"
+
+#include "alloc_stats.h"
+#include "common_sensor.h"
+#include "rest_json.h"
+#include <ArduinoJson.h>
+#include <chrono>
+#include <map>
+#include <string>
+
+uint32_t num_failures = 0;
+
+void check(bool ok, const char *what, const char *context) {
+  if (!ok) {
+    printf("FAIL %s: %s\n", context, what);
+    num_failures++;
+  }
+}
+
+///// Results
+std::map<std::string, double> baseline;
+double time_tolerance = -1; // Times not compared
+
+bool read_baseline(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    return false;
+  }
+  char line[256], key[128];
+  double value;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    if (sscanf(line, "%127[a-z0-9_]: %lf", key, &value) == 2) {
+      baseline[key] = value;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+// Print a result and compare it to the baseline. Bytes and allocations are
+// deterministic and may not grow, a decoder that read the response may not
+// start failing and times may vary by the tolerance.
+void result(const char *name, const char *metric, double value) {
+  char key[128];
+  snprintf(key, sizeof(key), "%s_%s", name, metric);
+  printf("%s: %.1f\n", key, value);
+  const auto base = baseline.find(key);
+  if (base == baseline.end()) {
+    return;
+  }
+  const bool is_time = strstr(metric, "ns_per") != nullptr;
+  if (is_time && time_tolerance < 0) {
+    return;
+  }
+  const bool is_ok = strcmp(metric, "ok") == 0;
+  const double limit =
+      is_time ? base->second * (1 + time_tolerance) : base->second + 0.05;
+  if (is_ok ? value < base->second : value > limit) {
+    printf("FAIL %s: %.1f, baseline %.1f\n", key, value, base->second);
+    num_failures++;
+  }
+}
+
+///// Timing
+typedef std::chrono::steady_clock Clock;
+
+// The time of a case is the best of a few windows, against the noise of the
+// other processes of a CI runner
+const double window_s = 0.02;
+const uint8_t num_windows = 5;
+
+struct Measurement {
+  double ns_per_run;
+  double allocs_per_run;
+  size_t peak_bytes;
+};
+
+// Runs the function repeatedly for num_windows windows. The allocations and
+// peak heap are those of a single run.
+template <typename Function> Measurement measure(Function run) {
+  Measurement measurement;
+  reset_alloc_peak();
+  const size_t base_bytes = alloc_stats.live_bytes;
+  const uint64_t base_allocs = alloc_stats.num_allocs;
+  run();
+  measurement.allocs_per_run = alloc_stats.num_allocs - base_allocs;
+  measurement.peak_bytes = alloc_stats.peak_bytes - base_bytes;
+
+  measurement.ns_per_run = 1e18;
+  for (uint8_t window = 0; window < num_windows; window++) {
+    uint32_t num_runs = 0;
+    const Clock::time_point start = Clock::now();
+    double elapsed_s;
+    do {
+      for (uint32_t i = 0; i < 16; i++) {
+        run();
+      }
+      num_runs += 16;
+      elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed_s < window_s);
+    measurement.ns_per_run =
+        min(measurement.ns_per_run, elapsed_s * 1e9 / num_runs);
+  }
+  return measurement;
+}
+
+void report(const char *name, const Measurement &measurement,
+            uint32_t num_records, size_t num_bytes) {
+  result(name, "ns_per_record", measurement.ns_per_run / num_records);
+  result(name, "bytes_per_record", (double)num_bytes / num_records);
+  result(name, "allocs_per_batch", measurement.allocs_per_run);
+  result(name, "peak_bytes", measurement.peak_bytes);
+}
+
+///// Measurement batches
+// Up to the largest batch of send_data()
+const uint16_t batch_sizes[] = {1,  2,  4,  8,
+                                16, 32, max_measurements_per_post};
+
+// Stand-in for the sensors list: frames of two magnitudes from sensors 1 to 4
+// with 1 to 3 decimals, and server ids as the sensors get them.
+uint8_t magnitude_decimals(uint8_t sensor_id, uint8_t index) {
+  return 1 + (sensor_id + index) % 3;
+}
+
+uint8_t magnitude_id(uint8_t sensor_id, uint8_t index) {
+  return 2 * sensor_id + index;
+}
+
+// As declared by the sensors with two magnitudes
+const size_t sensor_response_capacity =
+    JSON_ARRAY_SIZE(2) + JSON_OBJECT_SIZE(3) + 2 * JSON_OBJECT_SIZE(4);
+
+class BenchSensor : public Sensor {
+public:
+  BenchSensor(uint8_t sensor_id)
+      : Sensor("bench", 10, 0, sensor_response_capacity) {
+    id = sensor_id;
+  }
+
+  bool setup() { return true; }
+  void measure() {}
+  void setup_json(JsonObject &sensor_json) {}
+  bool parse_json(JsonObject &sensor_json_response) { return true; }
+  uint8_t magnitude_id(uint8_t index) { return ::magnitude_id(id, index); }
+  uint8_t magnitude_decimals(uint8_t index) {
+    return ::magnitude_decimals(id, index);
+  }
+};
+
+BenchSensor bench_sensor_1(1), bench_sensor_2(2), bench_sensor_3(3),
+    bench_sensor_4(4);
+Sensor *bench_sensors[] = {&bench_sensor_1, &bench_sensor_2, &bench_sensor_3,
+                           &bench_sensor_4};
+const uint8_t num_bench_sensors = 4;
+
+// Queue frames until the buffer holds num_measurements values
+void fill_buffer(uint16_t num_measurements) {
+  sensor_buffer.discard_until(sensor_buffer.end());
+  for (uint16_t i = 0; i < num_measurements; i += 2) {
+    SensorFrame frame = {};
+    frame.epoch = 1661083250 + i / 8 * 10;
+    frame.sensor_id = 1 + i / 2 % 4;
+    frame.num_values = min(2, num_measurements - i);
+    for (uint8_t j = 0; j < frame.num_values; j++) {
+      frame.values[j] =
+          to_fixed(21.5 + 0.37 * (i % 23) - 3.1 * j,
+                   magnitude_decimals(frame.sensor_id, j));
+    }
+    sensor_buffer.push(frame);
+  }
+}
+
+// The body of send_data(), built in the arena and serialized into http_body
+size_t encode_send_data() {
+  uint16_t num_measurements;
+  const uint16_t end_pos =
+      sensor_buffer.batch_end(max_measurements_per_post, num_measurements);
+
+  ArenaJsonDocument list_measurement(
+      measurements_json_capacity(num_measurements));
+  build_measurements_json(list_measurement, sensor_buffer, end_pos,
+                          bench_sensors, num_bench_sensors);
+  return serialize_body(list_measurement);
+}
+
+char direct_body[sizeof(http_body)];
+
+// The same body written straight into a buffer, without a document
+size_t encode_direct(char *body, size_t size) {
+  uint16_t num_measurements;
+  const uint16_t end_pos =
+      sensor_buffer.batch_end(max_measurements_per_post, num_measurements);
+
+  size_t length = 0;
+  body[length++] = '[';
+  SensorFrame frame;
+  char value[12];
+  for (uint16_t pos = 0; pos < end_pos;) {
+    pos = sensor_buffer.read(pos, frame);
+    for (uint8_t i = 0; i < frame.num_values; i++) {
+      const uint8_t magnitude = frame.first_magnitude + i;
+      format_fixed(frame.values[i],
+                   magnitude_decimals(frame.sensor_id, magnitude), value,
+                   sizeof(value));
+      length += snprintf(
+          body + length, size - length,
+          "%s{\"sensor_id\":%u,\"magnitude_id\":%u,\"timestamp\":%ld,"
+          "\"value\":\"%s\"}",
+          length > 1 ? "," : "", frame.sensor_id,
+          magnitude_id(frame.sensor_id, magnitude), (long)frame.epoch, value);
+    }
+  }
+  body[length++] = ']';
+  body[length] = '\0';
+  return length;
+}
+
+void benchmark_encoders() {
+  printf("max_measurements_per_post: %u\n", max_measurements_per_post);
+  char name[64];
+  std::string reference;
+  for (uint16_t num_measurements : batch_sizes) {
+    fill_buffer(num_measurements);
+
+    snprintf(name, sizeof(name), "encode_send_data_n%u", num_measurements);
+    size_t length = 0;
+    Measurement measurement = measure([&]() { length = encode_send_data(); });
+    report(name, measurement, num_measurements, length);
+    check(length > 0, "measurements don't fit", name);
+    reference.assign(http_body, length);
+
+    snprintf(name, sizeof(name), "encode_direct_n%u", num_measurements);
+    measurement = measure(
+        [&]() { length = encode_direct(direct_body, sizeof(direct_body)); });
+    report(name, measurement, num_measurements, length);
+    check(reference == direct_body, "body differs from send_data()", name);
+  }
+}
+
+///// Sensors response
+const uint8_t max_sensors = 16;
+const char *sensor_names[] = {"AM2320", "CCS811", "HDC1080", "HP303B"};
+const char *magnitude_names[][2] = {{"temperature", "humidity"},
+                                    {"eco2", "etvoc"},
+                                    {"temperature", "humidity"},
+                                    {"temperature", "pressure"}};
+const char *magnitude_units[][2] = {
+    {"C", "%"}, {"ppm", "ppb"}, {"C", "%"}, {"C", "Pa"}};
+
+// The body of GET /api/stations/{id}/sensors, as the rest_server sends it
+void sensors_response(uint8_t num_sensors, String &response) {
+  char sensor[256];
+  response = "[";
+  for (uint8_t i = 0; i < num_sensors; i++) {
+    const uint8_t kind = i % 4;
+    snprintf(sensor, sizeof(sensor),
+             "%s{\"name\":\"%s\",\"tag\":null,\"id\":%u,\"magnitudes\":["
+             "{\"name\":\"%s\",\"unit\":\"%s\",\"precision\":0.1,\"id\":%u},"
+             "{\"name\":\"%s\",\"unit\":\"%s\",\"precision\":0.1,\"id\":%u}]}",
+             i > 0 ? "," : "", sensor_names[kind], 1 + i,
+             magnitude_names[kind][0], magnitude_units[kind][0], 2 * i + 1,
+             magnitude_names[kind][1], magnitude_units[kind][1], 2 * i + 2);
+    response += sensor;
+  }
+  response += "]";
+}
+
+// Walks the response like parse_json() of the sensors, the sum of the ids
+// found or -1 if the document could not be read.
+int32_t parse_sensors(JsonDocument &sensors_json_response,
+                      DeserializationError error) {
+  if (error) {
+    return -1;
+  }
+  int32_t ids = 0;
+  for (JsonObject sensor_json : sensors_json_response.as<JsonArray>()) {
+    const char *name = sensor_json["name"] | "";
+    for (const char *sensor_name : sensor_names) {
+      if (strcmp(name, sensor_name) != 0) {
+        continue;
+      }
+      ids += sensor_json["id"].as<int32_t>();
+      for (JsonObject mag_json : sensor_json["magnitudes"].as<JsonArray>()) {
+        ids += mag_json["id"].as<int32_t>();
+      }
+      break;
+    }
+  }
+  return ids;
+}
+
+void benchmark_decoders() {
+  char name[64];
+  String response;
+  Sensor *response_sensors[max_sensors];
+  for (uint8_t i = 0; i < max_sensors; i++) {
+    response_sensors[i] = bench_sensors[i % num_bench_sensors];
+  }
+  for (uint8_t num_sensors = 1; num_sensors <= max_sensors; num_sensors *= 2) {
+    sensors_response(num_sensors, response);
+    const size_t response_capacity =
+        sensors_response_capacity(response_sensors, num_sensors);
+    // Sensor ids 1 to num_sensors, magnitude ids 1 to 2 * num_sensors
+    const int32_t expected_ids = num_sensors * (num_sensors + 1) / 2 +
+                                 num_sensors * (2 * num_sensors + 1);
+    check(response.length() < sizeof(http_body), "response doesn't fit",
+          "sensors_response");
+
+    // setup_sensors(): the body is read into http_body and parsed in place,
+    // the strings of the document point into it. It is read again before
+    // every run as the parser modifies it.
+    int32_t ids = 0;
+    snprintf(name, sizeof(name), "decode_setup_sensors_n%u", num_sensors);
+    Measurement measurement = measure([&]() {
+      memcpy(http_body, response.c_str(), response.length() + 1);
+      ArenaJsonDocument sensors_json_response(response_capacity);
+      ids = parse_sensors(sensors_json_response,
+                          deserializeJson(sensors_json_response, http_body,
+                                          response.length()));
+    });
+    report(name, measurement, num_sensors, response.length());
+    result(name, "ok", ids == expected_ids);
+
+    // A heap document read from the String, the strings are copied into it
+    snprintf(name, sizeof(name), "decode_copied_n%u", num_sensors);
+    measurement = measure([&]() {
+      DynamicJsonDocument sensors_json_response(response_capacity);
+      ids = parse_sensors(sensors_json_response,
+                          deserializeJson(sensors_json_response, response));
+    });
+    report(name, measurement, num_sensors, response.length());
+    result(name, "ok", ids == expected_ids);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--baseline") == 0) {
+      if (!read_baseline(argv[i + 1])) {
+        fprintf(stderr, "Can't read %s\n", argv[i + 1]);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--time-tolerance") == 0) {
+      time_tolerance = atof(argv[i + 1]);
+    }
+  }
+
+  benchmark_encoders();
+  benchmark_decoders();
+
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
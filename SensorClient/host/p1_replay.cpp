@@ -0,0 +1,552 @@
+// Replay and benchmark of the P1 decoding path on the host.
+//
+// Replays the recorded telegrams in host/corpus through P1Parser and the OBIS
+// dispatch of p1_data.h, the code P1Sensor runs on the station, and checks the
+// CRC verdicts and decoded values. Then measures the parse speed, the heap use
+// per telegram and the CRC table against the bitwise reference.
+//
+//   pio run -e native_p1 -t exec
+//   g++ -std=gnu++11 -O2 -Ihost/shim -Ihost -Iinclude host/p1_replay.cpp
+//
+// Results are printed as "key: value" lines. Exits with 1 if a check fails.
+#include "Arduino.h"
+#include "alloc_stats.h"
+#include "p1_data.h"
+#include "p1_parser.h"
+#include <chrono>
+#include <random>
+#include <vector>
+
+const char *corpus_dir = "host/corpus";
+uint32_t num_failures = 0;
+
+void check(bool ok, const char *what, const char *context) {
+  if (!ok) {
+    printf("FAIL %s: %s\n", context, what);
+    num_failures++;
+  }
+}
+
+bool read_file(const char *name, std::vector<char> &data) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", corpus_dir, name);
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  char chunk[512];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + length);
+  }
+  fclose(file);
+  return true;
+}
+
+///// Replay
+// Same handling of the parser events as P1Sensor::process_event()
+typedef struct {
+  uint32_t num_valid;
+  uint32_t num_invalid;
+  P1Data data;
+} ReplayResult;
+
+void replay(const char *data, size_t length, ReplayResult &result) {
+  P1Parser parser;
+  P1Data new_data = {};
+  result = {};
+  for (size_t i = 0; i < length; i++) {
+    switch (parser.feed(data[i])) {
+    case P1Event::none:
+      break;
+    case P1Event::line:
+      decode_p1_line(parser.line(), new_data, UINT32_MAX);
+      break;
+    case P1Event::valid_telegram:
+      result.num_valid++;
+      result.data = new_data;
+      break;
+    case P1Event::invalid_telegram:
+      result.num_invalid++;
+      new_data = result.data;
+      break;
+    }
+  }
+}
+
+typedef struct {
+  P1Field field;
+  int32_t value;
+} ExpectedValue;
+
+const uint8_t max_expected_values = 12;
+
+typedef struct {
+  const char *file;
+  uint32_t num_valid, num_invalid;
+  time_t timestamp, gas_timestamp;
+  uint8_t num_values;
+  ExpectedValue values[max_expected_values];
+} ReplayCase;
+
+const ReplayCase replay_cases[] = {
+    {"dsmr5_valid.txt",
+     1,
+     0,
+     1661104492,
+     1661101200,
+     12,
+     {{p1_consumption_1, 992992},
+      {p1_consumption_2, 1560157},
+      {p1_delivery_1, 560157},
+      {p1_delivery_2, 15001},
+      {p1_actual_tariff, 2},
+      {p1_actual_consumption, 378},
+      {p1_power_failures, 10},
+      {p1_long_power_failures, 3},
+      {p1_voltage_sags_l1, 2},
+      {p1_voltage_l1, 2310},
+      {p1_current_l1, 2},
+      {p1_gas_consumption, 8385402}}},
+    // Last second of summer time, gas captured in the repeated winter hour
+    {"dsmr5_three_phase_valid.txt",
+     1,
+     0,
+     1667091599,
+     1667091600,
+     12,
+     {{p1_consumption_1, 12345678},
+      {p1_delivery_2, 2345678},
+      {p1_actual_consumption, 3141},
+      {p1_voltage_sags_l3, 3},
+      {p1_voltage_swells_l2, 1},
+      {p1_voltage_l2, 2298},
+      {p1_voltage_l3, 2314},
+      {p1_current_l3, 6},
+      {p1_power_consumption_l1, 1102},
+      {p1_power_consumption_l2, 654},
+      {p1_power_consumption_l3, 1385},
+      {p1_gas_consumption, 4321009}}},
+    {"dsmr4_valid.txt",
+     1,
+     0,
+     1421517556,
+     1421514000,
+     10,
+     {{p1_consumption_1, 671578},
+      {p1_consumption_2, 842472},
+      {p1_delivery_1, 0},
+      {p1_actual_tariff, 1},
+      {p1_actual_consumption, 333},
+      {p1_power_failures, 8},
+      {p1_long_power_failures, 7},
+      {p1_current_l1, 1},
+      {p1_power_consumption_l1, 332},
+      {p1_gas_consumption, 473789}}},
+    {"dsmr5_corrupt_value.txt", 0, 1, 0, 0, 0, {}},
+    {"dsmr5_corrupt_crc.txt", 0, 1, 0, 0, 0, {}},
+    // The cut telegram is dropped when the next one starts
+    {"dsmr4_truncated.txt",
+     1,
+     0,
+     1421517556,
+     1421514000,
+     2,
+     {{p1_consumption_1, 671578}, {p1_gas_consumption, 473789}}},
+    // The values of the corrupt telegram must not leak into the last one
+    {"mixed_stream.txt",
+     2,
+     1,
+     1661104492,
+     1661101200,
+     2,
+     {{p1_consumption_1, 992992}, {p1_current_l1, 2}}},
+};
+
+void check_replay_cases() {
+  for (const ReplayCase &replay_case : replay_cases) {
+    std::vector<char> data;
+    if (!read_file(replay_case.file, data)) {
+      check(false, "can't read the file", replay_case.file);
+      continue;
+    }
+    ReplayResult result;
+    replay(data.data(), data.size(), result);
+
+    check(result.num_valid == replay_case.num_valid, "valid telegrams",
+          replay_case.file);
+    check(result.num_invalid == replay_case.num_invalid, "invalid telegrams",
+          replay_case.file);
+    if (replay_case.num_valid == 0) {
+      continue;
+    }
+    check(result.data.timestamp == replay_case.timestamp, "timestamp",
+          replay_case.file);
+    check(result.data.gas_timestamp == replay_case.gas_timestamp,
+          "gas timestamp", replay_case.file);
+    for (uint8_t i = 0; i < replay_case.num_values; i++) {
+      const ExpectedValue &expected = replay_case.values[i];
+      if (result.data.values[expected.field] != expected.value) {
+        printf("FAIL %s: %s is %d, expected %d\n", replay_case.file,
+               p1_magnitudes[expected.field].name,
+               result.data.values[expected.field], expected.value);
+        num_failures++;
+      }
+    }
+  }
+}
+
+///// OBIS codes
+// The OBIS code of a line, as the parser decodes it
+uint32_t parsed_obis(const char *code) {
+  P1Parser parser;
+  parser.feed('/');
+  parser.feed('\n');
+  for (const char *c = code; *c != '\0'; c++) {
+    parser.feed(*c);
+  }
+  for (const char *c = "(1)"; *c != '\0'; c++) {
+    parser.feed(*c);
+  }
+  return parser.feed('\n') == P1Event::line ? parser.line().obis : 0;
+}
+
+void check_obis() {
+  const struct {
+    const char *code;
+    uint32_t obis;
+  } cases[] = {
+      {"1-0:1.8.1", obis(1, 0, 1, 8, 1)},
+      {"0-1:24.2.1", obis(0, 1, 24, 2, 1)},
+      {"15-15:255.255.255", obis(15, 15, 255, 255, 255)},
+      // A and B don't fit in 4 bits
+      {"16-0:1.8.1", 0},
+      {"1-16:1.8.1", 0},
+      {"1-0:256.8.1", 0},
+      // Other separators, missing or extra groups
+      {"1.0:1.8.1", 0},
+      {"1-0.1.8.1", 0},
+      {"1-0:1:8.1", 0},
+      {"1-0:1.8-1", 0},
+      {"1 0 1 8 1", 0},
+      {"1-0:1.8", 0},
+      {"1-0:1.8.1.2", 0},
+      {"1-0:1.8.", 0},
+      {"1-0:.8.1", 0},
+      {"1-0:1.8.1x", 0},
+      {"", 0},
+  };
+  for (const auto &obis_case : cases) {
+    if (parsed_obis(obis_case.code) != obis_case.obis) {
+      printf("FAIL obis: %s is 0x%08X, expected 0x%08X\n", obis_case.code,
+             parsed_obis(obis_case.code), obis_case.obis);
+      num_failures++;
+    }
+  }
+}
+
+///// CRC
+uint16_t crc16_bitwise(uint16_t crc, char c) {
+  crc ^= (uint8_t)c;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+void check_crc() {
+  for (uint16_t crc = 0; crc < 256; crc++) {
+    for (uint16_t c = 0; c < 256; c++) {
+      const uint16_t start = crc * 257; // both bytes of the CRC vary
+      if (p1_crc16(start, c) != crc16_bitwise(start, c)) {
+        check(false, "table differs from the bitwise CRC", "crc");
+        return;
+      }
+    }
+  }
+}
+
+///// Fixed point values
+// Random values of up to 6 integer digits and 0 to 5 decimals, signed and
+// zero padded, parsed with 0 to 3 decimals. The reference works on the digits,
+// the double one only differs on exact ties, which strtod() may put just below
+// the half.
+void check_fixed_point_random() {
+  const uint32_t num_values = 2000000;
+  const uint32_t scales[] = {1, 10, 100, 1000};
+  std::mt19937 random(20210601);
+  uint32_t num_double_ties = 0;
+  char text[24], fraction[8];
+  int32_t value;
+  for (uint32_t i = 0; i < num_values; i++) {
+    const uint32_t integer = random() % 1000000;
+    const uint8_t num_fraction_digits = random() % 6;
+    const uint8_t decimals = random() % 4;
+    const bool negative = random() % 8 == 0;
+    for (uint8_t d = 0; d < num_fraction_digits; d++) {
+      fraction[d] = '0' + random() % 10;
+    }
+    fraction[num_fraction_digits] = '\0';
+    snprintf(text, sizeof(text), random() % 2 ? "%s%06u%s%s" : "%s%u%s%s",
+             negative ? "-" : "", integer, num_fraction_digits > 0 ? "." : "",
+             fraction);
+
+    int32_t expected = integer * scales[decimals];
+    for (uint8_t d = 0; d < decimals && d < num_fraction_digits; d++) {
+      expected += (fraction[d] - '0') * scales[decimals - 1 - d];
+    }
+    bool tie = false;
+    if (num_fraction_digits > decimals) {
+      expected += fraction[decimals] >= '5';
+      tie = fraction[decimals] == '5' &&
+            strspn(fraction + decimals + 1, "0") ==
+                strlen(fraction + decimals + 1);
+    }
+    expected = negative ? -expected : expected;
+    if (!parse_fixed(text, decimals, value) || value != expected) {
+      check(false, text, "fixed point random");
+      return;
+    }
+    if (value != lround(strtod(text, nullptr) * scales[decimals])) {
+      if (!tie) {
+        check(false, text, "fixed point random, double reference");
+        return;
+      }
+      num_double_ties++;
+    }
+  }
+  printf("fixed_point_random_values: %u\n", num_values);
+  printf("fixed_point_double_ties: %u\n", num_double_ties);
+}
+
+void check_fixed_point() {
+  char text[24];
+  int32_t value;
+  for (uint32_t integer = 0; integer < 1000000; integer += 997) {
+    for (uint32_t fraction = 0; fraction < 1000; fraction++) {
+      snprintf(text, sizeof(text), "%06u.%03u", integer, fraction);
+      if (!parse_fixed(text, 3, value) ||
+          value != (int32_t)(integer * 1000 + fraction) ||
+          value != lround(strtod(text, nullptr) * 1000)) {
+        check(false, text, "fixed point");
+        return;
+      }
+    }
+  }
+
+  check_fixed_point_random();
+
+  const struct {
+    const char *text;
+    uint8_t decimals;
+    bool ok;
+    int32_t value;
+  } cases[] = {
+      {"999999.999", 3, true, 999999999}, {"00.378", 3, true, 378},
+      {"230.1", 1, true, 2301},           {"002", 0, true, 2},
+      {"1.5", 0, true, 2},                {"1.25", 1, true, 13},
+      {"1.2", 3, true, 1200},             {"-0.5", 1, true, -5},
+      {"2147483.647", 3, true, INT32_MAX}, {"2147483.648", 3, false, 0},
+      {"", 3, false, 0},                  {".", 3, false, 0},
+      {"1.2.3", 3, false, 0},             {"12a", 3, false, 0},
+  };
+  for (const auto &c : cases) {
+    value = 0;
+    const bool ok = parse_fixed(c.text, c.decimals, value);
+    check(ok == c.ok && (!ok || value == c.value), c.text, "fixed point");
+  }
+}
+
+///// Timestamps
+void check_timestamps() {
+  char text[24];
+  time_t utc;
+  for (int year = 0; year < 100; year++) {
+    for (int day = 0; day < 366; day++) {
+      struct tm date = {};
+      date.tm_year = 100 + year;
+      date.tm_mday = 1 + day;
+      date.tm_hour = 13;
+      date.tm_min = 7;
+      date.tm_sec = 9;
+      const time_t expected = timegm(&date);
+      if (date.tm_year != 100 + year) {
+        break;
+      }
+      snprintf(text, sizeof(text), "%02d%02d%02d130709W", year,
+               date.tm_mon + 1, date.tm_mday);
+      if (!parse_p1_timestamp(text, utc) || utc != expected - 3600) {
+        check(false, text, "timestamp");
+        return;
+      }
+    }
+  }
+
+  // Both DST transitions of 2022 and malformed timestamps
+  const struct {
+    const char *text;
+    bool ok;
+    time_t utc;
+  } cases[] = {
+      {"220327015959W", true, 1648342799}, {"220327030000S", true, 1648342800},
+      {"221030025959S", true, 1667091599}, {"221030020000W", true, 1667091600},
+      {"221030025959W", true, 1667095199}, {"221030030000W", true, 1667095200},
+      {"2203270159", false, 0},            {"22032701595XW", false, 0},
+      {"221330000000W", false, 0},         {"220327015959X", false, 0},
+  };
+  for (const auto &c : cases) {
+    utc = 0;
+    const bool ok = parse_p1_timestamp(c.text, utc);
+    check(ok == c.ok && (!ok || utc == c.utc), c.text, "timestamp");
+  }
+}
+
+///// Report intervals
+void check_interval() {
+  P1Interval interval;
+  P1Data data = {};
+  P1Data report;
+  // One telegram per second from 12:00:50, the first report covers 10 s
+  for (uint32_t i = 0; i < 70; i++) {
+    data.timestamp = 1661083250 + i;
+    data.values[p1_consumption_1] = 1000 + i;
+    data.values[p1_actual_consumption] = 300 + (i % 7) * 100;
+    if (interval.ends_before(data.timestamp)) {
+      interval.report(report);
+      check(report.timestamp == data.timestamp - 1, "report timestamp",
+            "interval");
+      break;
+    }
+    interval.add(data);
+  }
+  check(report.values[p1_actual_consumption] == 540, "average power",
+        "interval");
+  check(report.values[p1_peak_consumption] == 900, "peak power", "interval");
+#ifdef P1_REPORT_DELTAS
+  check(report.values[p1_consumption_1] == 9, "energy delta", "interval");
+#else
+  check(report.values[p1_consumption_1] == 1009, "energy snapshot",
+        "interval");
+#endif
+}
+
+// Gas is captured every 5 minutes, only the reports with a new capture have
+// it and its delta is the one since the previous capture
+void check_gas_interval() {
+  P1Interval interval;
+  P1Data data = {};
+  P1Data report;
+  uint32_t num_gas_reports = 0, num_wrong_gas = 0;
+  for (uint32_t i = 0; i < 1200; i++) {
+    data.timestamp = 1661083200 + i;
+    if (i % 300 == 0) {
+      data.gas_timestamp = data.timestamp;
+      data.values[p1_gas_consumption] = 8385402 + i / 300 * 12;
+    }
+    if (interval.ends_before(data.timestamp)) {
+      interval.report(report);
+      if (interval.has_new_gas()) {
+        num_gas_reports++;
+#ifdef P1_REPORT_DELTAS
+        num_wrong_gas += report.values[p1_gas_consumption] != 12;
+#else
+        num_wrong_gas += report.values[p1_gas_consumption] !=
+                         data.values[p1_gas_consumption];
+#endif
+      }
+    }
+    interval.add(data);
+  }
+#ifdef P1_REPORT_DELTAS
+  // The capture of the first telegram has no delta
+  check(num_gas_reports == 3, "reports with new gas", "gas interval");
+#else
+  check(num_gas_reports == 4, "reports with new gas", "gas interval");
+#endif
+  check(num_wrong_gas == 0, "gas value", "gas interval");
+}
+
+///// Benchmarks
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void benchmark_replay() {
+  std::vector<char> stream;
+  const char *files[] = {"dsmr5_valid.txt", "dsmr5_three_phase_valid.txt",
+                         "dsmr4_valid.txt"};
+  for (const char *file : files) {
+    read_file(file, stream);
+  }
+
+  const uint32_t repetitions = 20000;
+  const uint32_t num_telegrams = repetitions * 3;
+  ReplayResult result;
+  uint32_t num_valid = 0;
+
+  reset_alloc_peak();
+  const size_t base_bytes = alloc_stats.live_bytes;
+  const uint64_t base_allocs = alloc_stats.num_allocs;
+  const Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < repetitions; i++) {
+    replay(stream.data(), stream.size(), result);
+    num_valid += result.num_valid;
+  }
+  const double elapsed_s = seconds_since(start);
+  // Read before any output, printf allocates the stdout buffer
+  const uint64_t num_allocs = alloc_stats.num_allocs - base_allocs;
+  const size_t peak_bytes = alloc_stats.peak_bytes - base_bytes;
+
+  check(num_valid == num_telegrams, "telegrams lost", "benchmark");
+  check(num_allocs == 0, "heap allocations while parsing", "benchmark");
+  printf("telegrams_per_s: %.0f\n", num_telegrams / elapsed_s);
+  printf("bytes_per_s: %.0f\n", repetitions * stream.size() / elapsed_s);
+  printf("allocs_per_telegram: %.3f\n", (double)num_allocs / num_telegrams);
+  printf("peak_heap_bytes: %zu\n", peak_bytes);
+}
+
+void benchmark_crc() {
+  std::vector<char> stream;
+  read_file("dsmr5_three_phase_valid.txt", stream);
+  const uint32_t repetitions = 50000;
+  const double megabytes = repetitions * stream.size() / 1e6;
+
+  uint16_t table_crc = 0, bitwise_crc = 0;
+  Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < repetitions; i++) {
+    for (char c : stream) {
+      table_crc = p1_crc16(table_crc, c);
+    }
+  }
+  printf("crc_table_mb_per_s: %.1f\n", megabytes / seconds_since(start));
+
+  start = Clock::now();
+  for (uint32_t i = 0; i < repetitions; i++) {
+    for (char c : stream) {
+      bitwise_crc = crc16_bitwise(bitwise_crc, c);
+    }
+  }
+  printf("crc_bitwise_mb_per_s: %.1f\n", megabytes / seconds_since(start));
+  check(table_crc == bitwise_crc, "table and bitwise CRC differ", "benchmark");
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    corpus_dir = argv[1];
+  }
+
+  check_replay_cases();
+  check_obis();
+  check_crc();
+  check_fixed_point();
+  check_timestamps();
+  check_interval();
+  check_gas_interval();
+  benchmark_replay();
+  benchmark_crc();
+
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// AM232X library stand-in for the host simulation. Only the identification
+// is read through the library, measurements go through the I2C bus.
+#include "Arduino.h"
+#include "Wire.h"
+
+class AM232X {
+public:
+  AM232X(TwoWire *wire = &Wire) {}
+  bool begin() { return true; }
+  bool isConnected(uint16_t timeout = 3000) { return true; }
+  int getModel() { return 2320; }
+  int getVersion() { return 3; }
+  uint32_t getDeviceID() { return 0x2320DD6C; }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+// Arduino core stand-in for the host simulation of a whole station. Time is
+// the simulated clock of sim.h, Serial is the UART shared with the P1 meter
+// and ESP reports the simulated heap.
+#include "../shim/Arduino.h"
+
+#include <cstdarg>
+#include <cstdlib>
+#include <functional>
+
+#include "sim.h"
+
+using std::abs;
+
+class __FlashStringHelper;
+#define F(string_literal)                                                      \
+  (reinterpret_cast<const __FlashStringHelper *>(PSTR(string_literal)))
+#define FPSTR(pstr) (reinterpret_cast<const __FlashStringHelper *>(pstr))
+#define pgm_read_ptr(addr) (*(const void *const *)(addr))
+#define pgm_read_float(addr) (*(const float *)(addr))
+#define strncpy_P strncpy
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+#include "Print.h"
+#include "WString.h"
+
+///// Time
+inline uint32_t millis() { return sim_now_us() / 1000; }
+inline uint32_t micros() { return sim_now_us(); }
+inline void delay(uint32_t ms) { sim_advance_us((uint64_t)ms * 1000); }
+inline void delayMicroseconds(uint32_t us) { sim_advance_us(us); }
+inline void yield() {}
+
+///// GPIO
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define LED_BUILTIN 2
+#define digitalPinToInterrupt(pin) (pin)
+
+inline uint8_t *sim_pins() {
+  static uint8_t pins[17] = {};
+  return pins;
+}
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+  sim_pins()[pin] = value;
+}
+inline int digitalRead(uint8_t pin) { return sim_pins()[pin]; }
+inline void attachInterrupt(uint8_t pin, void (*handler)(), int mode) {}
+
+///// UART
+// Only the RX inversion bit of the configuration register is used
+extern uint32_t sim_uart_conf0[2];
+#define UART0 0
+#define USC0(uart) (sim_uart_conf0[uart])
+#define UCRXI 19
+#define BIT(nr) (1UL << (nr))
+
+enum SerialConfig { SERIAL_8N1 = 0x1c };
+enum SerialMode { SERIAL_FULL, SERIAL_RX_ONLY, SERIAL_TX_ONLY };
+
+// The receive ring is allocated by begin() and resized by setRxBufferSize().
+// When it is full the oldest byte is overwritten and the overrun flag is set,
+// like the core's UART interrupt does.
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) { begin(baud, SERIAL_8N1, SERIAL_FULL); }
+  void begin(unsigned long baud, SerialConfig config, SerialMode mode) {
+    end();
+    rx_buffer = (uint8_t *)malloc(rx_size);
+    rx_read = rx_write = 0;
+    overrun = false;
+  }
+  void end() {
+    free(rx_buffer);
+    rx_buffer = nullptr;
+  }
+
+  size_t setRxBufferSize(size_t size) {
+    if (rx_buffer != nullptr) {
+      // Pending bytes are dropped, the simulation only resizes at setup
+      uint8_t *new_buffer = (uint8_t *)realloc(rx_buffer, size);
+      if (new_buffer == nullptr) {
+        return 0;
+      }
+      rx_buffer = new_buffer;
+      rx_read = rx_write = 0;
+    }
+    rx_size = size;
+    return size;
+  }
+
+  int available() {
+    if (rx_buffer == nullptr) {
+      return 0;
+    }
+    return (rx_write + rx_size - rx_read) % rx_size;
+  }
+  int peek() { return available() ? rx_buffer[rx_read] : -1; }
+  int read() {
+    if (!available()) {
+      return -1;
+    }
+    const uint8_t c = rx_buffer[rx_read];
+    rx_read = (rx_read + 1) % rx_size;
+    return c;
+  }
+  // Reads what is buffered, without waiting for the rest
+  size_t readBytes(char *buffer, size_t length) {
+    size_t n = 0;
+    while (n < length && available()) {
+      buffer[n++] = read();
+    }
+    return n;
+  }
+
+  bool hasOverrun() {
+    const bool had_overrun = overrun;
+    overrun = false;
+    return had_overrun;
+  }
+  bool hasRxError() { return false; }
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    sim_serial_write(buffer, size);
+    return size;
+  }
+  using Print::write;
+  void flush() {}
+  explicit operator bool() const { return true; }
+
+  // A byte from the line, called by the simulated world
+  void sim_receive(uint8_t c) {
+    if (rx_buffer == nullptr) {
+      return;
+    }
+    const size_t next = (rx_write + 1) % rx_size;
+    if (next == rx_read) {
+      overrun = true;
+      num_dropped++;
+      rx_read = (rx_read + 1) % rx_size;
+    }
+    rx_buffer[rx_write] = c;
+    rx_write = next;
+  }
+  uint32_t num_dropped = 0;
+
+private:
+  uint8_t *rx_buffer = nullptr;
+  size_t rx_size = 256;
+  size_t rx_read = 0, rx_write = 0;
+  bool overrun = false;
+};
+
+extern HardwareSerial Serial;
+
+///// ESP
+// A fixed heap is shared by the station code, the allocations of the
+// simulation itself are not counted. There is no fragmentation model.
+// Hardware random number register, fixed so two runs give the same report
+#define RANDOM_REG32 0x5EED5EEDu
+
+class EspClass {
+public:
+  [[noreturn]] void restart() { sim_restart(); }
+  [[noreturn]] void reset() { sim_restart(); }
+
+  uint32_t getFreeHeap() { return sim_free_heap(); }
+  uint16_t getMaxFreeBlockSize() { return min(sim_free_heap(), 0xFFFFu); }
+  uint8_t getHeapFragmentation() { return 0; }
+  void getHeapStats(uint32_t *free, uint16_t *max, uint8_t *frag) {
+    *free = getFreeHeap();
+    *max = getMaxFreeBlockSize();
+    *frag = getHeapFragmentation();
+  }
+
+  String getResetReason() { return "Power On"; }
+  uint32_t getChipId() { return 0xDD6C38; }
+  uint8_t getCpuFreqMHz() { return 80; }
+  uint32_t getCycleCount() { return sim_now_us() * 80; }
+  uint32_t getFlashChipRealSize() { return 4 * 1024 * 1024; }
+  uint32_t getSketchSize() { return 420 * 1024; }
+  uint32_t getFreeSketchSpace() { return 600 * 1024; }
+};
+
+extern EspClass ESP;
@@ -0,0 +1,36 @@
+#pragma once
+
+// OTA stand-in for the host simulation: handlers are kept, no update ever
+// arrives.
+#include "Arduino.h"
+
+typedef enum {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+} ota_error_t;
+
+class ArduinoOTAClass {
+public:
+  typedef std::function<void(void)> THandlerFunction;
+  typedef std::function<void(ota_error_t)> THandlerFunction_Error;
+  typedef std::function<void(unsigned int, unsigned int)>
+      THandlerFunction_Progress;
+
+  void onStart(THandlerFunction fn) { start_callback = fn; }
+  void onEnd(THandlerFunction fn) { end_callback = fn; }
+  void onError(THandlerFunction_Error fn) { error_callback = fn; }
+  void onProgress(THandlerFunction_Progress fn) { progress_callback = fn; }
+  void setHostname(const char *hostname) {}
+  void begin(bool use_mdns = true) {}
+  void handle() {}
+
+private:
+  THandlerFunction start_callback, end_callback;
+  THandlerFunction_Error error_callback;
+  THandlerFunction_Progress progress_callback;
+};
+
+extern ArduinoOTAClass ArduinoOTA;
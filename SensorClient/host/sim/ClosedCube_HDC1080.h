@@ -0,0 +1,30 @@
+#pragma once
+
+// ClosedCube HDC1080 library stand-in for the host simulation. Only the
+// identification is read through the library, measurements go through the
+// I2C bus.
+#include "Arduino.h"
+#include "Wire.h"
+
+typedef union {
+  uint8_t rawData[6];
+  struct {
+    uint16_t serialFirst;
+    uint16_t serialMid;
+    uint16_t serialLast;
+  };
+} HDC1080_SerialNumber;
+
+class ClosedCube_HDC1080 {
+public:
+  void begin(uint8_t address) {}
+  uint16_t readManufacturerId() { return 0x5449; }
+  uint16_t readDeviceId() { return 0x1050; }
+  HDC1080_SerialNumber readSerialNumber() {
+    HDC1080_SerialNumber serial;
+    serial.serialFirst = 0x12;
+    serial.serialMid = 0x3456;
+    serial.serialLast = 0x7890;
+    return serial;
+  }
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+// HTTP client stand-in for the host simulation. Requests go to the fake
+// rest_server in sim.cpp and block for its simulated latency. The station
+// side copies of URLs and headers are kept in Strings, as in the core's
+// client, so their allocations are counted: addHeader() builds each header
+// line in a temporary String and appends it, and every request builds its
+// header in a String reserved for it, with a Content-Length header when it
+// has a payload. The allocations of the client are also counted in
+// sim_allocs.
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+enum t_http_codes {
+  HTTP_CODE_OK = 200,
+  HTTP_CODE_CREATED = 201,
+  HTTP_CODE_NO_CONTENT = 204,
+  HTTP_CODE_NOT_MODIFIED = 304,
+  HTTP_CODE_BAD_REQUEST = 400,
+  HTTP_CODE_NOT_FOUND = 404,
+  HTTP_CODE_INTERNAL_SERVER_ERROR = 500,
+  HTTP_CODE_SERVICE_UNAVAILABLE = 503,
+};
+
+class HTTPClient {
+public:
+  bool begin(WiFiClient &client, const String &host, uint16_t port,
+             const String &uri = "/", bool https = false) {
+    const uint64_t before = sim_num_allocs();
+    this->client = &client;
+    this->host = host;
+    this->uri = uri;
+    sim_allocs += sim_num_allocs() - before;
+    return true;
+  }
+  void end() {
+    uri = "";
+    location = "";
+    headers = "";
+    body = nullptr;
+  }
+  void setTimeout(uint16_t timeout) {}
+  void setReuse(bool reuse) {}
+
+  void addHeader(const String &name, const String &value, bool first = false,
+                 bool replace = true) {
+    const uint64_t before = sim_num_allocs();
+    String header_line = name;
+    header_line += ": ";
+    if (replace) {
+      const int start = headers.indexOf(header_line);
+      if (start >= 0) {
+        const int end = headers.indexOf('\n', start);
+        headers = headers.substring(0, start) + headers.substring(end + 1);
+      }
+    }
+    header_line += value;
+    header_line += "\r\n";
+    if (first) {
+      headers = header_line + headers;
+    } else {
+      headers += header_line;
+    }
+    sim_allocs += sim_num_allocs() - before;
+  }
+  void collectHeaders(const char *header_keys[], const size_t count) {
+    collect_location = false;
+    for (size_t i = 0; i < count; i++) {
+      collect_location |= strcmp(header_keys[i], "Location") == 0;
+    }
+  }
+  String header(const char *name) {
+    return strcmp(name, "Location") == 0 ? location : String();
+  }
+
+  int GET() { return sendRequest("GET", nullptr, 0); }
+  int POST(const String &payload) {
+    return POST((const uint8_t *)payload.c_str(), payload.length());
+  }
+  int POST(const uint8_t *payload, size_t size) {
+    return sendRequest("POST", payload, size);
+  }
+  int PUT(const String &payload) {
+    return PUT((const uint8_t *)payload.c_str(), payload.length());
+  }
+  int PUT(const uint8_t *payload, size_t size) {
+    return sendRequest("PUT", payload, size);
+  }
+  int sendRequest(const char *method, const uint8_t *payload, size_t size) {
+    const uint64_t before = sim_num_allocs();
+    const uint64_t before_headers = sim_allocs;
+    if (payload != nullptr && size > 0) {
+      addHeader(F("Content-Length"), String((unsigned)size));
+    }
+    String header;
+    header.reserve(headers.length() + uri.length() + host.length() + 128);
+    header += method;
+    header += ' ';
+    header += uri;
+    header += F(" HTTP/1.1\r\nHost: ");
+    header += host;
+    header += F("\r\nUser-Agent: ESP8266HTTPClient\r\n"
+                "Connection: close\r\n");
+    header += headers;
+    header += "\r\n";
+    // addHeader() has counted its own already
+    sim_allocs = before_headers + (sim_num_allocs() - before);
+
+    const SimHttpResponse response =
+        sim_http_request(method, uri.c_str(), payload, size);
+    body = response.body;
+    client->sim_body = body;
+    if (collect_location) {
+      location = response.location;
+    }
+    return response.code;
+  }
+
+  // The body is only read into a String when it's asked for, as in the core
+  int getSize() { return body ? strlen(body) : -1; }
+  String getString() { return String(body); }
+  WiFiClient &getStream() { return *client; }
+
+  static String errorToString(int error) {
+    switch (error) {
+    case HTTPC_ERROR_CONNECTION_REFUSED:
+      return F("connection refused");
+    case HTTPC_ERROR_SEND_PAYLOAD_FAILED:
+      return F("send payload failed");
+    case HTTPC_ERROR_NOT_CONNECTED:
+      return F("not connected");
+    case HTTPC_ERROR_CONNECTION_LOST:
+      return F("connection lost");
+    case HTTPC_ERROR_READ_TIMEOUT:
+      return F("read Timeout");
+    default:
+      return String();
+    }
+  }
+
+  uint64_t sim_allocs = 0;
+
+private:
+  WiFiClient *client = nullptr;
+  String host, uri, location, headers;
+  const char *body = nullptr;
+  bool collect_location = false;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+// Wi-Fi stand-in for the host simulation: the station is always connected.
+#include "Arduino.h"
+
+enum WiFiMode_t { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA };
+enum wl_status_t { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 };
+
+class IPAddress {
+public:
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : octets{a, b, c, d} {}
+  String toString() const {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", octets[0], octets[1],
+             octets[2], octets[3]);
+    return buffer;
+  }
+
+private:
+  uint8_t octets[4];
+};
+
+class ESP8266WiFiClass {
+public:
+  wl_status_t begin(const char *ssid, const char *password) {
+    return WL_CONNECTED;
+  }
+  bool mode(WiFiMode_t mode) { return true; }
+  bool isConnected() { return true; }
+  wl_status_t status() { return WL_CONNECTED; }
+  int8_t waitForConnectResult() { return WL_CONNECTED; }
+  bool setAutoReconnect(bool autoReconnect) { return true; }
+  String macAddress() { return "5C:CF:7F:DD:6C:38"; }
+  String hostname() { return "ESP-DD6C38"; }
+  IPAddress localIP() { return IPAddress(192, 168, 1, 38); }
+};
+
+extern ESP8266WiFiClass WiFi;
+
+// The stream of an HTTP response, read from the body held by HTTPClient
+class WiFiClient {
+public:
+  size_t readBytes(char *buffer, size_t length) {
+    size_t read = 0;
+    for (; read < length && sim_body && sim_body[read] != '\0'; read++) {
+      buffer[read] = sim_body[read];
+    }
+    sim_body += read;
+    return read;
+  }
+
+  const char *sim_body = nullptr;
+};
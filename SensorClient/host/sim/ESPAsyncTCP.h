@@ -0,0 +1,3 @@
+#pragma once
+
+// The simulated web server doesn't need a TCP stack
@@ -0,0 +1,520 @@
+#pragma once
+
+// ESPAsyncWebServer stand-in for the host simulation. Handlers are registered
+// as on the device and run by AsyncWebServer::sim_request(), which the runner
+// calls between loop iterations where the real server would run them from the
+// TCP callbacks. Responses are built like the library does, a stream grows
+// its buffer by what doesn't fit and a chunked response is filled packet by
+// packet when it is sent, so their allocations are counted.
+#include "Arduino.h"
+#include "LittleFS.h"
+
+enum WebRequestMethod {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111,
+};
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebHeader {
+public:
+  AsyncWebHeader(const String &name, const String &value)
+      : name_{name}, value_{value} {}
+  const String &name() const { return name_; }
+  const String &value() const { return value_; }
+
+private:
+  String name_, value_;
+};
+
+// Up to max_headers headers, allocated like the library's list entries
+class AsyncWebHeaders {
+public:
+  ~AsyncWebHeaders() {
+    for (uint8_t i = 0; i < num_headers; i++) {
+      delete headers[i];
+    }
+  }
+  void add(const String &name, const String &value) {
+    if (num_headers < max_headers) {
+      headers[num_headers++] = new AsyncWebHeader(name, value);
+    }
+  }
+  AsyncWebHeader *get(const char *name) const {
+    for (uint8_t i = 0; i < num_headers; i++) {
+      if (strcasecmp(headers[i]->name().c_str(), name) == 0) {
+        return headers[i];
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  static const uint8_t max_headers = 8;
+  AsyncWebHeader *headers[max_headers];
+  uint8_t num_headers = 0;
+};
+
+class AsyncWebServerResponse {
+public:
+  AsyncWebServerResponse(int code, const String &content_type)
+      : code_{code}, content_type_{content_type} {}
+  virtual ~AsyncWebServerResponse() {}
+
+  void addHeader(const String &name, const String &value) {
+    headers.add(name, value);
+  }
+
+  int code() const { return code_; }
+  const String &contentType() const { return content_type_; }
+  AsyncWebHeader *header(const char *name) const { return headers.get(name); }
+  virtual size_t contentLength() const = 0;
+  // Called when the response is sent
+  virtual void sim_send() {}
+
+private:
+  int code_;
+  String content_type_;
+  AsyncWebHeaders headers;
+};
+
+class AsyncBasicResponse : public AsyncWebServerResponse {
+public:
+  AsyncBasicResponse(int code, const String &content_type,
+                     const String &content)
+      : AsyncWebServerResponse(code, content_type), content{content} {}
+  size_t contentLength() const { return content.length(); }
+
+private:
+  String content;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+public:
+  AsyncResponseStream(const String &content_type, size_t buffer_size)
+      : AsyncWebServerResponse(200, content_type),
+        buffer{(uint8_t *)malloc(buffer_size)}, capacity{buffer_size} {}
+  ~AsyncResponseStream() { free(buffer); }
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *data, size_t size) {
+    if (size > capacity - length) {
+      uint8_t *new_buffer = (uint8_t *)realloc(buffer, length + size);
+      if (new_buffer == nullptr) {
+        return 0;
+      }
+      buffer = new_buffer;
+      capacity = length + size;
+    }
+    memcpy(buffer + length, data, size);
+    length += size;
+    return size;
+  }
+  using Print::write;
+
+  size_t contentLength() const { return length; }
+  const uint8_t *content() const { return buffer; }
+
+private:
+  uint8_t *buffer;
+  size_t capacity, length = 0;
+};
+
+// Serves path, or its gzipped version when only that one exists
+class AsyncFileResponse : public AsyncWebServerResponse {
+public:
+  AsyncFileResponse(FS &fs, const String &path, const String &content_type)
+      : AsyncWebServerResponse(200, content_type) {
+    if (fs.exists(path)) {
+      file = fs.open(path, "r");
+    } else {
+      file = fs.open(path + ".gz", "r");
+      addHeader("Content-Encoding", "gzip");
+    }
+  }
+  size_t contentLength() const { return file.size(); }
+
+private:
+  File file;
+};
+
+typedef std::function<size_t(uint8_t *buffer, size_t max_len, size_t index)>
+    AwsResponseFiller;
+
+// Filled into a TCP packet sized buffer until the filler returns 0, the last
+// bytes sent are kept. The runner can have the whole content copied to a
+// buffer of its own with sim_capture().
+class AsyncChunkedResponse : public AsyncWebServerResponse {
+public:
+  static const size_t packet_size = 1460;
+
+  typedef struct {
+    char *buffer;
+    size_t size;
+  } Capture;
+  static Capture &sim_capture() {
+    static Capture capture = {nullptr, 0};
+    return capture;
+  }
+
+  AsyncChunkedResponse(const String &content_type, AwsResponseFiller filler)
+      : AsyncWebServerResponse(200, content_type), filler{filler} {}
+
+  void sim_send() {
+    uint8_t *buffer = (uint8_t *)malloc(packet_size);
+    size_t n;
+    Capture &capture = sim_capture();
+    while ((n = filler(buffer, packet_size, length)) > 0) {
+      if (length + n < capture.size) {
+        memcpy(capture.buffer + length, buffer, n);
+        capture.buffer[length + n] = '\0';
+      }
+      length += n;
+      const size_t kept = min(n, sizeof(tail) - 1);
+      memmove(tail, tail + kept, sizeof(tail) - 1 - kept);
+      memcpy(tail + sizeof(tail) - 1 - kept, buffer + n - kept, kept);
+    }
+    free(buffer);
+  }
+  size_t contentLength() const { return length; }
+  // Up to the last 31 bytes of the content
+  const char *sim_tail() const {
+    const size_t kept = min(length, sizeof(tail) - 1);
+    return tail + sizeof(tail) - 1 - kept;
+  }
+
+private:
+  AwsResponseFiller filler;
+  size_t length = 0;
+  char tail[32] = {};
+};
+
+class AsyncWebServerRequest {
+public:
+  AsyncWebServerRequest(WebRequestMethodComposite method, const String &url)
+      : method_{method}, url_{url} {}
+  ~AsyncWebServerRequest() { delete response; }
+
+  WebRequestMethodComposite method() const { return method_; }
+  const String &url() const { return url_; }
+  bool hasHeader(const char *name) const { return headers.get(name); }
+  AsyncWebHeader *getHeader(const char *name) const {
+    return headers.get(name);
+  }
+
+  AsyncResponseStream *beginResponseStream(const String &content_type,
+                                           size_t buffer_size = 1460) {
+    return new AsyncResponseStream(content_type, buffer_size);
+  }
+  AsyncWebServerResponse *beginResponse(int code,
+                                        const String &content_type = String(),
+                                        const String &content = String()) {
+    return new AsyncBasicResponse(code, content_type, content);
+  }
+  AsyncWebServerResponse *beginChunkedResponse(const String &content_type,
+                                               AwsResponseFiller filler) {
+    return new AsyncChunkedResponse(content_type, filler);
+  }
+  AsyncWebServerResponse *beginResponse(FS &fs, const String &path,
+                                        const String &content_type = String(),
+                                        bool download = false) {
+    return new AsyncFileResponse(fs, path, content_type);
+  }
+
+  void send(AsyncWebServerResponse *response) {
+    delete this->response;
+    this->response = response;
+    response->sim_send();
+  }
+  void send(int code, const String &content_type = String(),
+            const String &content = String()) {
+    send(beginResponse(code, content_type, content));
+  }
+  void send(FS &fs, const String &path, const String &content_type = String(),
+            bool download = false) {
+    if (fs.exists(path) || (!download && fs.exists(path + ".gz"))) {
+      send(beginResponse(fs, path, content_type, download));
+    } else {
+      send(404);
+    }
+  }
+  void redirect(const String &url) {
+    AsyncWebServerResponse *response = beginResponse(302);
+    response->addHeader("Location", url);
+    send(response);
+  }
+
+  // Simulation: request headers and the response that was sent
+  void sim_add_header(const String &name, const String &value) {
+    headers.add(name, value);
+  }
+  AsyncWebServerResponse *sim_response() const { return response; }
+
+private:
+  WebRequestMethodComposite method_;
+  String url_;
+  AsyncWebHeaders headers;
+  AsyncWebServerResponse *response = nullptr;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)>
+    ArRequestHandlerFunction;
+
+class AsyncCallbackWebHandler {
+public:
+  String uri;
+  WebRequestMethodComposite method = HTTP_ANY;
+  ArRequestHandlerFunction on_request;
+};
+
+// A file of fs, with the ETag (its size) and Cache-Control headers of the
+// library when a cache control is set
+class AsyncStaticWebHandler {
+public:
+  AsyncStaticWebHandler(const char *uri, FS &fs, const char *path)
+      : uri{uri}, fs{fs}, path{path} {}
+
+  AsyncStaticWebHandler &setCacheControl(const char *cache_control) {
+    this->cache_control = cache_control;
+    return *this;
+  }
+
+  bool sim_handle(AsyncWebServerRequest *request) {
+    if (request->method() != HTTP_GET || request->url() != uri) {
+      return false;
+    }
+    File file = fs.exists(path) ? fs.open(path, "r")
+                                : fs.open(path + ".gz", "r");
+    if (!file) {
+      request->send(404);
+      return true;
+    }
+    const String etag(file.size());
+    AsyncWebHeader *if_none_match = request->getHeader("If-None-Match");
+    AsyncWebServerResponse *response;
+    if (cache_control.length() > 0 && if_none_match != nullptr &&
+        if_none_match->value() == etag) {
+      response = new AsyncBasicResponse(304, String(), String());
+    } else {
+      response = new AsyncFileResponse(fs, path, String());
+    }
+    if (cache_control.length() > 0) {
+      response->addHeader("Cache-Control", cache_control);
+      response->addHeader("ETag", etag);
+    }
+    request->send(response);
+    return true;
+  }
+
+private:
+  String uri;
+  FS &fs;
+  String path, cache_control;
+};
+
+class AsyncWebHandler {
+public:
+  virtual ~AsyncWebHandler() {}
+};
+
+// Server-Sent Events. Like the library, a client queues a copy of each
+// message up to SSE_MAX_QUEUED_MESSAGES and drops what doesn't fit. The
+// runner connects the clients and reads their messages.
+#define SSE_MAX_QUEUED_MESSAGES 8
+
+class AsyncEventSourceClient {
+public:
+  ~AsyncEventSourceClient() {
+    while (num_queued > 0) {
+      sim_read(nullptr, 0);
+    }
+  }
+
+  void write(const char *message, size_t len) {
+    if (num_queued == SSE_MAX_QUEUED_MESSAGES) {
+      num_dropped++;
+      return;
+    }
+    char *copy = (char *)malloc(len + 1);
+    memcpy(copy, message, len);
+    copy[len] = '\0';
+    queue[(first + num_queued) % SSE_MAX_QUEUED_MESSAGES] = copy;
+    num_queued++;
+  }
+  void close() { connected_ = false; }
+  bool connected() const { return connected_; }
+  size_t packetsWaiting() const { return num_queued; }
+
+  // Simulation: take the oldest queued message, false when there is none
+  bool sim_read(char *buffer, size_t size) {
+    if (num_queued == 0) {
+      return false;
+    }
+    char *message = queue[first];
+    if (size > 0) {
+      snprintf(buffer, size, "%s", message);
+    }
+    free(message);
+    first = (first + 1) % SSE_MAX_QUEUED_MESSAGES;
+    num_queued--;
+    num_received++;
+    return true;
+  }
+  uint32_t num_received = 0, num_dropped = 0;
+
+private:
+  char *queue[SSE_MAX_QUEUED_MESSAGES];
+  uint8_t first = 0, num_queued = 0;
+  bool connected_ = true;
+};
+
+typedef std::function<void(AsyncEventSourceClient *client)>
+    ArEventHandlerFunction;
+
+class AsyncEventSource : public AsyncWebHandler {
+public:
+  AsyncEventSource(const String &url) : url{url} {}
+  ~AsyncEventSource() {
+    for (uint8_t i = 0; i < num_clients; i++) {
+      delete clients[i];
+    }
+  }
+
+  void onConnect(ArEventHandlerFunction on_connect) {
+    this->on_connect = on_connect;
+  }
+
+  size_t count() const {
+    size_t connected = 0;
+    for (uint8_t i = 0; i < num_clients; i++) {
+      connected += clients[i]->connected();
+    }
+    return connected;
+  }
+  size_t avgPacketsWaiting() const {
+    size_t waiting = 0, connected = 0;
+    for (uint8_t i = 0; i < num_clients; i++) {
+      if (clients[i]->connected()) {
+        waiting += clients[i]->packetsWaiting();
+        connected++;
+      }
+    }
+    return connected > 0 ? (waiting + connected / 2) / connected : 0;
+  }
+
+  // The message is formatted in a String and written to every client
+  void send(const char *message, const char *event = nullptr,
+            uint32_t id = 0, uint32_t reconnect = 0) {
+    const uint64_t before = sim_num_allocs();
+    {
+      String ev;
+      if (event != nullptr) {
+        ev += "event: ";
+        ev += event;
+        ev += "\r\n";
+      }
+      ev += "data: ";
+      ev += message;
+      ev += "\r\n\r\n";
+      for (uint8_t i = 0; i < num_clients; i++) {
+        if (clients[i]->connected()) {
+          clients[i]->write(ev.c_str(), ev.length());
+        }
+      }
+    }
+    sim_allocs += sim_num_allocs() - before;
+  }
+
+  // Simulation: a new client, nullptr when the station closed it. The
+  // allocations of send() are counted in sim_allocs.
+  AsyncEventSourceClient *sim_connect() {
+    if (num_clients == max_clients) {
+      return nullptr;
+    }
+    AsyncEventSourceClient *client = new AsyncEventSourceClient();
+    clients[num_clients++] = client;
+    if (on_connect) {
+      on_connect(client);
+    }
+    if (!client->connected()) {
+      delete client;
+      num_clients--;
+      return nullptr;
+    }
+    return client;
+  }
+  uint64_t sim_allocs = 0;
+
+private:
+  static const uint8_t max_clients = 8;
+  String url;
+  AsyncEventSourceClient *clients[max_clients];
+  uint8_t num_clients = 0;
+  ArEventHandlerFunction on_connect;
+};
+
+class AsyncWebServer {
+public:
+  AsyncWebServer(uint16_t port) {}
+
+  void begin() {}
+  AsyncCallbackWebHandler &on(const char *uri,
+                              WebRequestMethodComposite method,
+                              ArRequestHandlerFunction on_request) {
+    AsyncCallbackWebHandler *handler = new AsyncCallbackWebHandler();
+    handler->uri = uri;
+    handler->method = method;
+    handler->on_request = on_request;
+    if (num_handlers < max_handlers) {
+      handlers[num_handlers++] = handler;
+    }
+    return *handler;
+  }
+  AsyncStaticWebHandler &serveStatic(const char *uri, FS &fs,
+                                     const char *path) {
+    AsyncStaticWebHandler *handler = new AsyncStaticWebHandler(uri, fs, path);
+    if (num_static_handlers < max_handlers) {
+      static_handlers[num_static_handlers++] = handler;
+    }
+    return *handler;
+  }
+  // Only event sources, their clients are connected by the runner
+  AsyncWebHandler &addHandler(AsyncWebHandler *handler) { return *handler; }
+  void onNotFound(ArRequestHandlerFunction fn) { not_found = fn; }
+
+  // Simulation: run the handler of a request, the caller deletes it
+  AsyncWebServerRequest *sim_request(AsyncWebServerRequest *request) {
+    for (uint8_t i = 0; i < num_handlers; i++) {
+      AsyncCallbackWebHandler *handler = handlers[i];
+      if ((handler->method & request->method()) &&
+          handler->uri == request->url()) {
+        handler->on_request(request);
+        return request;
+      }
+    }
+    for (uint8_t i = 0; i < num_static_handlers; i++) {
+      if (static_handlers[i]->sim_handle(request)) {
+        return request;
+      }
+    }
+    if (not_found) {
+      not_found(request);
+    } else {
+      request->send(404);
+    }
+    return request;
+  }
+
+private:
+  static const uint8_t max_handlers = 16;
+  AsyncCallbackWebHandler *handlers[max_handlers];
+  uint8_t num_handlers = 0;
+  AsyncStaticWebHandler *static_handlers[max_handlers];
+  uint8_t num_static_handlers = 0;
+  ArRequestHandlerFunction not_found;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+// The station only needs a stable token out of the MAC address, so this
+// stand-in hashes it with FNV-1a into 40 hex digits instead of SHA-1.
+#include "Arduino.h"
+
+inline String sha1(const String &data) {
+  char hex[41];
+  uint32_t hash = 2166136261u;
+  for (uint8_t word = 0; word < 5; word++) {
+    for (size_t i = 0; i < data.length(); i++) {
+      hash = (hash ^ (uint8_t)data.c_str()[i]) * 16777619u;
+    }
+    snprintf(hex + 8 * word, 9, "%08x", hash);
+  }
+  return hex;
+}
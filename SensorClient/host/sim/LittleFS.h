@@ -0,0 +1,131 @@
+#pragma once
+
+// Flash file system stand-in for the host simulation: a few files in static
+// memory, so opening and writing them doesn't touch the counted heap.
+#include "Arduino.h"
+
+typedef struct {
+  bool used;
+  char path[32];
+  size_t size;
+  uint8_t data[8192];
+} SimFile;
+
+class File : public Print {
+public:
+  File(SimFile *file = nullptr, size_t position = 0)
+      : file{file}, position_{position} {}
+
+  explicit operator bool() const { return file != nullptr; }
+
+  size_t size() const { return file ? file->size : 0; }
+  size_t position() const { return position_; }
+  int available() { return size() - position_; }
+  bool seek(size_t position) {
+    if (position > size()) {
+      return false;
+    }
+    position_ = position;
+    return true;
+  }
+  const char *name() const { return file ? file->path : ""; }
+
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  size_t read(uint8_t *buffer, size_t length) {
+    const size_t n = min(length, (size_t)available());
+    if (n > 0) {
+      memcpy(buffer, file->data + position_, n);
+      position_ += n;
+    }
+    return n;
+  }
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t length) {
+    if (file == nullptr) {
+      return 0;
+    }
+    const size_t n = min(length, sizeof(file->data) - position_);
+    memcpy(file->data + position_, buffer, n);
+    position_ += n;
+    file->size = max(file->size, position_);
+    return n;
+  }
+  using Print::write;
+
+  void close() { file = nullptr; }
+
+private:
+  SimFile *file;
+  size_t position_;
+};
+
+class FS {
+public:
+  bool begin() { return true; }
+  void end() {}
+
+  bool exists(const char *path) { return find(path) != nullptr; }
+  bool exists(const String &path) { return exists(path.c_str()); }
+  bool remove(const char *path) {
+    SimFile *file = find(path);
+    if (file == nullptr) {
+      return false;
+    }
+    file->used = false;
+    return true;
+  }
+
+  // Modes "r", "w" and "a"
+  File open(const char *path, const char *mode) {
+    SimFile *file = find(path);
+    if (mode[0] == 'r') {
+      return File(file);
+    }
+    if (file == nullptr) {
+      file = create(path);
+      if (file == nullptr) {
+        return File();
+      }
+    }
+    if (mode[0] == 'w') {
+      file->size = 0;
+    }
+    return File(file, file->size);
+  }
+  File open(const String &path, const char *mode) {
+    return open(path.c_str(), mode);
+  }
+
+private:
+  SimFile files[8] = {};
+
+  SimFile *find(const char *path) {
+    for (SimFile &file : files) {
+      if (file.used && strcmp(file.path, path) == 0) {
+        return &file;
+      }
+    }
+    return nullptr;
+  }
+
+  SimFile *create(const char *path) {
+    if (strlen(path) >= sizeof(SimFile::path)) {
+      return nullptr;
+    }
+    for (SimFile &file : files) {
+      if (!file.used) {
+        file.used = true;
+        strcpy(file.path, path);
+        file.size = 0;
+        return &file;
+      }
+    }
+    return nullptr;
+  }
+};
+
+extern FS LittleFS;
@@ -0,0 +1,112 @@
+#pragma once
+
+// Arduino Print for the host simulation. printf() formats into a 64 byte
+// stack buffer and only allocates for longer output, like the core does.
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+      n += write(*buffer++);
+    }
+    return n;
+  }
+  size_t write(const char *str) {
+    return str ? write((const uint8_t *)str, strlen(str)) : 0;
+  }
+  size_t write(const char *buffer, size_t size) {
+    return write((const uint8_t *)buffer, size);
+  }
+  virtual void flush() {}
+
+  size_t printf(const char *format, ...)
+      __attribute__((format(printf, 2, 3))) {
+    va_list arg;
+    va_start(arg, format);
+    const size_t n = vprintf(format, arg);
+    va_end(arg);
+    return n;
+  }
+  size_t printf_P(const char *format, ...)
+      __attribute__((format(printf, 2, 3))) {
+    va_list arg;
+    va_start(arg, format);
+    const size_t n = vprintf(format, arg);
+    va_end(arg);
+    return n;
+  }
+
+  size_t print(const __FlashStringHelper *str) {
+    return write((const char *)str);
+  }
+  size_t print(const String &str) { return write(str.c_str(), str.length()); }
+  size_t print(const char *str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char value, int base = DEC) {
+    return print((unsigned long)value, base);
+  }
+  size_t print(int value, int base = DEC) { return print((long)value, base); }
+  size_t print(unsigned int value, int base = DEC) {
+    return print((unsigned long)value, base);
+  }
+  size_t print(long value, int base = DEC) {
+    if (base == DEC) {
+      char buffer[24];
+      snprintf(buffer, sizeof(buffer), "%ld", value);
+      return write(buffer);
+    }
+    return print((unsigned long)value, base);
+  }
+  size_t print(unsigned long value, int base = DEC) {
+    return print(String(value, base));
+  }
+  size_t print(double value, int decimals = 2) {
+    char buffer[33];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    return write(buffer);
+  }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(const T &value) {
+    const size_t n = print(value);
+    return n + println();
+  }
+  template <typename T> size_t println(const T &value, int base) {
+    const size_t n = print(value, base);
+    return n + println();
+  }
+
+private:
+  size_t vprintf(const char *format, va_list arg) {
+    char temp[64];
+    char *buffer = temp;
+    va_list copy;
+    va_copy(copy, arg);
+    size_t len = vsnprintf(temp, sizeof(temp), format, copy);
+    va_end(copy);
+    if (len > sizeof(temp) - 1) {
+      buffer = new char[len + 1];
+      vsnprintf(buffer, len + 1, format, arg);
+    }
+    len = write((const uint8_t *)buffer, len);
+    if (buffer != temp) {
+      delete[] buffer;
+    }
+    return len;
+  }
+};
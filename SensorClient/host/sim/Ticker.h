@@ -0,0 +1,89 @@
+#pragma once
+
+// Stand-in of sstaub/Ticker 3.2 for the host simulation, with the same
+// semantics: update() calls the callback once the interval has elapsed since
+// the last call, the next interval counts from that update.
+#include "Arduino.h"
+
+enum resolution_t { MICROS, MILLIS, MICROS_MICROS };
+enum status_t { STOPPED, RUNNING, PAUSED };
+
+typedef std::function<void(void)> fptr;
+
+class Ticker {
+public:
+  Ticker(fptr callback, uint32_t timer, uint32_t repeat = 0,
+         resolution_t resolution = MICROS)
+      : callback{callback}, timer{timer}, repeat{repeat},
+        resolution{resolution} {}
+
+  void start() {
+    if (!callback) {
+      return;
+    }
+    last_time = now();
+    enabled = true;
+    counts = 0;
+    status = RUNNING;
+  }
+  void resume() {
+    if (!callback) {
+      return;
+    }
+    last_time = now() - diff_time;
+    if (status == STOPPED) {
+      counts = 0;
+    }
+    enabled = true;
+    status = RUNNING;
+  }
+  void pause() {
+    diff_time = now() - last_time;
+    enabled = false;
+    status = PAUSED;
+  }
+  void stop() {
+    enabled = false;
+    counts = 0;
+    status = STOPPED;
+  }
+  void update() {
+    if (tick()) {
+      callback();
+    }
+  }
+  void interval(uint32_t timer) { this->timer = timer; }
+
+  uint32_t elapsed() { return now() - last_time; }
+  uint32_t remaining() { return timer - elapsed(); }
+  status_t state() { return status; }
+  uint32_t counter() { return counts; }
+
+private:
+  fptr callback;
+  uint32_t timer;
+  uint32_t repeat;
+  resolution_t resolution;
+  bool enabled = false;
+  uint32_t last_time = 0, diff_time = 0, counts = 0;
+  status_t status = STOPPED;
+
+  uint32_t now() { return resolution == MILLIS ? millis() : micros(); }
+
+  bool tick() {
+    if (!enabled) {
+      return false;
+    }
+    const uint32_t current_time = now();
+    if (current_time - last_time < timer) {
+      return false;
+    }
+    last_time = current_time;
+    if (repeat - counts == 1 && counts != 0xFFFFFFFF) {
+      enabled = false;
+      status = STOPPED;
+    }
+    counts++;
+    return true;
+  }
+};
@@ -0,0 +1,418 @@
+#pragma once
+
+// Arduino String for the host simulation. Buffers are managed like the
+// ESP8266 core's: strings of up to sso_capacity characters are stored inline
+// and longer ones in a heap buffer rounded up to 16 bytes, so the simulation
+// counts the same allocations as the device.
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+class __FlashStringHelper;
+
+class String {
+public:
+  String(const char *cstr = "") {
+    if (cstr != nullptr) {
+      copy(cstr, strlen(cstr));
+    }
+  }
+  String(const String &str) { copy(str.c_str(), str.length()); }
+  String(String &&rval) { move(rval); }
+  String(const __FlashStringHelper *str) : String((const char *)str) {}
+  explicit String(char c) { copy(&c, 1); }
+  explicit String(unsigned char value, unsigned char base = 10) {
+    from_unsigned(value, base);
+  }
+  explicit String(int value, unsigned char base = 10) {
+    from_signed(value, base);
+  }
+  explicit String(unsigned int value, unsigned char base = 10) {
+    from_unsigned(value, base);
+  }
+  explicit String(long value, unsigned char base = 10) {
+    from_signed(value, base);
+  }
+  explicit String(unsigned long value, unsigned char base = 10) {
+    from_unsigned(value, base);
+  }
+  explicit String(double value, unsigned char decimals = 2) {
+    char buffer[33];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    copy(buffer, strlen(buffer));
+  }
+  ~String() { release(); }
+
+  String &operator=(const String &rhs) {
+    if (this != &rhs) {
+      copy(rhs.c_str(), rhs.length());
+    }
+    return *this;
+  }
+  String &operator=(String &&rval) {
+    if (this != &rval) {
+      release();
+      move(rval);
+    }
+    return *this;
+  }
+  String &operator=(const char *cstr) {
+    if (cstr == nullptr) {
+      cstr = "";
+    }
+    copy(cstr, strlen(cstr));
+    return *this;
+  }
+  String &operator=(const __FlashStringHelper *str) {
+    return *this = (const char *)str;
+  }
+
+  bool reserve(size_t size) {
+    if (capacity() >= size) {
+      return true;
+    }
+    return change_buffer(size);
+  }
+
+  size_t length() const { return len; }
+  size_t capacity() const { return heap ? heap_capacity : sso_capacity; }
+  bool isEmpty() const { return len == 0; }
+  const char *c_str() const { return heap ? heap : sso; }
+  char *begin() { return buffer(); }
+  char *end() { return buffer() + len; }
+
+  bool concat(const char *cstr, size_t length) {
+    if (cstr == nullptr) {
+      return false;
+    }
+    if (length == 0) {
+      return true;
+    }
+    if (!reserve(len + length)) {
+      return false;
+    }
+    memmove(buffer() + len, cstr, length);
+    len += length;
+    buffer()[len] = '\0';
+    return true;
+  }
+  bool concat(const String &str) {
+    // Appending a string to itself must not read a reallocated buffer
+    if (&str == this) {
+      const size_t length = len;
+      if (!reserve(2 * length)) {
+        return false;
+      }
+      memcpy(buffer() + length, buffer(), length);
+      len += length;
+      buffer()[len] = '\0';
+      return true;
+    }
+    return concat(str.c_str(), str.length());
+  }
+  bool concat(const char *cstr) {
+    return cstr != nullptr && concat(cstr, strlen(cstr));
+  }
+  bool concat(const __FlashStringHelper *str) {
+    return concat((const char *)str);
+  }
+  bool concat(char c) { return concat(&c, 1); }
+  bool concat(unsigned char value) { return concat(String(value)); }
+  bool concat(int value) { return concat(String(value)); }
+  bool concat(unsigned int value) { return concat(String(value)); }
+  bool concat(long value) { return concat(String(value)); }
+  bool concat(unsigned long value) { return concat(String(value)); }
+  bool concat(double value) { return concat(String(value)); }
+
+  template <typename T> String &operator+=(const T &rhs) {
+    concat(rhs);
+    return *this;
+  }
+  String &operator+=(const char *cstr) {
+    concat(cstr);
+    return *this;
+  }
+
+  int compareTo(const String &str) const {
+    return strcmp(c_str(), str.c_str());
+  }
+  bool equals(const String &str) const {
+    return len == str.len && compareTo(str) == 0;
+  }
+  bool equals(const char *cstr) const {
+    return strcmp(c_str(), cstr ? cstr : "") == 0;
+  }
+  bool operator==(const String &rhs) const { return equals(rhs); }
+  bool operator==(const char *cstr) const { return equals(cstr); }
+  bool operator!=(const String &rhs) const { return !equals(rhs); }
+  bool operator!=(const char *cstr) const { return !equals(cstr); }
+  bool operator<(const String &rhs) const { return compareTo(rhs) < 0; }
+  bool startsWith(const String &prefix) const {
+    return prefix.len <= len &&
+           strncmp(c_str(), prefix.c_str(), prefix.len) == 0;
+  }
+  bool endsWith(const String &suffix) const {
+    return suffix.len <= len &&
+           strcmp(c_str() + len - suffix.len, suffix.c_str()) == 0;
+  }
+
+  char charAt(size_t index) const { return index < len ? c_str()[index] : 0; }
+  char operator[](size_t index) const { return charAt(index); }
+  char &operator[](size_t index) {
+    static char dummy;
+    if (index >= len) {
+      dummy = 0;
+      return dummy;
+    }
+    return buffer()[index];
+  }
+
+  int indexOf(char c, size_t from = 0) const {
+    if (from >= len) {
+      return -1;
+    }
+    const char *found = strchr(c_str() + from, c);
+    return found ? found - c_str() : -1;
+  }
+  int indexOf(const String &str, size_t from = 0) const {
+    if (from >= len) {
+      return -1;
+    }
+    const char *found = strstr(c_str() + from, str.c_str());
+    return found ? found - c_str() : -1;
+  }
+  int lastIndexOf(char c) const {
+    const char *found = strrchr(c_str(), c);
+    return found ? found - c_str() : -1;
+  }
+  int lastIndexOf(const String &str, int from) const {
+    if (str.len == 0 || str.len > len || from < 0) {
+      return -1;
+    }
+    if ((size_t)from > len - str.len) {
+      from = len - str.len;
+    }
+    for (int i = from; i >= 0; i--) {
+      if (strncmp(c_str() + i, str.c_str(), str.len) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  String substring(size_t from) const { return substring(from, len); }
+  String substring(size_t from, size_t to) const {
+    if (from > to) {
+      const size_t swap = from;
+      from = to;
+      to = swap;
+    }
+    String out;
+    if (from >= len) {
+      return out;
+    }
+    if (to > len) {
+      to = len;
+    }
+    out.copy(c_str() + from, to - from);
+    return out;
+  }
+
+  void replace(char find, char replace) {
+    for (char *c = begin(); c != end(); c++) {
+      if (*c == find) {
+        *c = replace;
+      }
+    }
+  }
+  // Same algorithm as the core: shrinking replacements are done left to
+  // right in place, growing ones right to left after a single reserve.
+  void replace(const String &find, const String &replace) {
+    if (len == 0 || find.len == 0) {
+      return;
+    }
+    const int diff = (int)replace.len - (int)find.len;
+    if (diff == 0) {
+      int index = 0;
+      while ((index = indexOf(find, index)) >= 0) {
+        memcpy(buffer() + index, replace.c_str(), replace.len);
+        index += replace.len;
+      }
+    } else if (diff < 0) {
+      char *write_to = buffer();
+      size_t read_from = 0;
+      int index;
+      while ((index = indexOf(find, read_from)) >= 0) {
+        const size_t n = index - read_from;
+        memmove(write_to, buffer() + read_from, n);
+        write_to += n;
+        memcpy(write_to, replace.c_str(), replace.len);
+        write_to += replace.len;
+        read_from = index + find.len;
+      }
+      const size_t n = len - read_from;
+      memmove(write_to, buffer() + read_from, n);
+      len = write_to + n - buffer();
+      buffer()[len] = '\0';
+    } else {
+      size_t size = len;
+      int index = 0;
+      while ((index = indexOf(find, index)) >= 0) {
+        index += find.len;
+        size += diff;
+      }
+      if (size == len || !reserve(size)) {
+        return;
+      }
+      index = len - 1;
+      while (index >= 0 && (index = lastIndexOf(find, index)) >= 0) {
+        char *read_from = buffer() + index + find.len;
+        memmove(read_from + diff, read_from, len - (read_from - buffer()));
+        memcpy(buffer() + index, replace.c_str(), replace.len);
+        len += diff;
+        buffer()[len] = '\0';
+        index--;
+      }
+    }
+  }
+
+  void remove(size_t index, size_t count = (size_t)-1) {
+    if (index >= len) {
+      return;
+    }
+    if (count > len - index) {
+      count = len - index;
+    }
+    memmove(buffer() + index, buffer() + index + count, len - index - count);
+    len -= count;
+    buffer()[len] = '\0';
+  }
+  void toLowerCase() {
+    for (char *c = begin(); c != end(); c++) {
+      *c = tolower((unsigned char)*c);
+    }
+  }
+  void toUpperCase() {
+    for (char *c = begin(); c != end(); c++) {
+      *c = toupper((unsigned char)*c);
+    }
+  }
+  void trim() {
+    size_t start = 0;
+    while (start < len && isspace((unsigned char)c_str()[start])) {
+      start++;
+    }
+    size_t stop = len;
+    while (stop > start && isspace((unsigned char)c_str()[stop - 1])) {
+      stop--;
+    }
+    remove(stop);
+    remove(0, start);
+  }
+
+  long toInt() const { return atol(c_str()); }
+  float toFloat() const { return atof(c_str()); }
+  double toDouble() const { return atof(c_str()); }
+
+private:
+  static const size_t sso_capacity = 10;
+  char sso[sso_capacity + 1] = {};
+  char *heap = nullptr;
+  size_t heap_capacity = 0;
+  size_t len = 0;
+
+  char *buffer() { return heap ? heap : sso; }
+
+  bool change_buffer(size_t max_length) {
+    if (max_length <= sso_capacity && heap == nullptr) {
+      return true;
+    }
+    // Heap buffers grow in steps of 16 bytes, including the terminator
+    const size_t new_size = (max_length + 16) & ~(size_t)0xF;
+    char *new_buffer = (char *)realloc(heap, new_size);
+    if (new_buffer == nullptr) {
+      return false;
+    }
+    if (heap == nullptr) {
+      memcpy(new_buffer, sso, len + 1);
+    }
+    heap = new_buffer;
+    heap_capacity = new_size - 1;
+    return true;
+  }
+
+  void copy(const char *cstr, size_t length) {
+    if (!reserve(length)) {
+      release();
+      return;
+    }
+    len = length;
+    memmove(buffer(), cstr, length);
+    buffer()[len] = '\0';
+  }
+
+  void move(String &rhs) {
+    memcpy(sso, rhs.sso, sizeof(sso));
+    heap = rhs.heap;
+    heap_capacity = rhs.heap_capacity;
+    len = rhs.len;
+    rhs.heap = nullptr;
+    rhs.heap_capacity = 0;
+    rhs.len = 0;
+    rhs.sso[0] = '\0';
+  }
+
+  void release() {
+    free(heap);
+    heap = nullptr;
+    heap_capacity = 0;
+    len = 0;
+    sso[0] = '\0';
+  }
+
+  void from_unsigned(unsigned long value, unsigned char base) {
+    char buffer[8 * sizeof(value) + 1];
+    char *c = buffer + sizeof(buffer) - 1;
+    *c = '\0';
+    do {
+      const unsigned digit = value % base;
+      *--c = digit < 10 ? '0' + digit : 'a' + digit - 10;
+      value /= base;
+    } while (value > 0);
+    copy(c, strlen(c));
+  }
+
+  void from_signed(long value, unsigned char base) {
+    if (value >= 0 || base != 10) {
+      from_unsigned(base == 10 ? value : (unsigned long)value, base);
+      return;
+    }
+    from_unsigned(-(unsigned long)value, base);
+    String negative("-");
+    negative.concat(*this);
+    *this = std::move(negative);
+  }
+};
+
+// Chained concatenation works on a single temporary, like in the core
+class StringSumHelper : public String {
+public:
+  StringSumHelper(const String &str) : String(str) {}
+  StringSumHelper(const char *cstr) : String(cstr) {}
+  StringSumHelper(char c) : String(c) {}
+  StringSumHelper(unsigned char value) : String(value) {}
+  StringSumHelper(int value) : String(value) {}
+  StringSumHelper(unsigned int value) : String(value) {}
+  StringSumHelper(long value) : String(value) {}
+  StringSumHelper(unsigned long value) : String(value) {}
+  StringSumHelper(double value) : String(value) {}
+};
+
+template <typename T>
+StringSumHelper &operator+(const StringSumHelper &lhs, const T &rhs) {
+  StringSumHelper &sum = const_cast<StringSumHelper &>(lhs);
+  sum.concat(rhs);
+  return sum;
+}
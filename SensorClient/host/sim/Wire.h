@@ -0,0 +1,55 @@
+#pragma once
+
+// I2C stand-in for the host simulation. Transfers go to the simulated devices
+// in sim.cpp and take the bus time of 100 kHz transfers.
+#include "Arduino.h"
+
+class TwoWire {
+public:
+  void begin() {}
+  void begin(int sda, int scl) {}
+  void setClock(uint32_t frequency) {}
+  void setClockStretchLimit(uint32_t limit) {}
+
+  void beginTransmission(uint8_t address) {
+    tx_address = address;
+    tx_length = 0;
+  }
+  size_t write(uint8_t data) { return write(&data, 1); }
+  size_t write(const uint8_t *data, size_t length) {
+    const size_t n = min(length, sizeof(tx_buffer) - tx_length);
+    if (data != nullptr && n > 0) {
+      memcpy(tx_buffer + tx_length, data, n);
+    }
+    tx_length += n;
+    return n;
+  }
+  // 0 on success, 2 if the address wasn't acknowledged
+  uint8_t endTransmission(bool send_stop = true) {
+    return sim_i2c_write(tx_address, tx_buffer, tx_length) ? 0 : 2;
+  }
+
+  uint8_t requestFrom(uint8_t address, uint8_t quantity) {
+    if (quantity > buffer_size) {
+      quantity = buffer_size;
+    }
+    rx_length = sim_i2c_read(address, rx_buffer, quantity);
+    rx_position = 0;
+    return rx_length;
+  }
+  uint8_t requestFrom(int address, int quantity) {
+    return requestFrom((uint8_t)address, (uint8_t)quantity);
+  }
+  int available() { return rx_length - rx_position; }
+  int read() { return available() > 0 ? rx_buffer[rx_position++] : -1; }
+
+private:
+  static const uint8_t buffer_size = 128;
+  uint8_t tx_address = 0;
+  uint8_t tx_buffer[buffer_size];
+  size_t tx_length = 0;
+  uint8_t rx_buffer[buffer_size];
+  size_t rx_length = 0, rx_position = 0;
+};
+
+extern TwoWire Wire;
@@ -0,0 +1,51 @@
+#pragma once
+
+// CCS811 library stand-in for the host simulation. Results come from the
+// simulated sensor in sim.cpp, one every 10 s once started.
+#include "Arduino.h"
+
+#define CCS811_VERSION 10
+
+#define CCS811_MODE_IDLE 0
+#define CCS811_MODE_1SEC 1
+#define CCS811_MODE_10SEC 2
+#define CCS811_MODE_60SEC 3
+
+#define CCS811_ERRSTAT_ERROR 0x0001
+#define CCS811_ERRSTAT_DATA_READY 0x0008
+#define CCS811_ERRSTAT_APP_VALID 0x0010
+#define CCS811_ERRSTAT_FW_MODE 0x0080
+#define CCS811_ERRSTAT_I2CFAIL 0x8000
+#define CCS811_ERRSTAT_OK                                                      \
+  (CCS811_ERRSTAT_DATA_READY | CCS811_ERRSTAT_APP_VALID |                      \
+   CCS811_ERRSTAT_FW_MODE)
+#define CCS811_ERRSTAT_OK_NODATA                                               \
+  (CCS811_ERRSTAT_APP_VALID | CCS811_ERRSTAT_FW_MODE)
+
+class CCS811 {
+public:
+  CCS811(int nwake = -1, int slaveaddr = 0x5A) {}
+  void set_i2cdelay(int us) {}
+  bool begin() { return true; }
+  bool start(int mode) { return true; }
+
+  void read(uint16_t *eco2, uint16_t *etvoc, uint16_t *errstat,
+            uint16_t *raw) {
+    const bool ready = sim_ccs811_read(eco2, etvoc, raw);
+    *errstat = ready ? CCS811_ERRSTAT_OK : CCS811_ERRSTAT_OK_NODATA;
+  }
+  const char *errstat_str(uint16_t errstat) { return "--"; }
+
+  int hardware_version() { return 0x12; }
+  int bootloader_version() { return 0x1000; }
+  int application_version() { return 0x2000; }
+
+  bool set_envdata(uint16_t t, uint16_t h) { return true; }
+  bool get_baseline(uint16_t *baseline) {
+    *baseline = sim_ccs811_baseline();
+    return true;
+  }
+  bool set_baseline(uint16_t baseline) {
+    return sim_ccs811_set_baseline(baseline);
+  }
+};
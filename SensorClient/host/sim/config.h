@@ -0,0 +1,5 @@
+#define STASSID "sim"
+#define STAPSK "sim"
+
+#define SERVER_HOSTNAME "rest_server.sim"
+#define NTP_SERVER_HOSTNAME "ntp.sim"
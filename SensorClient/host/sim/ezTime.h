@@ -0,0 +1,153 @@
+#pragma once
+
+// ezTime stand-in for the host simulation. Time is the simulated clock, it is
+// always in sync, and the only time zone rules known are those of Central
+// Europe, for any "Europe/..." location.
+#include "Arduino.h"
+
+enum ezDebugLevel_t { NONE, ERROR, INFO, DEBUG };
+enum timeStatus_t { timeNotSet, timeNeedsSync, timeSet };
+
+#define COOKIE "l, d-M-Y H:i:s T"
+#define DEFAULT_TIMEFORMAT COOKIE
+
+// As in ezTime, now() and the times taken by dateTime() are local times of
+// the zone.
+class Timezone {
+public:
+  time_t now() { return tzTime(sim_epoch()); }
+
+  bool setCache(int16_t address) { return false; }
+  bool setLocation(const String &location = "") {
+    central_europe = location.startsWith("Europe/");
+    return true;
+  }
+  void setDefault();
+
+  // Local time from UTC
+  time_t tzTime(time_t utc) { return utc + 60 * offset_min(utc); }
+  String getTimezoneName(time_t local = 0) {
+    if (!central_europe) {
+      return "UTC";
+    }
+    return is_summer(local ? local - 3600 : sim_epoch()) ? "CEST" : "CET";
+  }
+
+  String dateTime(const String format = DEFAULT_TIMEFORMAT) {
+    return dateTime(now(), format);
+  }
+  String dateTime(time_t local, const String format = DEFAULT_TIMEFORMAT) {
+    static const char *const days[] = {"Sunday",   "Monday", "Tuesday",
+                                       "Wednesday", "Thursday", "Friday",
+                                       "Saturday"};
+    static const char *const months[] = {
+        "January", "February", "March",     "April",   "May",      "June",
+        "July",    "August",   "September", "October", "November", "December"};
+    struct tm tm;
+    gmtime_r(&local, &tm);
+
+    char out[64];
+    size_t n = 0;
+    for (const char *c = format.c_str(); *c != '\0' && n < sizeof(out) - 1;
+         c++) {
+      const size_t room = sizeof(out) - n;
+      int written;
+      switch (*c) {
+      case 'd':
+        written = snprintf(out + n, room, "%02d", tm.tm_mday);
+        break;
+      case 'j':
+        written = snprintf(out + n, room, "%d", tm.tm_mday);
+        break;
+      case 'D':
+        written = snprintf(out + n, room, "%.3s", days[tm.tm_wday]);
+        break;
+      case 'l':
+        written = snprintf(out + n, room, "%s", days[tm.tm_wday]);
+        break;
+      case 'm':
+        written = snprintf(out + n, room, "%02d", tm.tm_mon + 1);
+        break;
+      case 'n':
+        written = snprintf(out + n, room, "%d", tm.tm_mon + 1);
+        break;
+      case 'M':
+        written = snprintf(out + n, room, "%.3s", months[tm.tm_mon]);
+        break;
+      case 'F':
+        written = snprintf(out + n, room, "%s", months[tm.tm_mon]);
+        break;
+      case 'Y':
+        written = snprintf(out + n, room, "%d", tm.tm_year + 1900);
+        break;
+      case 'y':
+        written = snprintf(out + n, room, "%02d", tm.tm_year % 100);
+        break;
+      case 'H':
+        written = snprintf(out + n, room, "%02d", tm.tm_hour);
+        break;
+      case 'G':
+        written = snprintf(out + n, room, "%d", tm.tm_hour);
+        break;
+      case 'i':
+        written = snprintf(out + n, room, "%02d", tm.tm_min);
+        break;
+      case 's':
+        written = snprintf(out + n, room, "%02d", tm.tm_sec);
+        break;
+      case 'T':
+        written = snprintf(out + n, room, "%s", getTimezoneName(local).c_str());
+        break;
+      case '~':
+        if (c[1] != '\0') {
+          c++;
+        }
+        // fall through
+      default:
+        written = snprintf(out + n, room, "%c", *c);
+        break;
+      }
+      n = min(n + written, sizeof(out) - 1);
+    }
+    out[n] = '\0';
+    return out;
+  }
+
+private:
+  bool central_europe = false;
+
+  // Summer time from the last Sunday of March to the last Sunday of October,
+  // at 01:00 UTC
+  bool is_summer(time_t utc) {
+    struct tm tm;
+    gmtime_r(&utc, &tm);
+    const int year = tm.tm_year + 1900;
+    struct tm start = {}, end = {};
+    start.tm_year = end.tm_year = tm.tm_year;
+    start.tm_mon = 2;
+    start.tm_mday = 31 - (5 * year / 4 + 4) % 7;
+    end.tm_mon = 9;
+    end.tm_mday = 31 - (5 * year / 4 + 1) % 7;
+    start.tm_hour = end.tm_hour = 1;
+    return utc >= timegm(&start) && utc < timegm(&end);
+  }
+
+  int16_t offset_min(time_t utc) {
+    if (!central_europe) {
+      return 0;
+    }
+    return is_summer(utc) ? 120 : 60;
+  }
+};
+
+extern Timezone UTC;
+extern Timezone *defaultTZ;
+
+inline void Timezone::setDefault() { defaultTZ = this; }
+
+inline void events() {}
+inline void setDebug(ezDebugLevel_t level) {}
+inline void setServer(const String ntp_server) {}
+inline bool waitForSync(uint16_t timeout = 0) { return true; }
+inline void setInterval(uint16_t seconds = 0) {}
+inline timeStatus_t timeStatus() { return timeSet; }
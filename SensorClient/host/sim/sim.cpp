@@ -0,0 +1,1268 @@
+// Host simulation of a whole station.
+//
+// Builds src/main.cpp and the sensor headers against the stand-in libraries
+// in this directory and runs setup() and loop() on a simulated clock. The
+// world around the station is simulated too: the I2C sensors return scripted
+// values, a DSMR 5 meter writes a telegram to the UART every second and a fake
+// rest_server answers the station's requests. Nothing depends on the host's
+// clock or on random numbers, so two runs give the same report.
+//
+//   pio run -e native_sim -t exec
+//   .pio/build/native_sim/program --duration-s 600 --fail-every 7
+//
+// Options:
+//   --duration-s N       simulated seconds after setup (3600)
+//   --loop-us N          simulated time of a loop() iteration (1000)
+//   --http-latency-ms N  round trip of each rest_server request (40)
+//   --fail-every N       answer every Nth measurements POST with 503 (0, off)
+//   --web-every-s N      request the station's / page every N s, then again
+//                        with its ETag (60, 0 off)
+//   --sse-clients N      clients of /events (2), all read every event as it
+//                        comes but the last one, which reads every 30 s
+//   --data DIR           files loaded in LittleFS ("data")
+//   --deployed-p1        the rest_server already has the "P1" sensor with the
+//                        magnitudes of the first firmware
+//   --fixed-magnitudes   PUT sensors doesn't add magnitudes to a sensor the
+//                        rest_server already has, like it did before
+//   --echo               copy the station's serial output to stderr
+//
+// The heap of the station code is counted with alloc_stats.h, the allocations
+// of the simulated world and the rest_server are not. Results are printed as
+// "key: value" lines, those starting with host_ depend on the host's speed.
+// Exits with 1 if a check fails, 3 if the station restarted.
+#include "Arduino.h"
+#include "ArduinoOTA.h"
+#include "ESP8266WiFi.h"
+#include "ESP8266HTTPClient.h"
+#include "ESPAsyncWebServer.h"
+#include "LittleFS.h"
+#include "Wire.h"
+#include "alloc_stats.h"
+#include "ezTime.h"
+#include "sim.h"
+#include <ArduinoJson.h>
+#include <chrono>
+#include <cmath>
+#include <dirent.h>
+
+void setup();
+void loop();
+extern AsyncWebServer web_server;
+extern AsyncEventSource live_events;
+extern HTTPClient http;
+extern uint32_t num_live_events, num_live_dropped;
+extern uint32_t num_unregistered_measurements;
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+FS LittleFS;
+TwoWire Wire;
+Timezone UTC;
+Timezone *defaultTZ = &UTC;
+uint32_t sim_uart_conf0[2];
+
+typedef struct {
+  uint32_t duration_s;
+  uint32_t loop_us;
+  uint32_t http_latency_ms;
+  uint32_t fail_every;
+  uint32_t web_every_s;
+  uint32_t sse_clients;
+  const char *data_dir;
+  bool deployed_p1;
+  bool fixed_magnitudes;
+  bool echo;
+} SimOptions;
+
+SimOptions options = {3600, 1000, 40, 0, 60, 2, "data", false, false, false};
+
+///// Scripted values
+// Smooth daily and hourly cycles, so consecutive reads differ a little
+const double pi = 3.14159265358979;
+
+double cycle(double period_s, double phase = 0) {
+  return sin(2 * pi * (sim_epoch() / period_s + phase));
+}
+
+double sim_temperature() { return 21 + 2 * cycle(86400) + 0.3 * cycle(900); }
+double sim_humidity() { return 55 + 10 * cycle(86400, 0.5) + cycle(600); }
+double sim_pressure() { return 101325 + 400 * cycle(6 * 3600); }
+
+///// World
+// The only timed event source is the P1 meter, sensors compute their state
+// when they are read.
+uint64_t now_us = 0;
+
+uint64_t sim_now_us() { return now_us; }
+uint32_t sim_epoch() { return sim_start_epoch + now_us / 1000000; }
+
+class P1Meter {
+public:
+  // 115200 baud, 10 bits per byte
+  static const uint32_t baud_rate = 115200;
+
+  uint64_t next_event_us() const {
+    if (sent < length) {
+      return start_us + (uint64_t)sent * 10 * 1000000 / baud_rate;
+    }
+    return next_telegram_us;
+  }
+
+  void on_event() {
+    if (sent < length) {
+      Serial.sim_receive(telegram[sent++]);
+      return;
+    }
+    start_us = now_us;
+    next_telegram_us = now_us + 1000000;
+    write_telegram();
+    sent = 0;
+    num_telegrams++;
+  }
+
+  uint32_t num_telegrams = 0;
+
+private:
+  char telegram[1024];
+  size_t length = 0, sent = 0;
+  uint64_t start_us = 0, next_telegram_us = 1000000;
+
+  // Meter registers in Wh and dm3
+  uint64_t consumption_wh[2] = {992992, 1560157};
+  uint64_t delivery_wh[2] = {560157, 15001};
+  uint64_t gas_dm3 = 8385402;
+  double consumption_ws = 0, delivery_ws = 0;
+  time_t gas_timestamp = 0;
+
+  void write_timestamp(char *out, size_t size, time_t utc) {
+    Timezone cet;
+    cet.setLocation("Europe/Amsterdam");
+    const time_t local = cet.tzTime(utc);
+    struct tm tm;
+    gmtime_r(&local, &tm);
+    snprintf(out, size, "%02d%02d%02d%02d%02d%02d%c", tm.tm_year % 100,
+             tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             local - utc == 7200 ? 'S' : 'W');
+  }
+
+  void write_telegram() {
+    const time_t now = sim_epoch();
+    // House load and solar panels during the day
+    const double day = fmod(now + 7200, 86400) / 86400;
+    const double load_w = 450 + 250 * cycle(3600) + 150 * cycle(420);
+    const double solar_w = max(0.0, 1800 * sin(2 * pi * (day - 0.25)));
+    const double net_w = load_w - solar_w;
+    const uint8_t tariff = day > 7.0 / 24 && day < 23.0 / 24 ? 2 : 1;
+    consumption_ws += max(net_w, 0.0);
+    delivery_ws += max(-net_w, 0.0);
+    consumption_wh[tariff - 1] += (uint64_t)(consumption_ws / 3600);
+    delivery_wh[tariff - 1] += (uint64_t)(delivery_ws / 3600);
+    consumption_ws = fmod(consumption_ws, 3600);
+    delivery_ws = fmod(delivery_ws, 3600);
+    // The gas meter reports every 5 minutes
+    if (now - gas_timestamp >= 300) {
+      gas_timestamp = now - now % 300;
+      gas_dm3 += 12;
+    }
+
+    const uint32_t consumption_w = max(net_w, 0.0);
+    const uint32_t delivery_w = max(-net_w, 0.0);
+    const uint32_t voltage_dv = 2300 + lround(20 * cycle(1800));
+    char timestamp[14], gas_time[14];
+    write_timestamp(timestamp, sizeof(timestamp), now);
+    write_timestamp(gas_time, sizeof(gas_time), gas_timestamp);
+
+    length = snprintf(
+        telegram, sizeof(telegram),
+        "/ISK5\\2M550T-1012\r\n"
+        "\r\n"
+        "1-3:0.2.8(50)\r\n"
+        "0-0:1.0.0(%s)\r\n"
+        "0-0:96.1.1(4530303434303037313331363530363138)\r\n"
+        "1-0:1.8.1(%06u.%03u*kWh)\r\n"
+        "1-0:1.8.2(%06u.%03u*kWh)\r\n"
+        "1-0:2.8.1(%06u.%03u*kWh)\r\n"
+        "1-0:2.8.2(%06u.%03u*kWh)\r\n"
+        "0-0:96.14.0(%04u)\r\n"
+        "1-0:1.7.0(%02u.%03u*kW)\r\n"
+        "1-0:2.7.0(%02u.%03u*kW)\r\n"
+        "0-0:96.7.21(00010)\r\n"
+        "0-0:96.7.9(00003)\r\n"
+        "1-0:99.97.0(1)(0-0:96.7.19)(190314094713W)(0000005403*s)\r\n"
+        "1-0:32.32.0(00002)\r\n"
+        "1-0:32.36.0(00000)\r\n"
+        "0-0:96.13.0()\r\n"
+        "1-0:32.7.0(%03u.%u*V)\r\n"
+        "1-0:31.7.0(%03u*A)\r\n"
+        "1-0:21.7.0(%02u.%03u*kW)\r\n"
+        "1-0:22.7.0(%02u.%03u*kW)\r\n"
+        "0-1:24.1.0(003)\r\n"
+        "0-1:96.1.0(4730303339303031383331353439333138)\r\n"
+        "0-1:24.2.1(%s)(%05u.%03u*m3)\r\n"
+        "!",
+        timestamp, (unsigned)(consumption_wh[0] / 1000),
+        (unsigned)(consumption_wh[0] % 1000),
+        (unsigned)(consumption_wh[1] / 1000),
+        (unsigned)(consumption_wh[1] % 1000), (unsigned)(delivery_wh[0] / 1000),
+        (unsigned)(delivery_wh[0] % 1000), (unsigned)(delivery_wh[1] / 1000),
+        (unsigned)(delivery_wh[1] % 1000), tariff, consumption_w / 1000,
+        consumption_w % 1000, delivery_w / 1000, delivery_w % 1000,
+        voltage_dv / 10, voltage_dv % 10,
+        (unsigned)lround(fabs(net_w) / (voltage_dv / 10.0)),
+        consumption_w / 1000, consumption_w % 1000, delivery_w / 1000,
+        delivery_w % 1000, gas_time, (unsigned)(gas_dm3 / 1000),
+        (unsigned)(gas_dm3 % 1000));
+
+    // CRC-16/ARC from '/' to '!'
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+      crc ^= (uint8_t)telegram[i];
+      for (uint8_t bit = 0; bit < 8; bit++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+      }
+    }
+    length += snprintf(telegram + length, sizeof(telegram) - length,
+                       "%04X\r\n", crc);
+  }
+};
+
+P1Meter p1_meter;
+
+void sim_advance_us(uint64_t us) {
+  const uint64_t target_us = now_us + us;
+#ifdef HAS_P1
+  for (uint64_t event_us; (event_us = p1_meter.next_event_us()) <= target_us;) {
+    now_us = max(now_us, event_us);
+    p1_meter.on_event();
+  }
+#endif
+  now_us = target_us;
+}
+
+///// Serial
+// Writes block while the 128 byte TX FIFO is full, as on the device
+const uint64_t serial_byte_us = 10 * 1000000 / P1Meter::baud_rate;
+const uint64_t serial_fifo_size = 128;
+uint64_t serial_tx_busy_until_us = 0;
+uint64_t serial_tx_bytes = 0, serial_tx_blocked_us = 0;
+
+void sim_serial_write(const uint8_t *data, size_t len) {
+  if (options.echo) {
+    fwrite(data, 1, len, stderr);
+  }
+  serial_tx_bytes += len;
+  serial_tx_busy_until_us = max(serial_tx_busy_until_us, now_us);
+  serial_tx_busy_until_us += len * serial_byte_us;
+  const uint64_t fifo_us = serial_fifo_size * serial_byte_us;
+  if (serial_tx_busy_until_us - now_us > fifo_us) {
+    const uint64_t blocked_us = serial_tx_busy_until_us - now_us - fifo_us;
+    serial_tx_blocked_us += blocked_us;
+    sim_advance_us(blocked_us);
+  }
+}
+
+///// I2C devices
+// Transfers take 9 bit times per byte at 100 kHz plus start and stop
+uint64_t i2c_bus_us = 0;
+uint32_t i2c_nacks = 0;
+
+void i2c_transfer_time(size_t len) {
+  const uint64_t us = 20 + 90 * (len + 1);
+  i2c_bus_us += us;
+  sim_advance_us(us);
+}
+
+class SimI2CDevice {
+public:
+  virtual bool write(const uint8_t *data, size_t len) = 0;
+  virtual bool read(uint8_t *data, size_t len) = 0;
+};
+
+// Sleeps after 3 s, the wake up call is not acknowledged
+class SimAM2320 : public SimI2CDevice {
+public:
+  bool write(const uint8_t *data, size_t len) {
+    if (now_us >= awake_until_us) {
+      awake_until_us = now_us + 3000000;
+      return false;
+    }
+    if (len == 3 && data[0] == 0x03 && data[1] == 0x00 && data[2] == 0x04) {
+      ready_us = now_us + 1500;
+      return true;
+    }
+    return false;
+  }
+
+  bool read(uint8_t *data, size_t len) {
+    if (now_us >= awake_until_us || ready_us == 0 || now_us < ready_us ||
+        len != 8) {
+      return false;
+    }
+    ready_us = 0;
+    const uint16_t humidity = lround(sim_humidity() * 10);
+    const int16_t temperature = lround(sim_temperature() * 10);
+    const uint16_t raw_temperature =
+        temperature < 0 ? (-temperature | 0x8000) : temperature;
+    const uint8_t response[] = {0x03,
+                                0x04,
+                                (uint8_t)(humidity >> 8),
+                                (uint8_t)humidity,
+                                (uint8_t)(raw_temperature >> 8),
+                                (uint8_t)raw_temperature};
+    uint16_t crc = 0xFFFF;
+    for (uint8_t byte : response) {
+      crc ^= byte;
+      for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+      }
+    }
+    memcpy(data, response, sizeof(response));
+    data[6] = crc;
+    data[7] = crc >> 8;
+    return true;
+  }
+
+private:
+  uint64_t awake_until_us = 0, ready_us = 0;
+};
+
+// Pointing to the temperature register starts a conversion of both
+// magnitudes, reads are not acknowledged until it's done
+class SimHDC1080 : public SimI2CDevice {
+public:
+  bool write(const uint8_t *data, size_t len) {
+    if (len == 1 && data[0] == 0x00) {
+      ready_us = now_us + 12850;
+    }
+    return len > 0;
+  }
+
+  bool read(uint8_t *data, size_t len) {
+    if (ready_us == 0 || now_us < ready_us || len != 4) {
+      return false;
+    }
+    ready_us = 0;
+    const uint16_t temperature =
+        lround((sim_temperature() + 0.2 + 40) / 165 * 65536);
+    const uint16_t humidity = lround((sim_humidity() - 1) / 100 * 65536);
+    data[0] = temperature >> 8;
+    data[1] = temperature;
+    data[2] = humidity >> 8;
+    data[3] = humidity;
+    return true;
+  }
+
+private:
+  uint64_t ready_us = 0;
+};
+
+// Register file with a 32 result FIFO filled with one temperature and one
+// pressure result per second once continuous mode is started. The
+// coefficients are chosen so the raw values can be computed back.
+class SimHP303B : public SimI2CDevice {
+public:
+  SimHP303B() {
+    registers[0x0D] = 0x10; // Product and revision
+    registers[0x08] = 0xC0; // Coefficients and sensor ready
+    registers[0x28] = 0x80; // External temperature sensor
+    // c0, c1 (12 bit), c00, c10 (20 bit), c01, c11, c20, c21, c30 (16 bit)
+    const int32_t c0 = c0_, c1 = c1_ & 0xFFF, c00 = c00_ & 0xFFFFF,
+                  c10 = c10_ & 0xFFFFF, c01 = c01_ & 0xFFFF;
+    uint8_t *c = registers + 0x10;
+    c[0] = (c0 >> 4) & 0xFF;
+    c[1] = ((c0 & 0x0F) << 4 | c1 >> 8) & 0xFF;
+    c[2] = c1 & 0xFF;
+    c[3] = (c00 >> 12) & 0xFF;
+    c[4] = (c00 >> 4) & 0xFF;
+    c[5] = ((c00 & 0x0F) << 4 | c10 >> 16) & 0xFF;
+    c[6] = (c10 >> 8) & 0xFF;
+    c[7] = c10 & 0xFF;
+    c[8] = (c01 >> 8) & 0xFF;
+    c[9] = c01 & 0xFF;
+  }
+
+  bool write(const uint8_t *data, size_t len) {
+    if (len == 0) {
+      return true;
+    }
+    pointer = data[0];
+    if (len == 1) {
+      return true;
+    }
+    if (pointer == 0x0C && (data[1] & 0x80)) {
+      num_results = 0;
+    } else if (pointer == 0x08 && (data[1] & 0x07) == 0x07) {
+      measuring_since_s = sim_epoch();
+      generated_s = measuring_since_s;
+    }
+    registers[pointer] = data[1];
+    return true;
+  }
+
+  bool read(uint8_t *data, size_t len) {
+    generate();
+    if (pointer == 0x00) {
+      // Reading the result registers pops the oldest FIFO entry
+      uint32_t raw = 0x800000;
+      if (num_results > 0) {
+        raw = fifo[0];
+        memmove(fifo, fifo + 1, --num_results * sizeof(fifo[0]));
+      }
+      const uint8_t result[] = {(uint8_t)(raw >> 16), (uint8_t)(raw >> 8),
+                                (uint8_t)raw};
+      memcpy(data, result, min(len, sizeof(result)));
+      return true;
+    }
+    if (pointer == 0x0B) {
+      registers[0x0B] =
+          (num_results == 0 ? 0x01 : 0) | (num_results == 32 ? 0x02 : 0);
+    }
+    if (pointer == 0x08) {
+      registers[0x08] |= 0xC0;
+    }
+    memcpy(data, registers + pointer, min(len, sizeof(registers) - pointer));
+    return true;
+  }
+
+private:
+  static const int32_t c0_ = 204, c1_ = -260;
+  static const int32_t c00_ = 80000, c10_ = -60000, c01_ = -2000;
+  uint8_t registers[256] = {};
+  uint8_t pointer = 0;
+  uint32_t fifo[32];
+  uint8_t num_results = 0;
+  uint32_t measuring_since_s = 0, generated_s = 0;
+
+  // Scaled temperature and pressure with 8x and 64x oversampling
+  void generate() {
+    if (measuring_since_s == 0) {
+      return;
+    }
+    for (; generated_s < sim_epoch(); generated_s++) {
+      const double temperature = sim_temperature() + 0.4;
+      const double t = (temperature - c0_ * 0.5) / c1_;
+      const double p = (sim_pressure() - c00_ - t * c01_) / c10_;
+      push(((uint32_t)lround(t * 7864320) & 0xFFFFFE));
+      push(((uint32_t)lround(p * 1040384) & 0xFFFFFF) | 0x01);
+    }
+  }
+
+  void push(uint32_t raw) {
+    if (num_results < 32) {
+      fifo[num_results++] = raw;
+    }
+  }
+};
+
+// One result every 10 s
+uint32_t ccs811_last_result = 0;
+uint16_t ccs811_baseline = 0x847B;
+
+// The STATUS register of the CCS811, the results and baseline go through the
+// library stand-in below
+class SimCCS811 : public SimI2CDevice {
+public:
+  bool write(const uint8_t *data, size_t len) {
+    if (len > 0) {
+      pointer = data[0];
+    }
+    return true;
+  }
+
+  bool read(uint8_t *data, size_t len) {
+    if (pointer != 0x00) {
+      return false;
+    }
+    // FW_MODE, APP_VALID and DATA_READY
+    const bool ready = now_us / 10000000 != ccs811_last_result;
+    data[0] = 0x90 | (ready ? 0x08 : 0x00);
+    return true;
+  }
+
+private:
+  uint8_t pointer = 0;
+};
+
+SimAM2320 am2320;
+SimHDC1080 hdc1080;
+SimHP303B hp303b;
+SimCCS811 ccs811;
+
+SimI2CDevice *find_device(uint8_t address) {
+  switch (address) {
+  case 0x5C:
+    return &am2320;
+  case 0x40:
+    return &hdc1080;
+  case 0x77:
+    return &hp303b;
+  case 0x5A:
+    return &ccs811;
+  }
+  return nullptr;
+}
+
+bool sim_i2c_write(uint8_t address, const uint8_t *data, size_t len) {
+  i2c_transfer_time(len);
+  SimI2CDevice *device = find_device(address);
+  const bool ack = device != nullptr && device->write(data, len);
+  i2c_nacks += !ack;
+  return ack;
+}
+
+size_t sim_i2c_read(uint8_t address, uint8_t *data, size_t len) {
+  i2c_transfer_time(len);
+  SimI2CDevice *device = find_device(address);
+  if (device == nullptr || !device->read(data, len)) {
+    i2c_nacks++;
+    return 0;
+  }
+  return len;
+}
+
+bool sim_ccs811_read(uint16_t *eco2, uint16_t *etvoc, uint16_t *raw) {
+  const uint32_t result = now_us / 10000000;
+  if (result == ccs811_last_result) {
+    return false;
+  }
+  ccs811_last_result = result;
+  *eco2 = 400 + lround(300 * (1 + cycle(86400, 0.6)) + 20 * cycle(1200));
+  *etvoc = (*eco2 - 400) * 3 / 10;
+  *raw = 0x2345;
+  return true;
+}
+
+bool sim_ccs811_set_baseline(uint16_t baseline) {
+  ccs811_baseline = baseline;
+  return true;
+}
+
+uint16_t sim_ccs811_baseline() { return ccs811_baseline; }
+
+///// Fake rest_server
+// Follows rest_server/rest_api.py: a station is created once and then found
+// by its token, sensors are set with PUT and listed with GET (the server's
+// default page of 5 sensors), measurements are rejected if their sensor or
+// magnitude doesn't exist. PUT adds the magnitudes a known sensor is missing,
+// unless --fixed-magnitudes.
+const uint8_t max_server_sensors = 8;
+const uint8_t max_server_magnitudes = 32;
+
+typedef struct {
+  char name[40];
+  char unit[8];
+  double precision;
+  uint16_t id;
+  uint32_t num_measurements;
+  time_t last_timestamp;
+} ServerMagnitude;
+
+typedef struct {
+  char name[16];
+  uint16_t id;
+  uint8_t num_magnitudes;
+  ServerMagnitude magnitudes[max_server_magnitudes];
+} ServerSensor;
+
+class FakeRestServer {
+public:
+  SimHttpResponse handle(const char *method, const char *uri,
+                         const char *payload, size_t size) {
+    num_requests++;
+    if (strcmp(method, "POST") == 0 && strcmp(uri, "/api/stations") == 0) {
+      return post_station(payload, size);
+    }
+    char endpoint[64];
+    snprintf(endpoint, sizeof(endpoint), "/api/stations/%u", station_id);
+    const size_t endpoint_length = strlen(endpoint);
+    if (station_id == 0 || strncmp(uri, endpoint, endpoint_length) != 0) {
+      return respond(404, "{\"detail\":\"Station not found\"}");
+    }
+    const char *path = uri + endpoint_length;
+    if (strcmp(path, "/sensors") == 0 && strcmp(method, "PUT") == 0) {
+      return put_sensors(payload, size);
+    }
+    if (strcmp(path, "/sensors") == 0 && strcmp(method, "GET") == 0) {
+      return get_sensors();
+    }
+    if (strcmp(path, "/measurements") == 0 && strcmp(method, "POST") == 0) {
+      return post_measurements(payload, size);
+    }
+    return respond(404, "{\"detail\":\"Not Found\"}");
+  }
+
+  uint32_t num_requests = 0, num_measurement_posts = 0;
+  uint32_t num_failed_posts = 0, num_rejected_posts = 0;
+  uint32_t num_measurements = 0, num_out_of_order = 0;
+  uint64_t measurement_bytes = 0;
+  uint8_t num_sensors = 0;
+  ServerSensor sensors[max_server_sensors];
+
+  // The P1 sensor as the first firmware registered it
+  void add_deployed_p1() {
+    ServerSensor &sensor = sensors[num_sensors++];
+    sensor = {};
+    snprintf(sensor.name, sizeof(sensor.name), "P1");
+    sensor.id = num_sensors;
+    DynamicJsonDocument magnitudes(1024);
+    deserializeJson(magnitudes,
+                    "[{\"name\":\"power_consumption_1\",\"unit\":\"kWh\"},"
+                    "{\"name\":\"power_consumption_2\",\"unit\":\"kWh\"},"
+                    "{\"name\":\"power_delivery_1\",\"unit\":\"kWh\"},"
+                    "{\"name\":\"power_delivery_2\",\"unit\":\"kWh\"},"
+                    "{\"name\":\"gas_consumption\",\"unit\":\"m3\"}]");
+    for (JsonObject magnitude_json : magnitudes.as<JsonArray>()) {
+      magnitude_json["precision"] = 0.001;
+      add_magnitude(sensor, magnitude_json);
+    }
+  }
+
+private:
+  char body[16384];
+  char location[8];
+  char token[48] = "";
+  uint8_t station_id = 0;
+  uint16_t next_magnitude_id = 1;
+
+  SimHttpResponse respond(int code, const char *text = "") {
+    snprintf(body, sizeof(body), "%s", text);
+    return {code, body, location};
+  }
+
+  SimHttpResponse post_station(const char *payload, size_t size) {
+    DynamicJsonDocument station(1024);
+    if (deserializeJson(station, payload, size) ||
+        !station["token"].is<const char *>() ||
+        !station["location"].is<const char *>() ||
+        !station["hostname"].is<const char *>()) {
+      return respond(422);
+    }
+    int code = 200;
+    if (station_id == 0 || strcmp(station["token"], token) != 0) {
+      snprintf(token, sizeof(token), "%s", (const char *)station["token"]);
+      station_id++;
+      code = 201;
+    }
+    snprintf(location, sizeof(location), "%u", station_id);
+    station["id"] = station_id;
+    serializeJson(station, body, sizeof(body));
+    return {code, body, location};
+  }
+
+  ServerSensor *find_sensor(uint16_t id) {
+    for (uint8_t i = 0; i < num_sensors; i++) {
+      if (sensors[i].id == id) {
+        return &sensors[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Sensors keep their ids, new names get new ones
+  SimHttpResponse put_sensors(const char *payload, size_t size) {
+    DynamicJsonDocument sensors_json(4 * size + 1024);
+    if (deserializeJson(sensors_json, payload, size) ||
+        !sensors_json.is<JsonArray>()) {
+      return respond(422);
+    }
+    for (JsonObject sensor_json : sensors_json.as<JsonArray>()) {
+      const char *name = sensor_json["name"] | "";
+      ServerSensor *sensor = nullptr;
+      for (uint8_t i = 0; i < num_sensors; i++) {
+        if (strcmp(sensors[i].name, name) == 0) {
+          sensor = &sensors[i];
+        }
+      }
+      if (sensor != nullptr && options.fixed_magnitudes) {
+        continue;
+      }
+      if (sensor == nullptr) {
+        if (num_sensors == max_server_sensors) {
+          return respond(500);
+        }
+        sensor = &sensors[num_sensors++];
+        *sensor = {};
+        snprintf(sensor->name, sizeof(sensor->name), "%s", name);
+        sensor->id = num_sensors;
+      }
+      for (JsonObject magnitude_json :
+           sensor_json["magnitudes"].as<JsonArray>()) {
+        add_magnitude(*sensor, magnitude_json);
+      }
+    }
+    return respond(204);
+  }
+
+  void add_magnitude(ServerSensor &sensor, JsonObject magnitude_json) {
+    const char *name = magnitude_json["name"] | "";
+    for (uint8_t i = 0; i < sensor.num_magnitudes; i++) {
+      if (strcmp(sensor.magnitudes[i].name, name) == 0) {
+        return;
+      }
+    }
+    if (sensor.num_magnitudes == max_server_magnitudes) {
+      return;
+    }
+    ServerMagnitude &magnitude = sensor.magnitudes[sensor.num_magnitudes++];
+    magnitude = {};
+    snprintf(magnitude.name, sizeof(magnitude.name), "%s", name);
+    snprintf(magnitude.unit, sizeof(magnitude.unit), "%s",
+             magnitude_json["unit"] | "");
+    magnitude.precision = magnitude_json["precision"] | 0.0;
+    magnitude.id = next_magnitude_id++;
+  }
+
+  SimHttpResponse get_sensors() {
+    const uint8_t page_size = 5;
+    DynamicJsonDocument sensors_json(32768);
+    for (uint8_t i = 0; i < num_sensors && i < page_size; i++) {
+      const ServerSensor &sensor = sensors[i];
+      JsonObject sensor_json = sensors_json.createNestedObject();
+      sensor_json["name"] = sensor.name;
+      sensor_json["tag"] = nullptr;
+      sensor_json["id"] = sensor.id;
+      JsonArray magnitudes_json = sensor_json.createNestedArray("magnitudes");
+      for (uint8_t j = 0; j < sensor.num_magnitudes; j++) {
+        const ServerMagnitude &magnitude = sensor.magnitudes[j];
+        JsonObject magnitude_json = magnitudes_json.createNestedObject();
+        magnitude_json["name"] = magnitude.name;
+        magnitude_json["unit"] = magnitude.unit;
+        magnitude_json["precision"] = magnitude.precision;
+        magnitude_json["id"] = magnitude.id;
+      }
+    }
+    serializeJson(sensors_json, body, sizeof(body));
+    return {200, body, location};
+  }
+
+  ServerMagnitude *find_magnitude(ServerSensor &sensor, uint16_t id) {
+    for (uint8_t i = 0; i < sensor.num_magnitudes; i++) {
+      if (sensor.magnitudes[i].id == id) {
+        return &sensor.magnitudes[i];
+      }
+    }
+    return nullptr;
+  }
+
+  SimHttpResponse post_measurements(const char *payload, size_t size) {
+    num_measurement_posts++;
+    if (options.fail_every > 0 &&
+        num_measurement_posts % options.fail_every == 0) {
+      num_failed_posts++;
+      return respond(503);
+    }
+    DynamicJsonDocument measurements(4 * size + 1024);
+    if (deserializeJson(measurements, payload, size) ||
+        !measurements.is<JsonArray>()) {
+      num_rejected_posts++;
+      return respond(422);
+    }
+    // Validate everything before storing, like the server does
+    for (JsonObject measurement : measurements.as<JsonArray>()) {
+      ServerSensor *sensor = find_sensor(measurement["sensor_id"] | 0);
+      if (sensor == nullptr ||
+          find_magnitude(*sensor, measurement["magnitude_id"] | 0) ==
+              nullptr ||
+          !measurement["timestamp"].is<long>() ||
+          !measurement["value"].is<const char *>()) {
+        num_rejected_posts++;
+        return respond(404, "{\"detail\":\"Magnitude not found\"}");
+      }
+    }
+    for (JsonObject measurement : measurements.as<JsonArray>()) {
+      ServerSensor *sensor = find_sensor(measurement["sensor_id"]);
+      ServerMagnitude *magnitude =
+          find_magnitude(*sensor, measurement["magnitude_id"]);
+      const time_t timestamp = measurement["timestamp"];
+      num_out_of_order += timestamp < magnitude->last_timestamp;
+      magnitude->last_timestamp = timestamp;
+      magnitude->num_measurements++;
+      num_measurements++;
+    }
+    measurement_bytes += size;
+    return respond(201, "[]");
+  }
+};
+
+FakeRestServer rest_server;
+uint64_t http_us = 0;
+// Live bytes of the station while the server runs, 0 otherwise
+size_t serving_live_bytes = 0;
+
+// The server's own allocations are not the station's, they are taken out of
+// the counters and don't show in the free heap
+SimHttpResponse sim_http_request(const char *method, const char *uri,
+                                 const uint8_t *payload, size_t size) {
+  const AllocStats station_stats = alloc_stats;
+  serving_live_bytes = station_stats.live_bytes;
+  const SimHttpResponse response =
+      rest_server.handle(method, uri, (const char *)payload, size);
+  serving_live_bytes = 0;
+  alloc_stats = station_stats;
+
+  // Round trip plus the payloads at ~1 MB/s
+  const uint64_t us = options.http_latency_ms * 1000 + size +
+                      (response.body ? strlen(response.body) : 0);
+  http_us += us;
+  sim_advance_us(us);
+  return response;
+}
+
+///// Heap
+// Free heap of a station after the Wi-Fi stack is up. Blocks allocated by the
+// host's runtime before setup() are not the station's, until then the heap
+// is all free.
+const uint32_t sim_heap_size = 45 * 1024;
+size_t heap_base_bytes = 0;
+bool heap_base_known = false;
+
+size_t heap_bytes(size_t live_bytes) { return live_bytes - heap_base_bytes; }
+
+uint64_t sim_num_allocs() { return alloc_stats.num_allocs; }
+
+uint32_t sim_free_heap() {
+  if (!heap_base_known) {
+    return sim_heap_size;
+  }
+  const size_t used = heap_bytes(
+      serving_live_bytes ? serving_live_bytes : alloc_stats.live_bytes);
+  return used < sim_heap_size ? sim_heap_size - used : 0;
+}
+
+///// Runner
+typedef struct {
+  uint32_t num_loops;
+  uint64_t allocs;
+  // Those of HTTPClient, which copies the URL and headers of every request
+  // into Strings like the core's client
+  uint64_t http_client_allocs;
+  uint64_t max_loop_us;
+} LoopStats;
+
+uint32_t num_failures = 0;
+uint64_t setup_us = 0, setup_allocs = 0;
+size_t setup_heap_bytes = 0, first_minute_heap_bytes = 0;
+uint32_t setup_dropped = 0;
+LoopStats idle_loops = {}, upload_loops = {};
+uint32_t num_web_requests = 0, num_web_errors = 0;
+uint32_t num_web_revalidations = 0, num_web_not_modified = 0;
+uint64_t web_allocs = 0, web_response_bytes = 0;
+size_t web_peak_bytes = 0;
+int64_t web_leaked_bytes = 0;
+const uint8_t max_sse_clients = 8;
+AsyncEventSourceClient *sse_clients[max_sse_clients];
+uint8_t num_sse_clients = 0;
+uint32_t num_sse_invalid = 0;
+char latest_json[8192];
+uint64_t latest_allocs = 0;
+bool latest_ok = false;
+std::chrono::steady_clock::time_point host_start;
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    num_failures++;
+  }
+}
+
+void load_data_dir() {
+  DIR *dir = opendir(options.data_dir);
+  if (dir == nullptr) {
+    return;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    char path[256];
+    const int path_length =
+        snprintf(path, sizeof(path), "%s/%s", options.data_dir, entry->d_name);
+    FILE *in = path_length < (int)sizeof(path) ? fopen(path, "rb") : nullptr;
+    if (entry->d_name[0] == '.' || in == nullptr) {
+      if (in != nullptr) {
+        fclose(in);
+      }
+      continue;
+    }
+    char name[sizeof(SimFile::path)];
+    if (snprintf(name, sizeof(name), "/%s", entry->d_name) >=
+        (int)sizeof(name)) {
+      fclose(in);
+      continue;
+    }
+    File file = LittleFS.open(name, "w");
+    uint8_t chunk[512];
+    size_t length;
+    while ((length = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+      file.write(chunk, length);
+    }
+    file.close();
+    fclose(in);
+  }
+  closedir(dir);
+}
+
+// A whole page was streamed
+bool is_complete_page(AsyncWebServerResponse *response) {
+  AsyncChunkedResponse *chunked =
+      dynamic_cast<AsyncChunkedResponse *>(response);
+  if (chunked == nullptr) {
+    return true;
+  }
+  const char *tail = chunked->sim_tail();
+  const size_t length = strlen(tail);
+  return length >= 8 && strcmp(tail + length - 8, "</html>\n") == 0;
+}
+
+// The station's page, as a browser would request it, then again with its ETag
+// as a browser revalidating it. Nothing is logged in between, so it must be
+// answered with 304.
+void request_web_page() {
+  const AllocStats before = alloc_stats;
+  reset_alloc_peak();
+  AsyncWebServerRequest *request =
+      web_server.sim_request(new AsyncWebServerRequest(HTTP_GET, "/"));
+  AsyncWebServerResponse *response = request->sim_response();
+  num_web_requests++;
+  String etag;
+  if (response == nullptr || response->code() != 200 ||
+      !is_complete_page(response)) {
+    num_web_errors++;
+  } else {
+    web_response_bytes += response->contentLength();
+    if (AsyncWebHeader *header = response->header("ETag")) {
+      etag = header->value();
+    }
+  }
+  delete request;
+
+  if (etag.length() > 0) {
+    request = new AsyncWebServerRequest(HTTP_GET, "/");
+    request->sim_add_header("If-None-Match", etag);
+    response = web_server.sim_request(request)->sim_response();
+    num_web_revalidations++;
+    if (response != nullptr && response->code() == 304) {
+      num_web_not_modified++;
+    }
+    delete request;
+  }
+  etag = String();
+  web_allocs += alloc_stats.num_allocs - before.num_allocs;
+  web_peak_bytes = max(web_peak_bytes, heap_bytes(alloc_stats.peak_bytes));
+  web_leaked_bytes += (int64_t)alloc_stats.live_bytes - before.live_bytes;
+}
+
+// The stylesheet must be the gzipped file, cached by the browser
+bool check_static_assets() {
+  AsyncWebServerRequest *request = web_server.sim_request(
+      new AsyncWebServerRequest(HTTP_GET, "/style.css"));
+  AsyncWebServerResponse *response = request->sim_response();
+  const bool ok = response != nullptr && response->code() == 200 &&
+                  response->header("Content-Encoding") != nullptr &&
+                  response->header("Cache-Control") != nullptr;
+  delete request;
+  return ok;
+}
+
+// Read the events waiting for each client, the slow one only when it is due
+void read_live_events(bool slow_is_due) {
+  for (uint8_t i = 0; i < num_sse_clients; i++) {
+    if (i == num_sse_clients - 1 && num_sse_clients > 1 && !slow_is_due) {
+      break;
+    }
+    char message[256];
+    while (sse_clients[i]->sim_read(message, sizeof(message))) {
+      const char *data = strstr(message, "\r\ndata: ");
+      StaticJsonDocument<512> event;
+      if (strncmp(message, "event: frame\r\n", 14) != 0 || data == nullptr ||
+          deserializeJson(event, data + 8) ||
+          !event["sensor_id"].is<int>() || event["values"].size() == 0) {
+        num_sse_invalid++;
+      }
+    }
+  }
+}
+
+// /api/latest must have every magnitude the server got measurements for, at
+// least as recent as the last one the server got, with the value as a string
+// like the uploads
+bool request_latest_measurements() {
+  AsyncChunkedResponse::Capture &capture = AsyncChunkedResponse::sim_capture();
+  capture.buffer = latest_json;
+  capture.size = sizeof(latest_json);
+  latest_json[0] = '\0';
+  const AllocStats before = alloc_stats;
+  AsyncWebServerRequest *request = web_server.sim_request(
+      new AsyncWebServerRequest(HTTP_GET, "/api/latest"));
+  AsyncWebServerResponse *response = request->sim_response();
+  const bool ok = response != nullptr && response->code() == 200 &&
+                  response->header("Access-Control-Allow-Origin") != nullptr;
+  delete request;
+  latest_allocs = alloc_stats.num_allocs - before.num_allocs;
+  capture.buffer = nullptr;
+  capture.size = 0;
+
+  DynamicJsonDocument latest(4 * sizeof(latest_json));
+  if (!ok || deserializeJson(latest, latest_json) ||
+      !latest.is<JsonArray>()) {
+    return false;
+  }
+  for (uint8_t i = 0; i < rest_server.num_sensors; i++) {
+    const ServerSensor &sensor = rest_server.sensors[i];
+    for (uint8_t j = 0; j < sensor.num_magnitudes; j++) {
+      const ServerMagnitude &magnitude = sensor.magnitudes[j];
+      bool found = magnitude.num_measurements == 0;
+      for (JsonObject measurement : latest.as<JsonArray>()) {
+        found = found || ((measurement["sensor_id"] | 0) == sensor.id &&
+                          (measurement["magnitude_id"] | 0) == magnitude.id &&
+                          (measurement["timestamp"] | 0L) >=
+                              (long)magnitude.last_timestamp &&
+                          measurement["value"].is<const char *>());
+      }
+      if (!found) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void print_loop_stats(const char *name, const LoopStats &stats) {
+  printf("%s_loops: %u\n", name, stats.num_loops);
+  printf("%s_allocs_per_loop: %.2f\n", name,
+         stats.num_loops ? (double)stats.allocs / stats.num_loops : 0.0);
+  printf("%s_http_client_allocs_per_loop: %.2f\n", name,
+         stats.num_loops ? (double)stats.http_client_allocs / stats.num_loops
+                         : 0.0);
+  printf("%s_max_loop_ms: %.3f\n", name, stats.max_loop_us / 1000.0);
+}
+
+void print_report() {
+  const size_t peak_bytes = heap_bytes(alloc_stats.peak_bytes);
+  const size_t end_bytes = heap_bytes(alloc_stats.live_bytes);
+  const uint64_t run_us = now_us - setup_us;
+  printf("sim_seconds: %.3f\n", run_us / 1e6);
+  printf("setup_ms: %.3f\n", setup_us / 1000.0);
+  printf("setup_allocs: %llu\n", (unsigned long long)setup_allocs);
+  printf("setup_heap_bytes: %zu\n", setup_heap_bytes);
+  print_loop_stats("idle", idle_loops);
+  print_loop_stats("upload", upload_loops);
+  printf("peak_heap_bytes: %zu\n", peak_bytes);
+  printf("end_heap_bytes: %zu\n", end_bytes);
+  printf("heap_growth_bytes: %lld\n",
+         (long long)end_bytes - (long long)first_minute_heap_bytes);
+  printf("min_free_heap_bytes: %u\n",
+         peak_bytes < sim_heap_size ? (unsigned)(sim_heap_size - peak_bytes)
+                                    : 0);
+  printf("http_requests: %u\n", rest_server.num_requests);
+  printf("http_blocked_ms: %.3f\n", http_us / 1000.0);
+  printf("measurement_posts: %u\n", rest_server.num_measurement_posts);
+  printf("failed_posts: %u\n", rest_server.num_failed_posts);
+  printf("rejected_posts: %u\n", rest_server.num_rejected_posts);
+  printf("measurements: %u\n", rest_server.num_measurements);
+  printf("measurements_out_of_order: %u\n", rest_server.num_out_of_order);
+  printf("unregistered_measurements: %u\n", num_unregistered_measurements);
+  printf("bytes_per_measurement: %.1f\n",
+         rest_server.num_measurements
+             ? (double)rest_server.measurement_bytes /
+                   rest_server.num_measurements
+             : 0.0);
+  for (uint8_t i = 0; i < rest_server.num_sensors; i++) {
+    const ServerSensor &sensor = rest_server.sensors[i];
+    uint32_t num_measurements = 0;
+    for (uint8_t j = 0; j < sensor.num_magnitudes; j++) {
+      num_measurements += sensor.magnitudes[j].num_measurements;
+    }
+    printf("measurements_%s: %u\n", sensor.name, num_measurements);
+  }
+  printf("i2c_bus_ms: %.3f\n", i2c_bus_us / 1000.0);
+  printf("i2c_nacks: %u\n", i2c_nacks);
+#ifdef HAS_P1
+  printf("p1_telegrams: %u\n", p1_meter.num_telegrams);
+  printf("p1_rx_dropped_bytes: %u\n", Serial.num_dropped - setup_dropped);
+#endif
+  printf("serial_tx_bytes: %llu\n", (unsigned long long)serial_tx_bytes);
+  printf("serial_tx_blocked_ms: %.3f\n", serial_tx_blocked_us / 1000.0);
+  printf("web_requests: %u\n", num_web_requests);
+  printf("web_allocs_per_request: %.2f\n",
+         num_web_requests ? (double)web_allocs / num_web_requests : 0.0);
+  printf("web_bytes_per_response: %.1f\n",
+         num_web_requests ? (double)web_response_bytes / num_web_requests
+                          : 0.0);
+  printf("web_not_modified: %u of %u\n", num_web_not_modified,
+         num_web_revalidations);
+  printf("web_peak_heap_bytes: %zu\n", web_peak_bytes);
+  printf("web_leaked_bytes: %lld\n", (long long)web_leaked_bytes);
+  printf("latest_bytes: %zu\n", strlen(latest_json));
+  printf("latest_allocs: %llu\n", (unsigned long long)latest_allocs);
+  printf("sse_clients: %u\n", num_sse_clients);
+  printf("sse_events: %u\n", num_live_events);
+  printf("sse_frames_dropped: %u\n", num_live_dropped);
+  for (uint8_t i = 0; i < num_sse_clients; i++) {
+    printf("sse_client_%u: %u received, %u dropped\n", i,
+           sse_clients[i]->num_received, sse_clients[i]->num_dropped);
+  }
+  printf("sse_allocs_per_event: %.2f\n",
+         num_live_events ? (double)live_events.sim_allocs / num_live_events
+                         : 0.0);
+  const double host_s = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - host_start)
+                            .count();
+  printf("host_seconds: %.3f\n", host_s);
+  printf("host_ns_per_loop: %.1f\n",
+         1e9 * host_s / max(1u, idle_loops.num_loops + upload_loops.num_loops));
+}
+
+void sim_restart() {
+  print_report();
+  printf("restarted_at_s: %.3f\n", now_us / 1e6);
+  fflush(stdout);
+  exit(3);
+}
+
+bool parse_options(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *option = argv[i];
+    if (strcmp(option, "--echo") == 0) {
+      options.echo = true;
+      continue;
+    }
+    if (strcmp(option, "--deployed-p1") == 0) {
+      options.deployed_p1 = true;
+      continue;
+    }
+    if (strcmp(option, "--fixed-magnitudes") == 0) {
+      options.fixed_magnitudes = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      return false;
+    }
+    const char *value = argv[++i];
+    if (strcmp(option, "--data") == 0) {
+      options.data_dir = value;
+      continue;
+    }
+    uint32_t *number = nullptr;
+    if (strcmp(option, "--duration-s") == 0) {
+      number = &options.duration_s;
+    } else if (strcmp(option, "--loop-us") == 0) {
+      number = &options.loop_us;
+    } else if (strcmp(option, "--http-latency-ms") == 0) {
+      number = &options.http_latency_ms;
+    } else if (strcmp(option, "--fail-every") == 0) {
+      number = &options.fail_every;
+    } else if (strcmp(option, "--web-every-s") == 0) {
+      number = &options.web_every_s;
+    } else if (strcmp(option, "--sse-clients") == 0) {
+      number = &options.sse_clients;
+    } else {
+      return false;
+    }
+    *number = strtoul(value, nullptr, 10);
+  }
+  return options.loop_us > 0;
+}
+
+int main(int argc, char **argv) {
+  if (!parse_options(argc, argv)) {
+    fprintf(stderr, "usage: %s [--duration-s N] [--loop-us N] "
+                    "[--http-latency-ms N] [--fail-every N] "
+                    "[--web-every-s N] [--sse-clients N] [--data DIR] "
+                    "[--deployed-p1] [--fixed-magnitudes] [--echo]\n",
+            argv[0]);
+    return 2;
+  }
+  // The report must not allocate stdio buffers while the heap is counted
+  static char stdout_buffer[BUFSIZ];
+  setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+  load_data_dir();
+  if (options.deployed_p1) {
+    rest_server.add_deployed_p1();
+  }
+  host_start = std::chrono::steady_clock::now();
+
+  const AllocStats before_setup = alloc_stats;
+  heap_base_bytes = alloc_stats.live_bytes;
+  heap_base_known = true;
+  setup();
+  setup_us = now_us;
+  setup_allocs = alloc_stats.num_allocs - before_setup.num_allocs;
+  setup_heap_bytes = heap_bytes(alloc_stats.live_bytes);
+  setup_dropped = Serial.num_dropped;
+  for (uint32_t i = 0; i < options.sse_clients && i < max_sse_clients; i++) {
+    if (AsyncEventSourceClient *client = live_events.sim_connect()) {
+      sse_clients[num_sse_clients++] = client;
+    }
+  }
+  reset_alloc_peak();
+
+  const uint64_t end_us = setup_us + (uint64_t)options.duration_s * 1000000;
+  uint64_t next_web_us = setup_us;
+  uint64_t next_slow_sse_us = setup_us;
+  bool first_minute = true;
+  while (now_us < end_us) {
+    const uint64_t start_us = now_us;
+    const uint64_t start_allocs = alloc_stats.num_allocs;
+    const uint32_t start_posts = rest_server.num_measurement_posts;
+    const uint64_t start_sse_allocs = live_events.sim_allocs;
+    const uint64_t start_http_allocs = http.sim_allocs;
+    loop();
+    LoopStats &stats = rest_server.num_measurement_posts != start_posts
+                           ? upload_loops
+                           : idle_loops;
+    stats.num_loops++;
+    stats.allocs += alloc_stats.num_allocs - start_allocs -
+                    (live_events.sim_allocs - start_sse_allocs);
+    stats.http_client_allocs += http.sim_allocs - start_http_allocs;
+    stats.max_loop_us = max(stats.max_loop_us, now_us - start_us);
+
+    if (options.web_every_s > 0 && now_us >= next_web_us) {
+      const size_t peak_bytes = alloc_stats.peak_bytes;
+      request_web_page();
+      alloc_stats.peak_bytes = max(peak_bytes, alloc_stats.peak_bytes);
+      next_web_us += (uint64_t)options.web_every_s * 1000000;
+    }
+    const bool slow_sse_is_due = now_us >= next_slow_sse_us;
+    read_live_events(slow_sse_is_due);
+    if (slow_sse_is_due) {
+      next_slow_sse_us += 30000000;
+    }
+    if (first_minute && now_us >= setup_us + 60000000) {
+      first_minute_heap_bytes = heap_bytes(alloc_stats.live_bytes);
+      first_minute = false;
+    }
+    sim_advance_us(options.loop_us);
+  }
+
+  read_live_events(true);
+  latest_ok = request_latest_measurements();
+  print_report();
+  // With --fixed-magnitudes every magnitude may be unknown to the server, the
+  // station must skip them instead of posting them again and again
+  check(rest_server.num_measurements > 0 || options.fixed_magnitudes,
+        "no measurements were accepted");
+  check(rest_server.num_rejected_posts == 0, "measurements were rejected");
+  check(rest_server.num_out_of_order == 0, "measurements out of order");
+  check(num_unregistered_measurements == 0 || options.fixed_magnitudes,
+        "measurements of unregistered magnitudes weren't sent");
+  check(num_web_errors == 0, "web page requests failed");
+  check(num_web_not_modified == num_web_revalidations,
+        "an unchanged web page was sent again");
+  check(!LittleFS.exists("/style.css.gz") || check_static_assets(),
+        "style.css wasn't served gzipped with a cache lifetime");
+  // The core's HTTPClient allocates for every request, the station's own
+  // upload code must not
+  check(upload_loops.allocs == upload_loops.http_client_allocs,
+        "the upload cycle allocated on the heap outside HTTPClient");
+  check(latest_ok, "/api/latest missed the latest measurements");
+  check(num_sse_invalid == 0, "invalid live events were sent");
+  for (uint8_t i = 0; i + 1 < num_sse_clients; i++) {
+    check(sse_clients[i]->num_received == num_live_events,
+          "a live client that keeps up missed events");
+  }
+  check(first_minute || options.duration_s < 60 ||
+            heap_bytes(alloc_stats.live_bytes) <= first_minute_heap_bytes,
+        "the heap grew after the first minute");
+  printf("failures: %u\n", num_failures);
+  return num_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// Hooks between the stand-in libraries, compiled with the station code, and
+// the simulated world in sim.cpp: clock, UART, I2C devices and rest_server.
+#include <cstddef>
+#include <cstdint>
+
+// Simulated clock, starts at sim_start_epoch UTC. Everything that blocks on
+// the device (delays, I2C transfers, HTTP requests, a full serial TX FIFO)
+// advances it, and the world (P1 meter, sensors) is updated as it goes.
+const uint32_t sim_start_epoch = 1622505600; // 2021-06-01 00:00:00 UTC
+uint64_t sim_now_us();
+void sim_advance_us(uint64_t us);
+uint32_t sim_epoch();
+
+// I2C transactions, false on NACK / number of bytes read
+bool sim_i2c_write(uint8_t address, const uint8_t *data, size_t len);
+size_t sim_i2c_read(uint8_t address, uint8_t *data, size_t len);
+
+// CCS811 library stand-in, true if a new result is ready
+bool sim_ccs811_read(uint16_t *eco2, uint16_t *etvoc, uint16_t *raw);
+bool sim_ccs811_set_baseline(uint16_t baseline);
+uint16_t sim_ccs811_baseline();
+
+// Blocking HTTP request to the fake rest_server. The response is valid until
+// the next request.
+typedef struct {
+  int code;
+  const char *body;
+  const char *location;
+} SimHttpResponse;
+SimHttpResponse sim_http_request(const char *method, const char *uri,
+                                 const uint8_t *payload, size_t size);
+
+// Serial output of the station
+void sim_serial_write(const uint8_t *data, size_t len);
+
+// Heap as seen by ESP.getFreeHeap() and friends
+uint32_t sim_free_heap();
+// Allocations of the station so far
+uint64_t sim_num_allocs();
+
+[[noreturn]] void sim_restart();
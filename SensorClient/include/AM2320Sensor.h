@@ -1,23 +1,26 @@
 #pragma once
 
 #include "common_sensor.h"
+#include "i2c_scheduler.h"
+#include "latest_value_bus.h"
 #include "logging.h"
 #include <AM232X.h>
 #include <ArduinoJson.h>
 #include <Ticker.h>
 
-class AMS2320Sensor : public Sensor {
+class AMS2320Sensor : public Sensor, public I2CDevice {
 public:
   AMS2320Sensor(const char *name, uint32_t period_s, size_t capacity,
-                size_t response_capacity)
-      : Sensor(name, period_s, capacity, response_capacity) {}
+                size_t response_capacity, I2CBus &bus = i2c_bus)
+      : Sensor(name, period_s, capacity, response_capacity),
+        I2CDevice(name, bus) {}
 
   bool setup() {
-    log_println("Setting up AM2320 sensor...");
+    log_println(F("Setting up AM2320 sensor..."));
     if (!am2320.begin()) {
       delay(100);
       if (!am2320.isConnected()) {
-        log_println("  AM2320 begin FAILED");
+        log_println(F("  AM2320 begin FAILED"));
         return false;
       }
     }
@@ -33,82 +36,99 @@ public:
                       am2320.getModel(), am2320.getVersion(),
                       am2320.getDeviceID());
 
+    i2c_scheduler.add(this);
     return true;
   }
 
-  void measure() {
-    log_println("Measuring AM2320...");
-    int conversion_ret_val;
+  void measure() { i2c_scheduler.request(this); }
+
+  // The sensor sleeps between reads and doesn't acknowledge the wake up call.
+  uint32_t trigger() {
+    log_println(F("Measuring AM2320..."));
+    bus.write(address, nullptr, 0);
+    command_sent = false;
+    return 1;
+  }
+
+  uint32_t collect() {
+    if (!command_sent) {
+      // Read 4 registers from 0x00: humidity and temperature
+      const uint8_t command[] = {read_function, 0x00, 0x04};
+      if (!bus.write(address, command, sizeof(command))) {
+        log_println(F("  Error sending the AM2320 read command."));
+        num_measurement_errors++;
+        return i2c_done;
+      }
+      command_sent = true;
+      return 2;
+    }
+
     time_t now = UTC.now();
     float temperature, humidity;
 
-    int status = am2320.read();
-    if (status != AM232X_OK) {
-      log_printf("  Error reading AM2320 (%d).\n", status);
+    // Response: function, length, 4 data bytes, CRC (LSB first)
+    uint8_t response[8];
+    if (!bus.read(address, response, sizeof(response))) {
+      log_println(F("  Error reading AM2320."));
+      num_measurement_errors++;
+      return i2c_done;
+    }
+    if (response[0] != read_function || response[1] != sizeof(response) - 4) {
+      log_println(F("  Error reading AM2320 (header)."));
       num_measurement_errors++;
-      return;
+      return i2c_done;
+    }
+    if (crc16(response, 6) != (response[6] | response[7] << 8)) {
+      log_println(F("  Error reading AM2320 (CRC)."));
+      num_measurement_errors++;
+      return i2c_done;
     }
 
     // sensor
-    humidity = am2320.getHumidity();
-    temperature = am2320.getTemperature();
-
-    SensorData humidity_data = {now, id, hum_id};
-    conversion_ret_val = snprintf(
-        humidity_data.value, sizeof(humidity_data.value), "%.3f", humidity);
-    if (conversion_ret_val > 0) {
-      log_printf("  Humidity: %.2f %%.\n", humidity);
-      sensor_buffer.push(humidity_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
-    } else {
-      log_printf("  Problem converting humidity (%.2f %%) to char[].\n",
-                 humidity);
+    humidity = (response[2] << 8 | response[3]) / 10.0;
+    const uint16_t raw_temperature = response[4] << 8 | response[5];
+    temperature = (raw_temperature & 0x7FFF) / 10.0;
+    if (raw_temperature & 0x8000) {
+      temperature = -temperature;
     }
 
-    SensorData temperature_data = {now, id, temp_id};
-    conversion_ret_val =
-        snprintf(temperature_data.value, sizeof(temperature_data.value), "%.3f",
-                 temperature);
-    if (conversion_ret_val > 0) {
-      log_printf("  Temperature: %.2f C.\n", temperature);
-      sensor_buffer.push(temperature_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
-    } else {
-      log_printf("  Problem converting temperature (%.2f C) to char[].\n",
-                 temperature);
-    }
+    log_printf("  Humidity: %.2f %%.\n", humidity);
+    log_printf("  Temperature: %.2f C.\n", temperature);
+    SensorFrame frame = {now, id, 0, 2};
+    frame.values[0] = to_fixed(temperature, 3);
+    frame.values[1] = to_fixed(humidity, 3);
+    queue_frame(frame);
+    latest_values.publish(Quantity::temperature, temperature, now);
+    latest_values.publish(Quantity::humidity, humidity, now);
+    return i2c_done;
   }
 
   void setup_json(JsonObject &sensor_json) {
-    sensor_json["name"] = name;
+    sensor_json[JSON_KEY(name)] = name;
     JsonArray sensor_1_in_magnitudes =
-        sensor_json.createNestedArray("magnitudes");
+        sensor_json.createNestedArray(JSON_KEY(magnitudes));
 
     JsonObject mag1_in = sensor_1_in_magnitudes.createNestedObject();
-    mag1_in["name"] = "temperature";
-    mag1_in["unit"] = "C";
-    mag1_in["precision"] = 0.1;
+    mag1_in[JSON_KEY(name)] = FPSTR(magnitude_temperature);
+    mag1_in[JSON_KEY(unit)] = "C";
+    mag1_in[JSON_KEY(precision)] = 0.1;
 
     JsonObject mag2_in = sensor_1_in_magnitudes.createNestedObject();
-    mag2_in["name"] = "humidity";
-    mag2_in["unit"] = "%";
-    mag2_in["precision"] = 0.1;
+    mag2_in[JSON_KEY(name)] = FPSTR(magnitude_humidity);
+    mag2_in[JSON_KEY(unit)] = "%";
+    mag2_in[JSON_KEY(precision)] = 0.1;
   }
 
   bool parse_json(JsonObject &sensor_json_response) {
-    id = sensor_json_response["id"];
+    id = sensor_json_response[JSON_KEY(id)];
     JsonArray magnitudes_json =
-        sensor_json_response["magnitudes"].as<JsonArray>();
+        sensor_json_response[JSON_KEY(magnitudes)].as<JsonArray>();
     for (JsonObject mag_json : magnitudes_json) {
-      const char *name = mag_json["name"];
-      if (strcmp(name, "temperature") == 0) {
-        temp_id = mag_json["id"];
-      } else if (strcmp(name, "humidity") == 0) {
-        hum_id = mag_json["id"];
+      const char *name = mag_json[JSON_KEY(name)] | "";
+      if (strcmp_P(name, magnitude_temperature) == 0) {
+        temp_id = mag_json[JSON_KEY(id)];
+      } else if (strcmp_P(name, magnitude_humidity) == 0) {
+        hum_id = mag_json[JSON_KEY(id)];
       }
     }
     log_printf(
@@ -121,9 +141,26 @@ public:
     return true;
   }
 
+  uint8_t magnitude_id(uint8_t index) { return index == 0 ? temp_id : hum_id; }
+  uint8_t magnitude_decimals(uint8_t index) { return 3; }
+
 private:
   uint8_t temp_id, hum_id;
   AM232X am2320;
+  const uint8_t address = 0x5C;
+  static const uint8_t read_function = 0x03;
+  bool command_sent = false;
+
+  uint16_t crc16(const uint8_t *buf, uint8_t len) {
+    uint16_t crc = 0xFFFF;
+    for (uint8_t pos = 0; pos < len; pos++) {
+      crc ^= buf[pos];
+      for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+      }
+    }
+    return crc;
+  }
 };
 
 AMS2320Sensor am2320_sensor("AM2320", 10,
@@ -1,43 +1,47 @@
 #pragma once
 
+#include "LittleFS.h"
 #include "ccs811.h" // CCS811 library
 #include "common_sensor.h"
+#include "i2c_scheduler.h"
+#include "latest_value_bus.h"
 #include "logging.h"
 #include <ArduinoJson.h>
 #include <Ticker.h>
 
-class CCS811Sensor : public Sensor {
+class CCS811Sensor : public Sensor, public I2CDevice {
 public:
   CCS811Sensor(const char *name, uint32_t period_s, size_t capacity,
-               size_t response_capacity)
-      : Sensor(name, period_s, capacity, response_capacity){};
+               size_t response_capacity, I2CBus &bus = i2c_bus)
+      : Sensor(name, period_s, capacity, response_capacity),
+        I2CDevice(name, bus){};
 
   void setup_json(JsonObject &sensor_json) {
-    sensor_json["name"] = name;
+    sensor_json[JSON_KEY(name)] = name;
     JsonArray sensor_1_in_magnitudes =
-        sensor_json.createNestedArray("magnitudes");
+        sensor_json.createNestedArray(JSON_KEY(magnitudes));
 
     JsonObject mag1_in = sensor_1_in_magnitudes.createNestedObject();
-    mag1_in["name"] = "eco2";
-    mag1_in["unit"] = "ppm";
-    mag1_in["precision"] = 1;
+    mag1_in[JSON_KEY(name)] = FPSTR(magnitude_eco2);
+    mag1_in[JSON_KEY(unit)] = "ppm";
+    mag1_in[JSON_KEY(precision)] = 1;
 
     JsonObject mag2_in = sensor_1_in_magnitudes.createNestedObject();
-    mag2_in["name"] = "etvoc";
-    mag2_in["unit"] = "ppb";
-    mag2_in["precision"] = 1;
+    mag2_in[JSON_KEY(name)] = FPSTR(magnitude_etvoc);
+    mag2_in[JSON_KEY(unit)] = "ppb";
+    mag2_in[JSON_KEY(precision)] = 1;
   }
 
   bool parse_json(JsonObject &sensor_json_response) {
-    id = sensor_json_response["id"];
+    id = sensor_json_response[JSON_KEY(id)];
     JsonArray magnitudes_json =
-        sensor_json_response["magnitudes"].as<JsonArray>();
+        sensor_json_response[JSON_KEY(magnitudes)].as<JsonArray>();
     for (JsonObject mag_json : magnitudes_json) {
-      const char *name = mag_json["name"];
-      if (strcmp(name, "eco2") == 0) {
-        eco2_id = mag_json["id"];
-      } else if (strcmp(name, "etvoc") == 0) {
-        etvoc_id = mag_json["id"];
+      const char *name = mag_json[JSON_KEY(name)] | "";
+      if (strcmp_P(name, magnitude_eco2) == 0) {
+        eco2_id = mag_json[JSON_KEY(id)];
+      } else if (strcmp_P(name, magnitude_etvoc) == 0) {
+        etvoc_id = mag_json[JSON_KEY(id)];
       }
     }
     log_printf(
@@ -53,11 +57,11 @@ public:
     log_printf("Setting up CCS811 sensor (version %d)...\n", CCS811_VERSION);
 
     // Enable CCS811
-    ccs811.set_i2cdelay(20); // Needed for ESP8266 because it doesn't handle I2C
-                             // clock stretch correctly
+    // Needed for ESP8266 because it doesn't handle I2C clock stretch correctly
+    ccs811.set_i2cdelay(i2c_delay_us);
     bool ok = ccs811.begin();
     if (!ok) {
-      log_println("  CCS811 begin FAILED");
+      log_println(F("  CCS811 begin FAILED"));
       return false;
     }
 
@@ -69,81 +73,280 @@ public:
     // Start measuring
     ok = ccs811.start(CCS811_MODE_10SEC);
     if (!ok) {
-      log_println("  CCS811 start FAILED");
+      log_println(F("  CCS811 start FAILED"));
       return false;
     }
 
+#ifdef CCS811_INT_PIN
+    // Signal new results on the nINT pin (MEAS_MODE INT_DATARDY bit)
+    ok = bus.write_register(address, meas_mode_reg,
+                            CCS811_MODE_10SEC << 4 | int_data_ready);
+    if (!ok) {
+      log_println(F("  CCS811 data ready interrupt FAILED"));
+      return false;
+    }
+    pinMode(CCS811_INT_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(CCS811_INT_PIN), on_data_ready,
+                    FALLING);
+#endif
+
+    load_baseline();
+
     delay(500);
-    log_println("  Done!");
+    log_println(F("  Done!"));
     log_header_printf("CCS811 setup. lib v. %d, hw v.: 0x%X, "
                       "bootldr v.: 0x%X, app v.: 0x%X.",
                       CCS811_VERSION, ccs811.hardware_version(),
                       ccs811.bootloader_version(),
                       ccs811.application_version());
+    i2c_scheduler.add(this);
     return true;
   }
 
-  void measure() {
-    log_println("Measuring CCS811...");
-    int conversion_ret_val;
+  void measure() { i2c_scheduler.request(this); }
+
+  void watchdog() {
+    const uint32_t uptime_s = millis() / 1000;
+    if (baseline_pending && uptime_s >= warm_up_s) {
+      restore_baseline();
+    }
+    const uint32_t min_uptime_s = baseline_restored ? save_period_s : burn_in_s;
+    if (uptime_s >= min_uptime_s &&
+        UTC.now() - last_baseline_check >= save_period_s) {
+      save_baseline();
+    }
+  }
+
+  // Once triggered the reads follow the sensor's own cadence: collect() keeps
+  // rescheduling itself for the next result and only finishes on errors, after
+  // which the measurement timer requests a new read.
+  uint32_t trigger() { return 0; }
+
+  uint32_t collect() {
+#ifdef CCS811_INT_PIN
+    if (!data_ready) {
+      return data_ready_poll_ms;
+    }
+    data_ready = false;
+#else
+    // Poll the 1 byte STATUS register, the 8 bytes of the result are only read
+    // once DATA_READY is set
+    uint8_t status;
+    if (!read_status(status)) {
+      num_measurement_errors++;
+      log_println(F("CCS811 STATUS read FAILED"));
+      return i2c_done;
+    }
+    if (!(status & status_data_ready) && retry_no_data()) {
+      return no_data_retry_ms;
+    }
+#endif
     time_t now = UTC.now();
+    update_envdata(now);
 
     // sensor
     uint16_t eco2, etvoc, errstat, raw;
     ccs811.read(&eco2, &etvoc, &errstat, &raw);
 
+    // The result isn't there yet, not an error unless it never comes
+    if (errstat == CCS811_ERRSTAT_OK_NODATA && retry_no_data()) {
+      return no_data_retry_ms;
+    }
+    num_no_data = 0;
+
+    log_println(F("Measuring CCS811..."));
     // Check for errors
     if (errstat != CCS811_ERRSTAT_OK) {
       num_measurement_errors++;
       if (errstat == CCS811_ERRSTAT_OK_NODATA) {
-        log_println("  error: waiting for (new) data");
+        log_println(F("  error: no new data"));
       } else if (errstat & CCS811_ERRSTAT_I2CFAIL) {
-        log_println("  I2C error");
+        log_println(F("  I2C error"));
       } else {
         log_printf("  other error: errstat (%X) =", errstat);
         log_println(ccs811.errstat_str(errstat));
       }
-      return;
+      return i2c_done;
     }
 
-    SensorData eco2_data = {now, id, eco2_id};
-    conversion_ret_val =
-        snprintf(eco2_data.value, sizeof(eco2_data.value), "%d", eco2);
-    if (conversion_ret_val > 0) {
-      log_printf("  equivalent CO2: %d ppm.\n", eco2);
-      sensor_buffer.push(eco2_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
-    } else {
-      log_printf("  Problem converting equivalent CO2 (%d ppm) to char[].\n",
-                 eco2);
-    }
-
-    SensorData etvoc_data = {now, id, etvoc_id};
-    conversion_ret_val =
-        snprintf(etvoc_data.value, sizeof(etvoc_data.value), "%d", etvoc);
-    if (conversion_ret_val > 0) {
-      log_printf("  total VOC: %d ppb.\n", etvoc);
-      sensor_buffer.push(etvoc_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
-    } else {
-      log_printf("  Problem converting total VOC (%d ppb) to char[].\n", etvoc);
-    }
+    log_printf("  equivalent CO2: %d ppm.\n", eco2);
+    log_printf("  total VOC: %d ppb.\n", etvoc);
+    SensorFrame frame = {now, id, 0, 2};
+    frame.values[0] = eco2;
+    frame.values[1] = etvoc;
+    queue_frame(frame);
+
+#ifdef CCS811_INT_PIN
+    return data_ready_poll_ms;
+#else
+    // Aim a bit before the next result, a late read would drift further behind
+    return period_s * 1000 - 2 * no_data_retry_ms;
+#endif
+  }
+
+  uint8_t magnitude_id(uint8_t index) {
+    return index == 0 ? eco2_id : etvoc_id;
   }
+  uint8_t magnitude_decimals(uint8_t index) { return 0; }
 
-  void correct_ccs811_envdata(float humidity, float temperature) {
-    ccs811.set_envdata(((uint16_t)humidity + 250) / 500,
-                       ((uint16_t)temperature + 25250) / 500);
+  // ENV_DATA format: humidity in 1/512 %RH, temperature in 1/512 C offset by
+  // 25 C.
+  bool correct_ccs811_envdata(float humidity, float temperature) {
+    return ccs811.set_envdata((temperature + 25) * 512, humidity * 512);
   }
 
   // CCS811 Sensor
   uint8_t eco2_id, etvoc_id;
   CCS811 ccs811;
+
+private:
+  const uint32_t no_data_retry_ms = 100;
+  uint8_t num_no_data = 0;
+
+  // Wait for a result up to two periods
+  bool retry_no_data() {
+    return num_no_data++ < 2 * period_s * 1000 / no_data_retry_ms;
+  }
+
+  const uint8_t address = 0x5A;
+  const uint8_t status_reg = 0x00;
+  const uint8_t status_data_ready = 0x08;
+  const uint8_t i2c_delay_us = 20;
+
+  // A register read like those of the library, which waits i2c_delay_us
+  // between the register address and the data for the clock stretch
+  bool read_status(uint8_t &status) {
+    if (!bus.write(address, &status_reg, 1)) {
+      return false;
+    }
+    delayMicroseconds(i2c_delay_us);
+    return bus.read(address, &status, 1);
+  }
+
+  // The baseline learned by the algorithm is kept in flash so a restart doesn't
+  // need a new burn-in. It is restored after the warm up recommended by the
+  // datasheet and checked every save_period_s, only after burn_in_s when it
+  // didn't start from a stored one. Flash is written when the baseline changes
+  // or once a day to refresh its age.
+  const char *baseline_path = "/ccs811_baseline";
+  const uint32_t warm_up_s = 20 * 60;
+  const uint32_t burn_in_s = 24 * 60 * 60;
+  const uint32_t save_period_s = 6 * 60 * 60;
+  const uint32_t refresh_period_s = 24 * 60 * 60;
+  const uint32_t baseline_max_age_s = 7 * 24 * 60 * 60;
+  typedef struct {
+    uint16_t baseline;
+    time_t saved_at;
+  } StoredBaseline;
+  StoredBaseline stored_baseline = {0, 0};
+  time_t last_baseline_check = 0;
+  bool baseline_pending = false, baseline_restored = false;
+
+  void load_baseline() {
+    File file = LittleFS.open(baseline_path, "r");
+    if (!file) {
+      log_header_printf("  CCS811 baseline: none stored.");
+      return;
+    }
+    const size_t size =
+        file.read((uint8_t *)&stored_baseline, sizeof(stored_baseline));
+    file.close();
+    if (size != sizeof(stored_baseline)) {
+      stored_baseline = {0, 0};
+      log_header_printf("  CCS811 baseline: stored file is corrupt.");
+      return;
+    }
+
+    const time_t age_s = max(UTC.now() - stored_baseline.saved_at, (time_t)0);
+    if (age_s > (time_t)baseline_max_age_s) {
+      log_header_printf("  CCS811 baseline: 0x%04X is too old (%d h), "
+                        "not restoring.",
+                        stored_baseline.baseline, (int)(age_s / 3600));
+      return;
+    }
+    baseline_pending = true;
+    log_header_printf("  CCS811 baseline: 0x%04X (%d h old), restoring after "
+                      "%d min warm up.",
+                      stored_baseline.baseline, (int)(age_s / 3600),
+                      warm_up_s / 60);
+  }
+
+  void restore_baseline() {
+    baseline_pending = false;
+    baseline_restored = ccs811.set_baseline(stored_baseline.baseline);
+    if (baseline_restored) {
+      log_header_printf("  CCS811 baseline 0x%04X restored.",
+                        stored_baseline.baseline);
+    } else {
+      log_header_printf("  CCS811 baseline restore FAILED.");
+    }
+  }
+
+  void save_baseline() {
+    uint16_t baseline;
+    if (!ccs811.get_baseline(&baseline)) {
+      log_println(F("CCS811 error reading the baseline."));
+      return;
+    }
+    // Skip the flash write if nothing changed, but keep the stored age low
+    const time_t now = UTC.now();
+    last_baseline_check = now;
+    if (baseline == stored_baseline.baseline &&
+        now - stored_baseline.saved_at < refresh_period_s) {
+      return;
+    }
+
+    File file = LittleFS.open(baseline_path, "w");
+    if (!file) {
+      log_println(F("CCS811 error saving the baseline."));
+      return;
+    }
+    const StoredBaseline new_baseline = {baseline, now};
+    file.write((const uint8_t *)&new_baseline, sizeof(new_baseline));
+    file.close();
+    stored_baseline = new_baseline;
+    log_printf("CCS811 baseline 0x%04X saved.\n", baseline);
+  }
+
+  // Compensate with the values of the co-located sensors, only writing to the
+  // sensor when they change noticeably.
+  const uint32_t envdata_max_age_s = 60;
+  float envdata_humidity = NAN, envdata_temperature = NAN;
+
+  void update_envdata(time_t now) {
+    float humidity, temperature;
+    if (!latest_values.get(Quantity::humidity, humidity, now,
+                           envdata_max_age_s) ||
+        !latest_values.get(Quantity::temperature, temperature, now,
+                           envdata_max_age_s)) {
+      return;
+    }
+    if (fabs(humidity - envdata_humidity) < 1 &&
+        fabs(temperature - envdata_temperature) < 0.5) {
+      return;
+    }
+    if (correct_ccs811_envdata(humidity, temperature)) {
+      log_printf("CCS811 compensation: %.1f %%, %.1f C.\n", humidity,
+                 temperature);
+      envdata_humidity = humidity;
+      envdata_temperature = temperature;
+    }
+  }
+
+#ifdef CCS811_INT_PIN
+  const uint8_t meas_mode_reg = 0x01;
+  const uint8_t int_data_ready = 0x08;
+  const uint32_t data_ready_poll_ms = 50;
+  static volatile bool data_ready;
+
+  static void ICACHE_RAM_ATTR on_data_ready() { data_ready = true; }
+#endif
 };
 
+#ifdef CCS811_INT_PIN
+volatile bool CCS811Sensor::data_ready = false;
+#endif
+
 CCS811Sensor ccs811_sensor("CCS811", 10,
                            JSON_ARRAY_SIZE(2) + JSON_OBJECT_SIZE(2) +
                                2 * JSON_OBJECT_SIZE(3),
@@ -2,42 +2,45 @@
 
 #include "ClosedCube_HDC1080.h" // HDC1080 library
 #include "common_sensor.h"
+#include "i2c_scheduler.h"
+#include "latest_value_bus.h"
 #include "logging.h"
 #include <ArduinoJson.h>
 #include <Ticker.h>
 
-class HDC1080Sensor : public Sensor {
+class HDC1080Sensor : public Sensor, public I2CDevice {
 public:
   HDC1080Sensor(const char *name, uint32_t period_s, size_t capacity,
-                size_t response_capacity)
-      : Sensor(name, period_s, capacity, response_capacity){};
+                size_t response_capacity, I2CBus &bus = i2c_bus)
+      : Sensor(name, period_s, capacity, response_capacity),
+        I2CDevice(name, bus){};
 
   void setup_json(JsonObject &sensor_json) {
-    sensor_json["name"] = name;
+    sensor_json[JSON_KEY(name)] = name;
     JsonArray sensor_1_in_magnitudes =
-        sensor_json.createNestedArray("magnitudes");
+        sensor_json.createNestedArray(JSON_KEY(magnitudes));
 
     JsonObject mag1_in = sensor_1_in_magnitudes.createNestedObject();
-    mag1_in["name"] = "temperature";
-    mag1_in["unit"] = "C";
-    mag1_in["precision"] = 0.2;
+    mag1_in[JSON_KEY(name)] = FPSTR(magnitude_temperature);
+    mag1_in[JSON_KEY(unit)] = "C";
+    mag1_in[JSON_KEY(precision)] = 0.2;
 
     JsonObject mag2_in = sensor_1_in_magnitudes.createNestedObject();
-    mag2_in["name"] = "humidity";
-    mag2_in["unit"] = "%";
-    mag2_in["precision"] = 2;
+    mag2_in[JSON_KEY(name)] = FPSTR(magnitude_humidity);
+    mag2_in[JSON_KEY(unit)] = "%";
+    mag2_in[JSON_KEY(precision)] = 2;
   }
 
   bool parse_json(JsonObject &sensor_json_response) {
-    id = sensor_json_response["id"];
+    id = sensor_json_response[JSON_KEY(id)];
     JsonArray magnitudes_json =
-        sensor_json_response["magnitudes"].as<JsonArray>();
+        sensor_json_response[JSON_KEY(magnitudes)].as<JsonArray>();
     for (JsonObject mag_json : magnitudes_json) {
-      const char *name = mag_json["name"];
-      if (strcmp(name, "temperature") == 0) {
-        temp_id = mag_json["id"];
-      } else if (strcmp(name, "humidity") == 0) {
-        hum_id = mag_json["id"];
+      const char *name = mag_json[JSON_KEY(name)] | "";
+      if (strcmp_P(name, magnitude_temperature) == 0) {
+        temp_id = mag_json[JSON_KEY(id)];
+      } else if (strcmp_P(name, magnitude_humidity) == 0) {
+        hum_id = mag_json[JSON_KEY(id)];
       }
     }
     log_printf(
@@ -54,11 +57,14 @@ public:
     log_printf("Setting up HDC1080 sensor...\n");
 
     // Enable HDC1080
-    hdc1080.begin(0x40);
-    hdc1080.setResolution(HDC1080_RESOLUTION_14BIT, HDC1080_RESOLUTION_14BIT);
+    hdc1080.begin(address);
+    if (!write_config(false)) {
+      log_println(F("  Error writing the configuration."));
+      return false;
+    }
 
     if (hdc1080.readManufacturerId() == 0xFFFF) {
-      log_println("  Communication error!");
+      log_println(F("  Communication error!"));
       return false;
     }
 
@@ -70,73 +76,134 @@ public:
                sernum.serialMid, sernum.serialLast);
 
     delay(500);
-    log_println("  Done!");
+    log_println(F("  Done!"));
     log_header_printf("HDC1080 manufacturer ID v. 0x%X, dev ID: 0x%X, "
                       "serial no.: %02X-%04X-%04X.",
                       hdc1080.readManufacturerId(), hdc1080.readDeviceId(),
                       sernum.serialFirst, sernum.serialMid, sernum.serialLast);
+    i2c_scheduler.add(this);
     return true;
   }
 
-  void measure() {
-    log_println("Measuring HDC1080...");
-    int conversion_ret_val;
+  void measure() { i2c_scheduler.request(this); }
+
+  // In sequential mode one conversion gives temperature and then humidity
+  uint32_t trigger() {
+    log_println(F("Measuring HDC1080..."));
+    if (!start_conversion()) {
+      log_println(F("  Error starting the conversion."));
+      num_measurement_errors++;
+      return i2c_done;
+    }
+    return conversion_time_ms;
+  }
+
+  uint32_t collect() {
     time_t now = UTC.now();
     float temperature, humidity;
 
     // sensor
-    humidity = hdc1080.readHumidity();
-    temperature = hdc1080.readTemperature();
-
-    if (isnan(humidity)) {
-      log_println("  Error reading humidity.");
+    uint8_t data[4];
+    if (!bus.read(address, data, sizeof(data))) {
+      log_println(F("  Error reading the conversion."));
       num_measurement_errors++;
-    } else if (humidity > 99.99) {
-      log_printf("  Error reading humidity (%.1f).\n", humidity);
+      return i2c_done;
+    }
+    temperature = (data[0] << 8 | data[1]) * 165.0 / 65536.0 - 40;
+    humidity = (data[2] << 8 | data[3]) * 100.0 / 65536.0;
+
+#ifdef HDC1080_HEATER
+    if (heater_on) {
+      return heat(now);
+    }
+    if (now < heater_cooldown_until) {
+      log_println(F("  Cooling down after heating, skipping measurement."));
+      return i2c_done;
+    }
+#endif
+
+    // Values are queued in magnitude order: temperature, humidity
+    SensorFrame frame = {now, id, 0, 0};
+
+    if (temperature > 120) {
+      log_printf("  Error reading temperature (%.2f).\n", temperature);
       num_measurement_errors++;
+      frame.first_magnitude = 1;
     } else {
-      SensorData humidity_data = {now, id, hum_id};
-      conversion_ret_val = snprintf(
-          humidity_data.value, sizeof(humidity_data.value), "%.1f", humidity);
-      if (conversion_ret_val > 0) {
-        log_printf("  Humidity: %.1f %%.\n", humidity);
-        sensor_buffer.push(humidity_data);
-        if (num_measurement_errors > 0) {
-          num_measurement_errors--;
-        }
-      } else {
-        log_printf("  Problem converting humidity (%.1f %%) to char[].\n",
-                   humidity);
-      }
+      log_printf("  Temperature: %.2f C.\n", temperature);
+      frame.values[frame.num_values++] = to_fixed(temperature, 2);
+      latest_values.publish(Quantity::temperature, temperature, now);
     }
 
-    if (isnan(temperature)) {
-      log_println("  Error reading temperature.");
-      num_measurement_errors++;
-    } else if (temperature > 120) {
-      log_printf("  Error reading temperature (%.2f).\n", temperature);
+    if (humidity > 99.99) {
+      log_printf("  Error reading humidity (%.1f).\n", humidity);
       num_measurement_errors++;
     } else {
-      SensorData temperature_data = {now, id, temp_id};
-      conversion_ret_val =
-          snprintf(temperature_data.value, sizeof(temperature_data.value),
-                   "%.2f", temperature);
-      if (conversion_ret_val > 0) {
-        log_printf("  Temperature: %.2f C.\n", temperature);
-        sensor_buffer.push(temperature_data);
-        if (num_measurement_errors > 0) {
-          num_measurement_errors--;
-        }
-      } else {
-        log_printf("  Problem converting temperature (%.2f C) to char[].\n",
-                   temperature);
-      }
+      log_printf("  Humidity: %.1f %%.\n", humidity);
+      frame.values[frame.num_values++] = to_fixed(humidity, 1);
+      latest_values.publish(Quantity::humidity, humidity, now);
     }
+
+    if (frame.num_values > 0) {
+      queue_frame(frame);
+    }
+
+#ifdef HDC1080_HEATER
+    if (humidity >= heater_humidity) {
+      log_printf("  Humidity above %.0f %%, heating for %ds.\n",
+                 heater_humidity, heater_duration_s);
+      heater_on = write_config(true);
+      heater_off_at = now + heater_duration_s;
+      return heater_on ? heat(now) : i2c_done;
+    }
+#endif
+    return i2c_done;
   }
 
+  uint8_t magnitude_id(uint8_t index) { return index == 0 ? temp_id : hum_id; }
+  uint8_t magnitude_decimals(uint8_t index) { return index == 0 ? 2 : 1; }
+
   // HDC1080 Sensor
   uint8_t temp_id, hum_id;
   ClosedCube_HDC1080 hdc1080;
+
+private:
+  const uint8_t address = 0x40;
+  // Two 14 bit conversions take 6.35 + 6.5 ms
+  const uint32_t conversion_time_ms = 15;
+
+  // Configuration register: sequential acquisition (bit 12), 14 bit resolution
+  // for both magnitudes and optionally the heater (bit 13)
+  bool write_config(bool heater) {
+    const uint8_t config[] = {0x02, (uint8_t)(heater ? 0x30 : 0x10), 0x00};
+    return bus.write(address, config, sizeof(config));
+  }
+
+  // Pointing to the temperature register triggers the conversion
+  bool start_conversion() {
+    const uint8_t temperature_register = 0x00;
+    return bus.write(address, &temperature_register, 1);
+  }
+
+#ifdef HDC1080_HEATER
+  // The heater only warms up the sensor during conversions, so while it's on
+  // the conversions run back to back and their values are discarded.
+  const float heater_humidity = 95;
+  const uint32_t heater_duration_s = 30;
+  const uint32_t heater_cooldown_s = 60;
+  bool heater_on = false;
+  time_t heater_off_at = 0, heater_cooldown_until = 0;
+
+  uint32_t heat(time_t now) {
+    if (now < heater_off_at && start_conversion()) {
+      return conversion_time_ms;
+    }
+    log_println(F("  Heater off."));
+    heater_on = !write_config(false);
+    heater_cooldown_until = now + heater_cooldown_s;
+    return i2c_done;
+  }
+#endif
 };
 
 HDC1080Sensor hdc1080_sensor("HDC1080", 10,
@@ -1,43 +1,44 @@
 #pragma once
 
-#include "LOLIN_HP303B.h" // HP303B library
 #include "common_sensor.h"
+#include "i2c_scheduler.h"
 #include "logging.h"
 #include <ArduinoJson.h>
 #include <Ticker.h>
 
-class HP303BSensor : public Sensor {
+class HP303BSensor : public Sensor, public I2CDevice {
 public:
   HP303BSensor(const char *name, uint32_t period_s, size_t capacity,
-               size_t response_capacity)
-      : Sensor(name, period_s, capacity, response_capacity){};
+               size_t response_capacity, I2CBus &bus = i2c_bus)
+      : Sensor(name, period_s, capacity, response_capacity),
+        I2CDevice(name, bus){};
 
   void setup_json(JsonObject &sensor_json) {
-    sensor_json["name"] = name;
+    sensor_json[JSON_KEY(name)] = name;
     JsonArray sensor_1_in_magnitudes =
-        sensor_json.createNestedArray("magnitudes");
+        sensor_json.createNestedArray(JSON_KEY(magnitudes));
 
     JsonObject mag1_in = sensor_1_in_magnitudes.createNestedObject();
-    mag1_in["name"] = "temperature";
-    mag1_in["unit"] = "C";
-    mag1_in["precision"] = 0.5;
+    mag1_in[JSON_KEY(name)] = FPSTR(magnitude_temperature);
+    mag1_in[JSON_KEY(unit)] = "C";
+    mag1_in[JSON_KEY(precision)] = 0.5;
 
     JsonObject mag2_in = sensor_1_in_magnitudes.createNestedObject();
-    mag2_in["name"] = "pressure";
-    mag2_in["unit"] = "Pa";
-    mag2_in["precision"] = 10;
+    mag2_in[JSON_KEY(name)] = FPSTR(magnitude_pressure);
+    mag2_in[JSON_KEY(unit)] = "Pa";
+    mag2_in[JSON_KEY(precision)] = 10;
   }
 
   bool parse_json(JsonObject &sensor_json_response) {
-    id = sensor_json_response["id"];
+    id = sensor_json_response[JSON_KEY(id)];
     JsonArray magnitudes_json =
-        sensor_json_response["magnitudes"].as<JsonArray>();
+        sensor_json_response[JSON_KEY(magnitudes)].as<JsonArray>();
     for (JsonObject mag_json : magnitudes_json) {
-      const char *name = mag_json["name"];
-      if (strcmp(name, "temperature") == 0) {
-        id = mag_json["id"];
-      } else if (strcmp(name, "pressure") == 0) {
-        id = mag_json["id"];
+      const char *name = mag_json[JSON_KEY(name)] | "";
+      if (strcmp_P(name, magnitude_temperature) == 0) {
+        temp_id = mag_json[JSON_KEY(id)];
+      } else if (strcmp_P(name, magnitude_pressure) == 0) {
+        pres_id = mag_json[JSON_KEY(id)];
       }
     }
     log_printf(
@@ -51,104 +52,223 @@ public:
   }
 
   bool setup() {
-    log_println("Setting up HP303B sensor...");
-    hp303b.begin();
-    delay(500);
+    log_println(F("Setting up HP303B sensor..."));
+
+    uint8_t product;
+    if (!bus.read_register(address, product_id_reg, &product, 1)) {
+      log_println(F("  HP303B begin FAILED"));
+      return false;
+    }
+
+    // Coefficients and sensor are ready ~40 ms after power on
+    uint8_t meas_cfg = 0;
+    for (uint8_t i = 0; i < 10 && (meas_cfg & 0xC0) != 0xC0; i++) {
+      delay(10);
+      bus.read_register(address, meas_cfg_reg, &meas_cfg, 1);
+    }
+    if (!read_coefficients()) {
+      log_println(F("  Error reading the calibration coefficients."));
+      return false;
+    }
+    fix_temperature();
+
+    // Continuous background measurement of both magnitudes into the FIFO
+    const uint8_t tmp_ext = temperature_sensor_external ? 0x80 : 0x00;
+    const bool ok =
+        bus.write_register(address, prs_cfg_reg,
+                           pressure_rate << 4 | pressure_prc) &&
+        bus.write_register(address, tmp_cfg_reg,
+                           tmp_ext | temperature_rate << 4 |
+                               temperature_prc) &&
+        bus.write_register(address, cfg_reg, cfg_p_shift | cfg_fifo_en) &&
+        bus.write_register(address, reset_reg, fifo_flush) &&
+        bus.write_register(address, meas_cfg_reg, meas_cont_both);
+    if (!ok) {
+      log_println(F("  HP303B start FAILED"));
+      return false;
+    }
 
     log_printf("  Product ID: %d.\n"
                "  Revision ID: %d.\n"
                "  Done!\n",
-               hp303b.getProductId(), hp303b.getRevisionId());
+               product & 0x0F, product >> 4);
     log_header_printf("HP303B setup. product ID: %d, "
                       "revision ID: %d.",
-                      hp303b.getProductId(), hp303b.getRevisionId());
+                      product & 0x0F, product >> 4);
 
+    i2c_scheduler.add(this);
     return true;
   }
 
-  void measure() {
-    log_println("Measuring HP303B...");
-    const uint8_t oversampling = 7;
-    int conversion_ret_val;
+  void measure() { i2c_scheduler.request(this); }
+
+  // The chip measures in the background, nothing to trigger
+  uint32_t trigger() { return 0; }
+
+  // Drain all the results in the FIFO and queue their averages
+  uint32_t collect() {
+    log_println(F("Measuring HP303B..."));
     time_t now = UTC.now();
-    int temperature, pressure;
-    int status;
-
-    status = hp303b.measureTempOnce(temperature, oversampling);
-    switch (status) {
-    case HP303B__SUCCEEDED:
-      break;
-    case HP303B__FAIL_UNKNOWN:
-      log_println("  Unknown error reading HP303B.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_INIT_FAILED:
-      log_println("  Initialization error reading HP303B.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_TOOBUSY:
-      log_println("  Error: HP303B is busy.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_UNFINISHED:
-      log_println("  Error: HP303B could not finish the measurement on time.");
-      num_measurement_errors++;
-      break;
+
+    uint8_t fifo_status = 0;
+    bus.read_register(address, fifo_sts_reg, &fifo_status, 1);
+    if (fifo_status & fifo_full) {
+      log_println(F("  FIFO full, some results were lost."));
     }
-    SensorData temperature_data = {now, id, temp_id};
-    conversion_ret_val =
-        snprintf(temperature_data.value, sizeof(temperature_data.value), "%d",
-                 temperature);
-    if (conversion_ret_val > 0) {
-      log_printf("  Temperature: %d C.\n", temperature);
-      sensor_buffer.push(temperature_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
+
+    float temperature_sum = 0, pressure_sum = 0;
+    uint8_t temperature_count = 0, pressure_count = 0, pressure_skipped = 0;
+    uint8_t data[3];
+    for (uint8_t i = 0; i < fifo_size; i++) {
+      if (!bus.read_register(address, psr_b2_reg, data, sizeof(data))) {
+        log_println(F("  Error reading the FIFO."));
+        num_measurement_errors++;
+        break;
+      }
+      const uint32_t raw = (uint32_t)data[0] << 16 | data[1] << 8 | data[2];
+      if (raw == fifo_empty_result) {
+        break;
+      }
+      // The LSB tells a pressure result (1) from a temperature one (0)
+      if (raw & 0x01) {
+        // Pressure is compensated with the last temperature result, there is
+        // none in the first results after power on
+        if (!has_temperature) {
+          pressure_skipped++;
+          continue;
+        }
+        pressure_sum += compensate_pressure(twos_complement(raw, 24));
+        pressure_count++;
+      } else {
+        temperature_sum += compensate_temperature(twos_complement(raw, 24));
+        temperature_count++;
       }
-    } else {
-      log_printf("  Problem converting temperature (%d C) to char[].\n",
-                 temperature);
     }
 
-    status = hp303b.measurePressureOnce(pressure, oversampling);
-    switch (status) {
-    case HP303B__SUCCEEDED:
-      break;
-    case HP303B__FAIL_UNKNOWN:
-      log_println("  Unknown error reading HP303B.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_INIT_FAILED:
-      log_println("  Initialization error reading HP303B.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_TOOBUSY:
-      log_println("  Error: HP303B is busy.");
-      num_measurement_errors++;
-      break;
-    case HP303B__FAIL_UNFINISHED:
-      log_println("  Error: HP303B could not finish the measurement on time.");
+    // Values are queued in magnitude order: temperature, pressure
+    SensorFrame frame = {now, id, 0, 0};
+
+    if (temperature_count > 0) {
+      float temperature = temperature_sum / temperature_count;
+      log_printf("  Temperature: %.2f C (%d samples).\n", temperature,
+                 temperature_count);
+      frame.values[frame.num_values++] = to_fixed(temperature, 2);
+    } else {
+      log_println(F("  Error: no temperature results."));
       num_measurement_errors++;
-      break;
+      frame.first_magnitude = 1;
     }
-    SensorData pressure_data = {now, id, pres_id};
-    conversion_ret_val = snprintf(pressure_data.value,
-                                  sizeof(pressure_data.value), "%d", pressure);
-    if (conversion_ret_val > 0) {
-      log_printf("  Pressure: %d hPa.\n", pressure / 100);
-      sensor_buffer.push(pressure_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
+
+    if (pressure_count > 0) {
+      float pressure = pressure_sum / pressure_count;
+      log_printf("  Pressure: %.2f hPa (%d samples).\n", pressure / 100,
+                 pressure_count);
+      frame.values[frame.num_values++] = to_fixed(pressure, 0);
+    } else if (pressure_skipped > 0) {
+      log_println(F("  Pressure skipped, no temperature result yet."));
     } else {
-      log_printf("  Problem converting pressure (%d hPa) to char[].\n",
-                 pressure / 100);
+      log_println(F("  Error: no pressure results."));
+      num_measurement_errors++;
+    }
+
+    if (frame.num_values > 0) {
+      queue_frame(frame);
     }
+    return i2c_done;
   }
 
+  uint8_t magnitude_id(uint8_t index) { return index == 0 ? temp_id : pres_id; }
+  uint8_t magnitude_decimals(uint8_t index) { return index == 0 ? 2 : 0; }
+
   // HP303B Sensor
   uint8_t temp_id, pres_id;
-  LOLIN_HP303B hp303b;
+
+private:
+  const uint8_t address = 0x77;
+
+  // Registers
+  const uint8_t psr_b2_reg = 0x00;
+  const uint8_t prs_cfg_reg = 0x06;
+  const uint8_t tmp_cfg_reg = 0x07;
+  const uint8_t meas_cfg_reg = 0x08;
+  const uint8_t cfg_reg = 0x09;
+  const uint8_t fifo_sts_reg = 0x0B;
+  const uint8_t reset_reg = 0x0C;
+  const uint8_t product_id_reg = 0x0D;
+  const uint8_t coef_reg = 0x10;
+  const uint8_t coef_srce_reg = 0x28;
+
+  const uint8_t meas_cont_both = 0x07;
+  const uint8_t cfg_p_shift = 0x04;
+  const uint8_t cfg_fifo_en = 0x02;
+  const uint8_t fifo_flush = 0x80;
+  const uint8_t fifo_full = 0x02;
+  const uint32_t fifo_empty_result = 0x800000;
+  const uint8_t fifo_size = 32;
+
+  // 1 pressure result per second with 64x oversampling (~105 ms) and 1
+  // temperature result per second with 8x oversampling. A 10 s period drains
+  // 20 results, the FIFO holds 32.
+  const uint8_t pressure_rate = 0, pressure_prc = 6;
+  const uint8_t temperature_rate = 0, temperature_prc = 3;
+  const float scale_factors[8] = {524288,  1572864, 3670016, 7864320,
+                                  253952,  516096,  1040384, 2088960};
+
+  // Calibration coefficients
+  int32_t c0, c1, c00, c10, c01, c11, c20, c21, c30;
+  bool temperature_sensor_external = false;
+  // Scaled value of the last temperature result, used to compensate pressure
+  float last_scaled_temperature = 0;
+  bool has_temperature = false;
+
+  int32_t twos_complement(uint32_t value, uint8_t bits) {
+    if (value & ((uint32_t)1 << (bits - 1))) {
+      return (int32_t)value - ((int32_t)1 << bits);
+    }
+    return value;
+  }
+
+  bool read_coefficients() {
+    uint8_t c[18], source;
+    if (!bus.read_register(address, coef_reg, c, sizeof(c)) ||
+        !bus.read_register(address, coef_srce_reg, &source, 1)) {
+      return false;
+    }
+    c0 = twos_complement((uint32_t)c[0] << 4 | c[1] >> 4, 12);
+    c1 = twos_complement((uint32_t)(c[1] & 0x0F) << 8 | c[2], 12);
+    c00 = twos_complement((uint32_t)c[3] << 12 | c[4] << 4 | c[5] >> 4, 20);
+    c10 = twos_complement((uint32_t)(c[5] & 0x0F) << 16 | c[6] << 8 | c[7], 20);
+    c01 = twos_complement((uint32_t)c[8] << 8 | c[9], 16);
+    c11 = twos_complement((uint32_t)c[10] << 8 | c[11], 16);
+    c20 = twos_complement((uint32_t)c[12] << 8 | c[13], 16);
+    c21 = twos_complement((uint32_t)c[14] << 8 | c[15], 16);
+    c30 = twos_complement((uint32_t)c[16] << 8 | c[17], 16);
+    temperature_sensor_external = source & 0x80;
+    return true;
+  }
+
+  // Some chips report wrong temperatures (~60 C) unless these undocumented
+  // registers are written after power on.
+  void fix_temperature() {
+    bus.write_register(address, 0x0E, 0xA5);
+    bus.write_register(address, 0x0F, 0x96);
+    bus.write_register(address, 0x62, 0x02);
+    bus.write_register(address, 0x0E, 0x00);
+    bus.write_register(address, 0x0F, 0x00);
+  }
+
+  float compensate_temperature(int32_t raw) {
+    last_scaled_temperature = raw / scale_factors[temperature_prc];
+    has_temperature = true;
+    return c0 * 0.5 + c1 * last_scaled_temperature;
+  }
+
+  float compensate_pressure(int32_t raw) {
+    const float p = raw / scale_factors[pressure_prc];
+    const float t = last_scaled_temperature;
+    return c00 + p * (c10 + p * (c20 + p * c30)) + t * c01 +
+           t * p * (c11 + p * c21);
+  }
 };
 
 HP303BSensor hp303b_sensor("HP303B", 10,
@@ -1,10 +1,19 @@
 #pragma once
 
 #include "common_sensor.h"
+#include "heap_trace.h"
 #include "logging.h"
+#include "p1_data.h"
+#include "p1_parser.h"
 #include <ArduinoJson.h>
 #include <Ticker.h>
 
+// UART receive ring, filled by the UART interrupt. Sized to hold several
+// telegrams while the loop is blocked in an upload or an OTA update.
+#ifndef P1_RX_BUFFER_SIZE
+#define P1_RX_BUFFER_SIZE 4096
+#endif
+
 class P1Sensor : public Sensor {
 public:
   P1Sensor(const char *name, uint32_t period_s, size_t capacity,
@@ -12,11 +21,12 @@ public:
       : Sensor(name, period_s, capacity, response_capacity) {}
 
   bool setup() {
-    log_println("Setting up P1 sensor...");
+    log_println(F("Setting up P1 sensor..."));
     // Setup a hw serial connection for communication with the P1 meter and
     // logging (not using inversion)
+    Serial.setRxBufferSize(P1_RX_BUFFER_SIZE);
     Serial.begin(baud_rate, SERIAL_8N1, SERIAL_FULL);
-    Serial.println("");
+    Serial.println();
     Serial.flush();
 
     // Invert the RX serial port by setting a register value, this way the TX
@@ -29,14 +39,26 @@ public:
     return true;
   }
 
+  // Parse everything in the receive ring. Also called while the loop is
+  // blocked, so it must stay cheap when there is nothing to read.
   void measure() {
-    while (Serial.available()) {
-      ESP.wdtDisable();
-      telegram = Serial.readStringUntil('\n');
-      telegram += "\n";
-      ESP.wdtEnable(1);
-
-      process_line(telegram);
+    HEAP_TRACE_SCOPE("p1_measure");
+    if (Serial.hasOverrun()) {
+      num_rx_overruns++;
+    }
+    if (Serial.hasRxError()) {
+      num_rx_errors++;
+    }
+
+    char chunk[64];
+    int available;
+    while ((available = Serial.available()) > 0) {
+      max_rx_used = max(max_rx_used, (size_t)available);
+      const size_t length =
+          Serial.readBytes(chunk, min(available, (int)sizeof(chunk)));
+      for (size_t i = 0; i < length; i++) {
+        process_event(parser.feed(chunk[i]));
+      }
       yield();
     }
   }
@@ -52,384 +74,174 @@ public:
       log_printf("P1 watchdog ok, last measurement: %ds ago.\n",
                  defaultTZ->now() - last_measurement);
     }
+    log_printf("P1 serial: %u valid, %u invalid telegrams, %u overruns, %u rx "
+               "errors, max %u of %u bytes buffered.\n",
+               num_valid_telegrams, num_invalid_telegrams, num_rx_overruns,
+               num_rx_errors, max_rx_used, P1_RX_BUFFER_SIZE);
   }
 
   void setup_json(JsonObject &sensor_json) {
-    sensor_json["name"] = name;
-    JsonArray sensor_1_in_magnitudes =
-        sensor_json.createNestedArray("magnitudes");
-
-    JsonObject mag1_in = sensor_1_in_magnitudes.createNestedObject();
-    mag1_in["name"] = "power_consumption_1";
-    mag1_in["unit"] = "kWh";
-    mag1_in["precision"] = 0.001;
-
-    JsonObject mag2_in = sensor_1_in_magnitudes.createNestedObject();
-    mag2_in["name"] = "power_consumption_2";
-    mag2_in["unit"] = "kWh";
-    mag2_in["precision"] = 0.001;
-
-    JsonObject mag3_in = sensor_1_in_magnitudes.createNestedObject();
-    mag3_in["name"] = "power_delivery_1";
-    mag3_in["unit"] = "kWh";
-    mag3_in["precision"] = 0.001;
-
-    JsonObject mag4_in = sensor_1_in_magnitudes.createNestedObject();
-    mag4_in["name"] = "power_delivery_2";
-    mag4_in["unit"] = "kWh";
-    mag4_in["precision"] = 0.001;
-
-    JsonObject mag5_in = sensor_1_in_magnitudes.createNestedObject();
-    mag5_in["name"] = "gas_consumption";
-    mag5_in["unit"] = "m3";
-    mag5_in["precision"] = 0.001;
+    sensor_json[JSON_KEY(name)] = name;
+    JsonArray magnitudes_json =
+        sensor_json.createNestedArray(JSON_KEY(magnitudes));
+
+    for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+      const P1Field field = p1_subscriptions[i];
+      JsonObject mag_json = magnitudes_json.createNestedObject();
+      if (p1_kind(field) == P1Kind::counter && p1_delta_suffix[0] != '\0') {
+        mag_json[JSON_KEY(name)] =
+            String(FPSTR(p1_name(field))) + p1_delta_suffix;
+      } else {
+        mag_json[JSON_KEY(name)] = FPSTR(p1_name(field));
+      }
+      mag_json[JSON_KEY(unit)] = FPSTR(p1_unit(field));
+      mag_json[JSON_KEY(precision)] = 1.0 / decimal_scale[p1_decimals(field)];
+    }
   }
 
   bool parse_json(JsonObject &sensor_json_response) {
-    id = sensor_json_response["id"];
+    id = sensor_json_response[JSON_KEY(id)];
     JsonArray magnitudes_json =
-        sensor_json_response["magnitudes"].as<JsonArray>();
+        sensor_json_response[JSON_KEY(magnitudes)].as<JsonArray>();
 
     for (JsonObject mag_json : magnitudes_json) {
-      const char *name = mag_json["name"];
-      if (strcmp(name, "power_consumption_1") == 0) {
-        power_consumption_1_id = mag_json["id"];
-      } else if (strcmp(name, "power_consumption_2") == 0) {
-        power_consumption_2_id = mag_json["id"];
-      } else if (strcmp(name, "power_delivery_1") == 0) {
-        power_delivery_1_id = mag_json["id"];
-      } else if (strcmp(name, "power_delivery_2") == 0) {
-        power_delivery_2_id = mag_json["id"];
-      } else if (strcmp(name, "gas_consumption") == 0) {
-        gas_consumption_id = mag_json["id"];
+      const char *name = mag_json[JSON_KEY(name)] | "";
+      for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+        if (p1_magnitude_matches(p1_subscriptions[i], name)) {
+          magnitude_ids[i] = mag_json[JSON_KEY(id)];
+          break;
+        }
       }
     }
 
-    log_printf("  p1_sensor_id: %d, consumption ids: (%d, %d), delivery ids: "
-               "(%d, %d), gas id: %d.\n",
-               id, power_consumption_1_id, power_consumption_2_id,
-               power_delivery_1_id, power_delivery_2_id, gas_consumption_id);
-    log_header_printf(
-        "  P1 sensor_id: %d, consumption ids: (%d, %d), delivery ids: "
-        "(%d, %d), gas id: %d.\n",
-        id, power_consumption_1_id, power_consumption_2_id, power_delivery_1_id,
-        power_delivery_2_id, gas_consumption_id);
+    log_printf("  p1_sensor_id: %d, %d magnitudes.\n", id,
+               num_p1_subscriptions);
+    log_header_printf("  P1 sensor_id: %d, %d magnitudes.\n", id,
+                      num_p1_subscriptions);
+    char name[sizeof(P1Magnitude::name)];
+    for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+      strcpy_P(name, p1_name(p1_subscriptions[i]));
+      if (magnitude_ids[i] == 0) {
+        log_printf("    %s isn't registered, not sent\n", name);
+      } else {
+        log_printf("    %s id: %d\n", name, magnitude_ids[i]);
+      }
+    }
 
     return true;
   }
 
+  uint8_t magnitude_id(uint8_t index) { return magnitude_ids[index]; }
+  uint8_t magnitude_decimals(uint8_t index) {
+    return p1_decimals(p1_subscriptions[index]);
+  }
+
 private:
-  uint8_t power_consumption_1_id, power_consumption_2_id, power_delivery_1_id,
-      power_delivery_2_id, gas_consumption_id;
+  uint8_t magnitude_ids[num_p1_subscriptions] = {};
   const uint32_t baud_rate = 115200;
-  // Set during CRC checking
-  uint32_t currentCRC = 0;
 
   const uint32_t max_time_no_measurent_s = 120;
   time_t last_measurement = 0;
 
-  String telegram;
-
-  // Data
-  typedef struct {
-    String local_timestamp;
-
-    uint32_t consumption_1, consumption_2;
-    uint32_t delivery_1, delivery_2;
-
-    uint8_t actual_tariff;
-
-    uint32_t actual_consumption, actual_delivery;
-
-    uint32_t l1_instant_current;
-    uint32_t l1_instant_power_consumption, l1_instant_power_delivery;
-
-    String gas_local_timestamp;
-    double gas_consumption;
-  } P1Data;
-  P1Data p1_data;
-
-  unsigned int CRC16(unsigned int crc, unsigned char *buf, int len) {
-    for (int pos = 0; pos < len; pos++) {
-      crc ^= (unsigned int)buf[pos]; // * XOR byte into least sig. byte of crc
-      // * Loop over each bit
-      for (int i = 8; i != 0; i--) {
-        // * If the LSB is set
-        if ((crc & 0x0001) != 0) {
-          // * Shift right and XOR 0xA001
-          crc >>= 1;
-          crc ^= 0xA001;
-        }
-        // * Else LSB is not set
-        else {
-          // * Just shift right
-          crc >>= 1;
-        }
-      }
-    }
-    return crc;
-  }
-
-  double getValue(String buffer, char startchar, char endchar) {
-    int startIdx = buffer.indexOf(startchar);
-    int endIdx = buffer.lastIndexOf(endchar);
-
-    String value = buffer.substring(startIdx + 1, endIdx);
-    // log_println(value);
-    int startNumber = 0;
-    // remove leading zeros before converting to double
-    for (uint32_t i = 0; i < value.length(); i++) {
-      if (value[i] != '0') {
-        if (value[i] == '.') {
-          startNumber = i - 1;
-        } else {
-          startNumber = i;
-        }
-        break;
-      }
-    }
-    String trimmed_value = value.substring(startNumber);
-    // log_println(trimmed_value);
-    return trimmed_value.toDouble();
-  }
-
-  String getText(String buffer, char startchar, char endchar) {
-    int startIdx = buffer.indexOf(startchar);
-    int endIdx = buffer.lastIndexOf(endchar);
-    return buffer.substring(startIdx + 1, endIdx);
-  }
-
-  time_t getDatetime(String dsmr_timestamp) {
-    return makeTime(dsmr_timestamp.substring(6, 8).toInt(),
-                    dsmr_timestamp.substring(8, 10).toInt(),
-                    dsmr_timestamp.substring(10, 12).toInt(),
-                    dsmr_timestamp.substring(4, 6).toInt(),
-                    dsmr_timestamp.substring(2, 4).toInt(),
-                    2000 + dsmr_timestamp.substring(0, 2).toInt());
-  }
-
-  void process_line(String telegram) {
-    bool result = decode_telegram(telegram);
-    if (result) {
+  P1Parser parser;
+  uint32_t num_valid_telegrams = 0, num_invalid_telegrams = 0;
+  uint32_t num_rx_overruns = 0, num_rx_errors = 0;
+  size_t max_rx_used = 0;
+  const uint32_t subscribed = p1_subscription_mask();
+
+  // Values of the telegram being received and of the last valid one
+  P1Data new_p1_data, p1_data;
+  P1Interval interval;
+
+  void process_event(P1Event event) {
+    switch (event) {
+    case P1Event::none:
+      break;
+    case P1Event::line:
+      decode_p1_line(parser.line(), new_p1_data, subscribed);
+      break;
+    case P1Event::valid_telegram:
+      log_println(F("Valid P1 data found!"));
+      num_valid_telegrams++;
+      p1_data = new_p1_data;
       // print_data();
-      queue_data();
-      last_measurement = defaultTZ->now();
-    }
-  }
-
-  // parsing of telegram according to Dutch ESMR 4.0 implementation
-  // https://www.netbeheernederland.nl/_upload/Files/Slimme_meter_15_32ffe3cc38.pdf
-  bool decode_telegram(String telegram) {
-    bool msgStart = telegram.startsWith("/");
-    bool msgEnd = telegram.startsWith("!");
-    bool validCRCFound = false;
-
-    // log_println(telegram);
-    // Serial.print(telegram);
-
-    if (msgStart) {
-      // Start found. Reset CRC calculation
-      currentCRC =
-          CRC16(0x0000, (unsigned char *)telegram.c_str(), telegram.length());
-    } else if (msgEnd) {
-      // End found, add to crc calc
-      currentCRC = CRC16(currentCRC, (unsigned char *)telegram.c_str(), 1);
-
-      char messageCRC[5];
-      strncpy(messageCRC, telegram.c_str() + 1, 4);
-
-      messageCRC[4] = 0; // * Thanks to HarmOtten (issue 5)
-      validCRCFound = ((unsigned)strtol(messageCRC, NULL, 16) == currentCRC);
-
-      if (validCRCFound) {
-        log_println(F("Valid P1 data found!"));
-      } else {
-        log_println(F("Invalid P1 data found!"));
+      if (interval.ends_before(p1_data.timestamp)) {
+        P1Data report;
+        interval.report(report);
+        queue_data(report, interval.has_new_gas());
       }
-
-      currentCRC = 0;
-    } else {
-      // Middle of message
-      currentCRC = CRC16(currentCRC, (unsigned char *)telegram.c_str(),
-                         telegram.length());
-    }
-
-    // 0-0:1.0.0(220821195452S)
-    // 0-0:1.0.0 = Date-time stamp of the P1 message
-    if (telegram.startsWith("0-0:1.0.0")) {
-      p1_data.local_timestamp = getText(telegram, '(', ')');
-    }
-
-    // 1-0:1.8.1(000992.992*kWh)
-    // 1-0:1.8.1 = Meter Reading electricity delivered to client (Tariff 1) in
-    // 0,001 kWh
-    if (telegram.startsWith("1-0:1.8.1")) {
-      p1_data.consumption_1 = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:2.8.1(000560.157*kWh)
-    // 1-0:2.8.1 = Meter Reading electricity delivered by client (Tariff 1) in
-    // 0,001 kWh
-    if (telegram.startsWith("1-0:2.8.1")) {
-      p1_data.delivery_1 = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:1.8.2(000992.992*kWh)
-    // 1-0:1.8.2 = Meter Reading electricity delivered to client (Tariff 2) in
-    // 0,001 kWh
-    if (telegram.startsWith("1-0:1.8.2")) {
-      p1_data.consumption_2 = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:2.8.2(000560.157*kWh)
-    // 1-0:2.8.2 = Meter Reading electricity delivered by client (Tariff 2) in
-    // 0,001 kWh
-    if (telegram.startsWith("1-0:2.8.2")) {
-      p1_data.delivery_2 = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 0-0:96.14.0(0001)
-    // 0-0:96.14.0 = Current tariff (1 or 2)
-    if (telegram.startsWith("0-0:96.14.0")) {
-      p1_data.actual_tariff = getValue(telegram, '(', ')');
-    }
-
-    // 1-0:1.7.0(000560.157*kWh)
-    // 1-0:1.7.0 = Actual electricity power delivered (+P) in 1 Watt resolution
-    if (telegram.startsWith("1-0:1.7.0")) {
-      p1_data.actual_consumption = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:2.7.0(000560.157*kWh)
-    // 1-0:2.7.0 = Actual electricity power delivered (+P) in 1 Watt resolution
-    if (telegram.startsWith("1-0:2.7.0")) {
-      p1_data.actual_delivery = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:31.7.0(00.378*kW)
-    // 1-0:31.7.0 = Instantaneous current L1 in A resolution.
-    if (telegram.startsWith("1-0:31.7.0")) {
-      p1_data.l1_instant_current = getValue(telegram, '(', '*');
-    }
-
-    // 1-0:21.7.0(00.378*kW)
-    // 1-0:21.7.0 = Instantaneous active power L1 (+P) in W resolution
-    if (telegram.startsWith("1-0:21.7.0")) {
-      p1_data.l1_instant_power_consumption =
-          1000 * getValue(telegram, '(', '*');
-    }
-
-    // 1-0:22.7.0(00.378*kW)
-    // 1-0:22.7.0 = Instantaneous active power L1 (-P) in W resolution
-    if (telegram.startsWith("1-0:22.7.0")) {
-      p1_data.l1_instant_power_delivery = 1000.0 * getValue(telegram, '(', '*');
-    }
-
-    // 0-1:24.2.1(220821190000S)(08385.402*m3)
-    // 0-1:24.2.1 = Last hourly value (temperature converted), gas delivered to
-    // client in m3, including decimal values and capture time
-    if (telegram.startsWith("0-1:24.2.1")) {
-      p1_data.gas_local_timestamp =
-          getText(telegram.substring(0, 25), '(', ')');
-      p1_data.gas_consumption = getValue(telegram.substring(25), '(', '*');
+      interval.add(p1_data);
+      last_measurement = defaultTZ->now();
+      break;
+    case P1Event::invalid_telegram:
+      log_println(F("Invalid P1 data found!"));
+      num_invalid_telegrams++;
+      new_p1_data = p1_data;
+      break;
     }
-
-    return validCRCFound;
   }
 
   void print_data() {
-    log_printf("Timestamp: %s\n",
-               dateTime(getDatetime(p1_data.local_timestamp)).c_str());
-
-    log_printf("Consumption Tariff 1: %.3f kWh\n",
-               p1_data.consumption_1 / 1000.0);
-    log_printf("Consumption Tariff 2: %.3f kWh\n",
-               p1_data.consumption_2 / 1000.0);
-    log_printf("Delivery Tariff 1: %.3f kWh\n", p1_data.delivery_1 / 1000.0);
-    log_printf("Delivery Tariff 2: %.3f kWh\n", p1_data.delivery_2 / 1000.0);
-
-    log_printf("Actual Tariff: %d\n", p1_data.actual_tariff);
-
-    log_printf("Actual Consumption: %.3f kWh\n",
-               p1_data.actual_consumption / 1000.0);
-    log_printf("Actual Delivery: %.3f kWh\n", p1_data.actual_delivery / 1000.0);
-
-    log_printf("Actual L1 Current: %d A\n", p1_data.l1_instant_current);
-    log_printf("Actual L1 Power Consumption: %.3f kWh\n",
-               p1_data.l1_instant_power_consumption / 1000.0);
-    log_printf("Actual L1 Power Delivery: %.3f kWh\n",
-               p1_data.l1_instant_power_delivery / 1000.0);
-
+    log_printf("Timestamp: %s\n", UTC.dateTime(p1_data.timestamp).c_str());
     log_printf("Last gas timestamp: %s\n",
-               dateTime(getDatetime(p1_data.gas_local_timestamp)).c_str());
-    log_printf("Last hourly gas consumption: %.3f m3\n",
-               p1_data.gas_consumption);
+               UTC.dateTime(p1_data.gas_timestamp).c_str());
+
+    char name[sizeof(P1Magnitude::name)], unit[sizeof(P1Magnitude::unit)];
+    char value[12];
+    for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+      const P1Field field = p1_subscriptions[i];
+      format_fixed(p1_data.values[field], p1_decimals(field), value,
+                   sizeof(value));
+      strcpy_P(name, p1_name(field));
+      strcpy_P(unit, p1_unit(field));
+      log_printf("%s: %s %s\n", name, value, unit);
+    }
   }
 
-  void queue_data() {
-    int conversion_ret_val;
-    time_t timestamp = defaultTZ->tzTime(getDatetime(p1_data.local_timestamp));
-
-    SensorData consumption_1_data = {timestamp, id, power_consumption_1_id};
-    conversion_ret_val =
-        snprintf(consumption_1_data.value, sizeof(consumption_1_data.value),
-                 "%.3f", p1_data.consumption_1 / 1000.0);
-    if (conversion_ret_val > 0) {
-      sensor_buffer.push(consumption_1_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
+  // Queue the subscribed values of a report in magnitude order. Consecutive
+  // electricity values share the telegram timestamp and go in frames of up to
+  // max_frame_values, gas goes in its own frame with its capture time, only
+  // when there is a new capture.
+  void queue_data(const P1Data &report, bool new_gas) {
+    SensorFrame frame = {report.timestamp, id, 0, 0};
+    for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+      const P1Field field = p1_subscriptions[i];
+      if (field == p1_gas_consumption) {
+        if (frame.num_values > 0) {
+          queue_frame(frame);
+        }
+        if (new_gas) {
+          SensorFrame gas_frame = {report.gas_timestamp, id, i, 1};
+          gas_frame.values[0] = report.values[field];
+          queue_frame(gas_frame);
+        }
+        frame.num_values = 0;
+        continue;
       }
-    }
-    SensorData consumption_2_data = {timestamp, id, power_consumption_2_id};
-    conversion_ret_val =
-        snprintf(consumption_2_data.value, sizeof(consumption_2_data.value),
-                 "%.3f", p1_data.consumption_2 / 1000.0);
-    if (conversion_ret_val > 0) {
-      sensor_buffer.push(consumption_2_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
+      if (frame.num_values == 0) {
+        frame.first_magnitude = i;
       }
-    }
-
-    SensorData delivery_1_data = {timestamp, id, power_delivery_1_id};
-    conversion_ret_val =
-        snprintf(delivery_1_data.value, sizeof(delivery_1_data.value), "%.3f",
-                 p1_data.delivery_1 / 1000.0);
-    if (conversion_ret_val > 0) {
-      sensor_buffer.push(delivery_1_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
-    }
-    SensorData delivery_2_data = {timestamp, id, power_delivery_2_id};
-    conversion_ret_val =
-        snprintf(delivery_2_data.value, sizeof(delivery_2_data.value), "%.3f",
-                 p1_data.delivery_2 / 1000.0);
-    if (conversion_ret_val > 0) {
-      sensor_buffer.push(delivery_2_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
+      frame.values[frame.num_values++] = report.values[field];
+      if (frame.num_values == max_frame_values) {
+        queue_frame(frame);
+        frame.num_values = 0;
       }
     }
-
-    time_t gas_timestamp =
-        defaultTZ->tzTime(getDatetime(p1_data.gas_local_timestamp));
-    SensorData gas_data = {gas_timestamp, id, gas_consumption_id};
-    conversion_ret_val = snprintf(gas_data.value, sizeof(gas_data.value),
-                                  "%.3f", p1_data.gas_consumption);
-    if (conversion_ret_val > 0) {
-      sensor_buffer.push(gas_data);
-      if (num_measurement_errors > 0) {
-        num_measurement_errors--;
-      }
+    if (frame.num_values > 0) {
+      queue_frame(frame);
     }
   }
 };
 
+// The server keeps the magnitudes registered by earlier firmwares, the
+// response has room for those of the station under both their snapshot and
+// delta names.
 P1Sensor p1_sensor("P1", 0.2,
-                   JSON_ARRAY_SIZE(5) + JSON_OBJECT_SIZE(2) +
-                       5 * JSON_OBJECT_SIZE(3),
-                   JSON_ARRAY_SIZE(5) + JSON_OBJECT_SIZE(3) +
-                       5 * JSON_OBJECT_SIZE(4));
+                   JSON_ARRAY_SIZE(num_p1_subscriptions) +
+                       JSON_OBJECT_SIZE(2) +
+                       num_p1_subscriptions * (JSON_OBJECT_SIZE(3) + 32),
+                   JSON_ARRAY_SIZE(2 * num_p1_subscriptions) +
+                       JSON_OBJECT_SIZE(3) +
+                       2 * num_p1_subscriptions * (JSON_OBJECT_SIZE(4) + 32));
 Ticker p1_measurement_timer([]() { return p1_sensor.measure(); },
                             p1_sensor.period_s * 1e3, 0, MILLIS);
@@ -2,18 +2,25 @@
 
 #include "Arduino.h"
 #include <ArduinoJson.h>
-#include <CircularBuffer.h>
+
+#include "json_keys.h"
+#include "sensor_frame.h"
 
 ///// Common sensor
-typedef struct {
-  time_t epoch;
-  uint8_t sensor_id;
-  uint8_t magnitude_id;
-  char value[10];
-} SensorData;
-SensorData sensor_data;
-CircularBuffer<SensorData, 255> sensor_buffer; // Keep some raw data
+SensorFrameBuffer<4080> sensor_buffer; // Keep some raw data
 uint8 num_measurement_errors = 0;
+// Called with every queued frame, set by the station to keep its latest values
+// and push it live
+void (*on_queue_frame)(const SensorFrame &frame) = nullptr;
+
+// Queue a measurement, each value counts as a successful measurement.
+void queue_frame(const SensorFrame &frame) {
+  sensor_buffer.push(frame);
+  num_measurement_errors -= min(num_measurement_errors, frame.num_values);
+  if (on_queue_frame != nullptr) {
+    on_queue_frame(frame);
+  }
+}
 
 class Sensor {
 public:
@@ -27,6 +34,9 @@ public:
   virtual void watchdog(){};
   virtual void setup_json(JsonObject &sensor_json) = 0;
   virtual bool parse_json(JsonObject &sensor_json_response) = 0;
+  // Server id and decimals of the index-th magnitude in the frames' order.
+  virtual uint8_t magnitude_id(uint8_t index) = 0;
+  virtual uint8_t magnitude_decimals(uint8_t index) = 0;
 
   uint8_t id;
   const char *name;
@@ -34,3 +44,30 @@ public:
   const size_t capacity;
   const size_t response_capacity;
 };
+
+// Hand the entries of the GET sensors response to the sensors of the same
+// name. The response comes from the network, entries without a name or for
+// other sensors are skipped.
+void parse_sensors_json(JsonArray sensors_json, Sensor *const *sensors,
+                        uint8_t num_sensors) {
+  for (JsonObject sensor_json : sensors_json) {
+    const char *name = sensor_json[JSON_KEY(name)] | "";
+    for (uint8_t i = 0; i < num_sensors; i++) {
+      if (strcmp(name, sensors[i]->name) == 0) {
+        sensors[i]->parse_json(sensor_json);
+        break;
+      }
+    }
+  }
+}
+
+// The sensor with a server id, nullptr if none has it
+Sensor *find_sensor(Sensor *const *sensors, uint8_t num_sensors,
+                    uint8_t sensor_id) {
+  for (uint8_t i = 0; i < num_sensors; i++) {
+    if (sensors[i]->id == sensor_id) {
+      return sensors[i];
+    }
+  }
+  return nullptr;
+}
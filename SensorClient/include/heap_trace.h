@@ -0,0 +1,130 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Opt-in heap tracing. Built with HEAP_TRACE and the linker flags of the
+// [heap_trace] section of platformio.ini, malloc(), calloc(), realloc() and
+// free() go through the wrappers below. They count the allocations of the
+// scope that is running, tagged with HEAP_TRACE_SCOPE(), and keep the lowest
+// free heap seen. The largest free block and the fragmentation take a walk of
+// the heap, so they are only sampled when a scope ends.
+#ifdef HEAP_TRACE
+
+#ifndef HEAP_TRACE_MAX_SITES
+#define HEAP_TRACE_MAX_SITES 8
+#endif
+
+typedef struct {
+  const char *name;
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t bytes;
+  uint32_t max_size;
+} HeapTraceSite;
+
+// Site 0 counts the allocations made outside of any scope
+HeapTraceSite heap_trace_sites[HEAP_TRACE_MAX_SITES] = {{"other"}};
+uint8_t heap_trace_num_sites = 1;
+uint8_t heap_trace_site = 0;
+
+uint32_t heap_trace_min_free = UINT32_MAX;
+uint16_t heap_trace_min_max_block = UINT16_MAX;
+uint8_t heap_trace_max_fragmentation = 0;
+
+void heap_trace_sample() {
+  uint32_t hfree = 0;
+  uint16_t hmax = 0;
+  uint8_t hfrag = 0;
+  ESP.getHeapStats(&hfree, &hmax, &hfrag);
+  heap_trace_min_free = min(heap_trace_min_free, hfree);
+  heap_trace_min_max_block = min(heap_trace_min_max_block, hmax);
+  heap_trace_max_fragmentation = max(heap_trace_max_fragmentation, hfrag);
+}
+
+// Sites are found by name, the sites past HEAP_TRACE_MAX_SITES count as other
+uint8_t heap_trace_find_site(const char *name) {
+  for (uint8_t i = 1; i < heap_trace_num_sites; i++) {
+    if (strcmp(heap_trace_sites[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (heap_trace_num_sites == HEAP_TRACE_MAX_SITES) {
+    return 0;
+  }
+  heap_trace_sites[heap_trace_num_sites].name = name;
+  return heap_trace_num_sites++;
+}
+
+// Tags the allocations until the end of the C++ scope. Scopes nest, e.g. the
+// web server handlers run while send_data() waits for the rest_server.
+class HeapTraceScope {
+public:
+  explicit HeapTraceScope(const char *name) : previous{heap_trace_site} {
+    heap_trace_site = heap_trace_find_site(name);
+  }
+  ~HeapTraceScope() {
+    heap_trace_site = previous;
+    heap_trace_sample();
+  }
+
+private:
+  const uint8_t previous;
+};
+
+#define HEAP_TRACE_SCOPE(name) HeapTraceScope heap_trace_scope(name)
+
+void heap_trace_alloc(void *ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  HeapTraceSite &site = heap_trace_sites[heap_trace_site];
+  site.allocs++;
+  site.bytes += size;
+  site.max_size = max(site.max_size, (uint32_t)size);
+  heap_trace_min_free = min(heap_trace_min_free, ESP.getFreeHeap());
+}
+
+void heap_trace_free(void *ptr) {
+  if (ptr != nullptr) {
+    heap_trace_sites[heap_trace_site].frees++;
+  }
+}
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+  void *ptr = __real_malloc(size);
+  heap_trace_alloc(ptr, size);
+  return ptr;
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+  void *ptr = __real_calloc(num, size);
+  heap_trace_alloc(ptr, num * size);
+  return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  void *new_ptr = __real_realloc(ptr, size);
+  if (new_ptr != nullptr || size == 0) {
+    heap_trace_free(ptr);
+  }
+  heap_trace_alloc(new_ptr, size);
+  return new_ptr;
+}
+
+void __wrap_free(void *ptr) {
+  heap_trace_free(ptr);
+  __real_free(ptr);
+}
+}
+
+#else
+
+#define HEAP_TRACE_SCOPE(name)
+
+#endif
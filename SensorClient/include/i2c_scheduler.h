@@ -0,0 +1,156 @@
+#pragma once
+
+#include "Arduino.h"
+#include "logging.h"
+#include <Wire.h> // I2C library
+
+///// I2C bus
+// Raw transactions used by the sensor drivers. Drivers talk to this interface
+// instead of Wire so they can be run against a mock bus on the host.
+class I2CBus {
+public:
+  virtual bool write(uint8_t address, const uint8_t *data, uint8_t len) = 0;
+  virtual bool read(uint8_t address, uint8_t *data, uint8_t len) = 0;
+
+  bool write_register(uint8_t address, uint8_t reg, uint8_t value) {
+    const uint8_t data[] = {reg, value};
+    return write(address, data, sizeof(data));
+  }
+
+  bool read_register(uint8_t address, uint8_t reg, uint8_t *data,
+                     uint8_t len) {
+    return write(address, &reg, 1) && read(address, data, len);
+  }
+};
+
+class TwoWireBus : public I2CBus {
+public:
+  TwoWireBus(TwoWire &wire) : wire{wire} {}
+
+  bool write(uint8_t address, const uint8_t *data, uint8_t len) {
+    wire.beginTransmission(address);
+    wire.write(data, len);
+    return wire.endTransmission() == 0;
+  }
+
+  bool read(uint8_t address, uint8_t *data, uint8_t len) {
+    if (wire.requestFrom(address, len) != len) {
+      return false;
+    }
+    for (uint8_t i = 0; i < len; i++) {
+      data[i] = wire.read();
+    }
+    return true;
+  }
+
+private:
+  TwoWire &wire;
+};
+
+TwoWireBus i2c_bus(Wire);
+
+///// I2C scheduler
+// A device read is split in a trigger phase, that starts a conversion, and a
+// collect phase, that reads the result. Each phase returns the time in ms until
+// the next collect phase, or i2c_done to finish the read, so the loop keeps
+// running while the devices convert.
+const uint32_t i2c_done = UINT32_MAX;
+
+class I2CDevice {
+public:
+  I2CDevice(const char *device_name, I2CBus &bus)
+      : device_name{device_name}, bus{bus} {}
+
+  virtual uint32_t trigger() = 0;
+  virtual uint32_t collect() = 0;
+
+  enum State : uint8_t { idle, triggering, collecting };
+
+  const char *device_name;
+  // The transactions go to i2c_bus on the station, to a mock in host tests
+  I2CBus &bus;
+  State state = idle;
+  uint32_t due_ms = 0;
+  // Time spent in bus transactions and number of finished reads
+  uint32_t bus_time_us = 0;
+  uint32_t num_reads = 0;
+};
+
+const uint8_t max_i2c_devices = 4;
+
+class I2CScheduler {
+public:
+  void add(I2CDevice *device) {
+    for (uint8_t i = 0; i < num_devices; i++) {
+      if (devices[i] == device) {
+        return;
+      }
+    }
+    if (num_devices < max_i2c_devices) {
+      devices[num_devices++] = device;
+    }
+  }
+
+  // Queue a read of device, false if it still has one in progress.
+  bool request(I2CDevice *device) {
+    if (device->state != I2CDevice::idle) {
+      return false;
+    }
+    device->state = I2CDevice::triggering;
+    device->due_ms = millis();
+    return true;
+  }
+
+  // Run the phase that has been due the longest. Only one phase runs per call,
+  // so the bus is used by a single device at a time.
+  void update() {
+    const uint32_t now = millis();
+    I2CDevice *next = nullptr;
+    for (uint8_t i = 0; i < num_devices; i++) {
+      I2CDevice *device = devices[i];
+      if (device->state == I2CDevice::idle ||
+          (int32_t)(now - device->due_ms) < 0) {
+        continue;
+      }
+      if (next == nullptr || (int32_t)(device->due_ms - next->due_ms) < 0) {
+        next = device;
+      }
+    }
+    if (next == nullptr) {
+      return;
+    }
+
+    const uint32_t start_us = micros();
+    uint32_t wait_ms;
+    if (next->state == I2CDevice::triggering) {
+      wait_ms = next->trigger();
+      next->state = I2CDevice::collecting;
+    } else {
+      wait_ms = next->collect();
+    }
+    next->bus_time_us += micros() - start_us;
+
+    if (wait_ms == i2c_done) {
+      next->state = I2CDevice::idle;
+      next->num_reads++;
+    } else {
+      next->due_ms = millis() + wait_ms;
+    }
+  }
+
+  void log_stats() {
+    for (uint8_t i = 0; i < num_devices; i++) {
+      I2CDevice *device = devices[i];
+      log_printf("I2C %s: %u reads, %u us on the bus (%u us/read).\n",
+                 device->device_name, device->num_reads, device->bus_time_us,
+                 device->num_reads ? device->bus_time_us / device->num_reads
+                                   : 0);
+    }
+  }
+
+private:
+  I2CDevice *devices[max_i2c_devices];
+  uint8_t num_devices = 0;
+};
+
+I2CScheduler i2c_scheduler;
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <ESP8266HTTPClient.h>
+
+// Static memory for the requests to the rest_server. setup_station(),
+// setup_sensors() and send_data() run one at a time from the loop, so they
+// share one arena for their JSON document and one buffer for the request or
+// response body, instead of taking blocks of different sizes from the heap on
+// every upload.
+
+// Slots of the arena, 4 kB on the station
+#ifndef JSON_ARENA_SLOTS
+#define JSON_ARENA_SLOTS 256
+#endif
+
+#ifndef HTTP_BODY_SIZE
+#define HTTP_BODY_SIZE 4096
+#endif
+
+const size_t json_arena_size = JSON_ARRAY_SIZE(JSON_ARENA_SLOTS);
+alignas(8) uint8_t json_arena[json_arena_size];
+bool json_arena_used = false;
+
+char http_body[HTTP_BODY_SIZE];
+
+// Allocator of ArenaJsonDocument. The arena holds one document at a time, a
+// second one or a capacity larger than the arena gets no memory, like a
+// DynamicJsonDocument when the heap is short.
+struct JsonArenaAllocator {
+  void *allocate(size_t size) {
+    if (json_arena_used || size > json_arena_size) {
+      return nullptr;
+    }
+    json_arena_used = true;
+    return json_arena;
+  }
+  void deallocate(void *ptr) {
+    if (ptr == json_arena) {
+      json_arena_used = false;
+    }
+  }
+  void *reallocate(void *ptr, size_t new_size) {
+    return ptr == json_arena && new_size <= json_arena_size ? ptr : nullptr;
+  }
+};
+
+typedef BasicJsonDocument<JsonArenaAllocator> ArenaJsonDocument;
+
+// Serialize a document into http_body, its length or 0 if it doesn't fit
+size_t serialize_body(const JsonDocument &json) {
+  if (json.overflowed() || measureJson(json) >= sizeof(http_body)) {
+    return 0;
+  }
+  return serializeJson(json, http_body, sizeof(http_body));
+}
+
+// Read the response body into http_body, its length or 0 if it doesn't fit
+size_t read_body(HTTPClient &http) {
+  const int size = http.getSize();
+  if (size < 0) {
+    // Chunked response, the client joins the chunks in a String
+    const String body = http.getString();
+    if (body.length() >= sizeof(http_body)) {
+      return 0;
+    }
+    memcpy(http_body, body.c_str(), body.length() + 1);
+    return body.length();
+  }
+  if ((size_t)size >= sizeof(http_body)) {
+    return 0;
+  }
+  const size_t length = http.getStream().readBytes(http_body, size);
+  http_body[length] = '\0';
+  return length;
+}
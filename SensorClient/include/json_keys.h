@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Keys and magnitude names of the rest_server documents, kept in flash. Keys
+// are used with JSON_KEY(name) and names with FPSTR(). ArduinoJson copies a
+// flash string into the document, a key only once per document. The keys of
+// the measurements in send_data() stay in RAM, as pointers they aren't copied
+// into every batch.
+#define JSON_KEY(key) FPSTR(json_key_##key)
+
+const char json_key_id[] PROGMEM = "id";
+const char json_key_name[] PROGMEM = "name";
+const char json_key_magnitudes[] PROGMEM = "magnitudes";
+const char json_key_unit[] PROGMEM = "unit";
+const char json_key_precision[] PROGMEM = "precision";
+const char json_key_token[] PROGMEM = "token";
+const char json_key_location[] PROGMEM = "location";
+const char json_key_hostname[] PROGMEM = "hostname";
+
+const char magnitude_temperature[] PROGMEM = "temperature";
+const char magnitude_humidity[] PROGMEM = "humidity";
+const char magnitude_pressure[] PROGMEM = "pressure";
+const char magnitude_eco2[] PROGMEM = "eco2";
+const char magnitude_etvoc[] PROGMEM = "etvoc";
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "Arduino.h"
+#include "common_sensor.h"
+#include "status_page.h"
+
+///// Latest measurements
+// The latest value of each magnitude of the station, kept when the frames are
+// queued since they are gone from sensor_buffer once they are uploaded. The
+// table is keyed by the server ids (sensor_id, magnitude_id), hashed into a
+// fixed open addressing table, so an update is O(1) and doesn't allocate.
+// Sensor id 0 marks a free slot, the server ids start at 1.
+#ifndef LATEST_MEASUREMENTS_SLOTS
+#define LATEST_MEASUREMENTS_SLOTS 64
+#endif
+
+typedef struct {
+  uint8_t sensor_id;
+  uint8_t magnitude_id;
+  uint8_t decimals;
+  time_t epoch;
+  int32_t value;
+} LatestMeasurement;
+
+class LatestMeasurements {
+public:
+  static const uint16_t num_slots = LATEST_MEASUREMENTS_SLOTS;
+  static_assert((num_slots & (num_slots - 1)) == 0,
+                "LATEST_MEASUREMENTS_SLOTS must be a power of 2");
+
+  void update(const SensorFrame &frame, Sensor &sensor) {
+    for (uint8_t i = 0; i < frame.num_values; i++) {
+      const uint8_t magnitude = frame.first_magnitude + i;
+      const uint8_t magnitude_id = sensor.magnitude_id(magnitude);
+      if (magnitude_id == 0) {
+        // Not registered on the server, it isn't posted either
+        continue;
+      }
+      LatestMeasurement *slot = find_slot(frame.sensor_id, magnitude_id);
+      if (slot == nullptr) {
+        num_dropped++;
+        continue;
+      }
+      slot->decimals = sensor.magnitude_decimals(magnitude);
+      slot->epoch = frame.epoch;
+      slot->value = frame.values[i];
+    }
+  }
+
+  // Forget every measurement, their ids are stale once the sensors get new
+  // ones from the rest_server
+  void clear() {
+    for (LatestMeasurement &slot : slots) {
+      slot = {};
+    }
+  }
+
+  // Slots in table order, free ones have sensor_id 0
+  const LatestMeasurement &slot(uint16_t index) const { return slots[index]; }
+
+  // Updates that found the table full
+  uint32_t num_dropped = 0;
+
+private:
+  LatestMeasurement slots[num_slots] = {};
+
+  // The slot of the key, taken if it is new. nullptr when the table is full or
+  // the ids aren't set yet.
+  LatestMeasurement *find_slot(uint8_t sensor_id, uint8_t magnitude_id) {
+    if (sensor_id == 0 || magnitude_id == 0) {
+      return nullptr;
+    }
+    // Fibonacci hashing of the 16 bit key, the top bits are the index
+    const uint16_t key = sensor_id << 8 | magnitude_id;
+    uint16_t index = (uint16_t)(key * 40503u) / (65536 / num_slots);
+    for (uint16_t probes = 0; probes < num_slots; probes++) {
+      LatestMeasurement &slot = slots[index];
+      if (slot.sensor_id == 0) {
+        slot.sensor_id = sensor_id;
+        slot.magnitude_id = magnitude_id;
+        return &slot;
+      }
+      if (slot.sensor_id == sensor_id && slot.magnitude_id == magnitude_id) {
+        return &slot;
+      }
+      index = (index + 1) % num_slots;
+    }
+    return nullptr;
+  }
+};
+
+LatestMeasurements latest_measurements;
+
+// /api/latest, the table as a JSON array of the measurements in the format
+// they are posted in, e.g.
+//   [{"sensor_id":1,"magnitude_id":2,"timestamp":1622512800,"value":"55.1"}]
+// It is streamed like the status page, each slot is copied when it is
+// started so an update while it is sent doesn't mix two values.
+class LatestMeasurementsJson {
+public:
+  size_t fill(uint8_t *buffer, size_t size) {
+    ChunkWriter out(buffer, size);
+    while (index <= LatestMeasurements::num_slots) {
+      out.start_part(part_offset);
+      if (index == LatestMeasurements::num_slots) {
+        out.print_P(first ? PSTR("[]") : PSTR("]"));
+      } else {
+        if (part_offset == 0) {
+          measurement = latest_measurements.slot(index);
+        }
+        render(out);
+      }
+      if (out.is_full()) {
+        part_offset = out.part_position();
+        break;
+      }
+      index++;
+      part_offset = 0;
+    }
+    return out.chunk_length();
+  }
+
+private:
+  uint16_t index = 0;
+  size_t part_offset = 0;
+  bool first = true;
+  LatestMeasurement measurement;
+
+  void render(ChunkWriter &out) {
+    if (measurement.sensor_id == 0) {
+      return;
+    }
+    char value[16];
+    format_fixed(measurement.value, measurement.decimals, value,
+                 sizeof(value));
+    char line[96];
+    snprintf_P(line, sizeof(line),
+               PSTR("%c{\"sensor_id\":%u,\"magnitude_id\":%u,"
+                    "\"timestamp\":%ld,\"value\":\"%s\"}"),
+               first ? '[' : ',', measurement.sensor_id,
+               measurement.magnitude_id, (long)measurement.epoch, value);
+    out.print(line);
+    if (!out.is_full()) {
+      first = false;
+    }
+  }
+};
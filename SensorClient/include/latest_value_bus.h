@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Arduino.h"
+
+///// Latest value bus
+// Sensors publish the latest value of the physical quantities they measure so
+// other sensors of the station can use them, e.g. for compensation.
+enum class Quantity : uint8_t { temperature, humidity };
+const uint8_t num_quantities = 2;
+
+class LatestValueBus {
+public:
+  void publish(Quantity quantity, float value, time_t epoch) {
+    latest[(uint8_t)quantity] = {value, epoch};
+  }
+
+  // Get the latest value if it is not older than max_age_s
+  bool get(Quantity quantity, float &value, time_t now, uint32_t max_age_s) {
+    const LatestValue &latest_value = latest[(uint8_t)quantity];
+    if (latest_value.epoch == 0 || now - latest_value.epoch > max_age_s) {
+      return false;
+    }
+    value = latest_value.value;
+    return true;
+  }
+
+private:
+  typedef struct {
+    float value;
+    time_t epoch;
+  } LatestValue;
+  LatestValue latest[num_quantities] = {};
+};
+
+LatestValueBus latest_values;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Arduino.h"
+#include "ESPAsyncWebServer.h"
+#include "common_sensor.h"
+
+///// Live events
+// Every queued frame is pushed to the clients of /events as a Server-Sent
+// Event "frame", e.g.
+//   {"sensor_id":1,"timestamp":1622512800,"values":{"1":21.5,"2":55.1}}
+// with the values keyed by magnitude id. The event is formatted once in a
+// static buffer and the library queues a copy of it for each client.
+//
+// Memory stays bounded: at most max_live_clients are kept and the library
+// queues up to SSE_MAX_QUEUED_MESSAGES per client. A client that falls behind
+// has the new events dropped until it catches up, the others still get them.
+// When all the clients are full the frame isn't even formatted.
+const uint8_t max_live_clients = 3;
+
+AsyncEventSource live_events("/events");
+char live_event[64 + max_frame_values * 20];
+uint32_t num_live_events = 0, num_live_dropped = 0;
+
+// Compact JSON of a frame, the length or 0 when it doesn't fit or none of its
+// magnitudes is registered
+size_t format_live_event(const SensorFrame &frame, Sensor &sensor, char *event,
+                         size_t size) {
+  size_t length = snprintf_P(event, size,
+                             PSTR("{\"sensor_id\":%u,\"timestamp\":%ld,"
+                                  "\"values\":{"),
+                             frame.sensor_id, (long)frame.epoch);
+  bool first = true;
+  for (uint8_t i = 0; i < frame.num_values && length < size; i++) {
+    const uint8_t magnitude = frame.first_magnitude + i;
+    const uint8_t magnitude_id = sensor.magnitude_id(magnitude);
+    if (magnitude_id == 0) {
+      // Not registered on the server, it isn't posted either
+      continue;
+    }
+    length += snprintf_P(event + length, size - length, PSTR("%s\"%u\":"),
+                         first ? "" : ",", magnitude_id);
+    first = false;
+    if (length < size) {
+      length += format_fixed(frame.values[i],
+                             sensor.magnitude_decimals(magnitude),
+                             event + length, size - length);
+    }
+  }
+  if (length < size) {
+    length += snprintf_P(event + length, size - length, PSTR("}}"));
+  }
+  return length < size && !first ? length : 0;
+}
+
+void send_live_event(const SensorFrame &frame, Sensor &sensor) {
+  if (live_events.count() == 0) {
+    return;
+  }
+  if (live_events.avgPacketsWaiting() >= SSE_MAX_QUEUED_MESSAGES) {
+    num_live_dropped++;
+    return;
+  }
+  if (format_live_event(frame, sensor, live_event, sizeof(live_event)) > 0) {
+    live_events.send(live_event, "frame");
+    num_live_events++;
+  }
+}
+
+void setup_live_events(AsyncWebServer &server) {
+  live_events.onConnect([](AsyncEventSourceClient *client) {
+    if (live_events.count() > max_live_clients) {
+      client->close();
+    }
+  });
+  server.addHandler(&live_events);
+}
@@ -11,31 +11,52 @@ typedef struct {
 
 CircularBuffer<LogData, 20> log_buffer;
 CircularBuffer<LogData, 15> log_header_buffer;
+// Messages pushed to each buffer since boot, the message number n is at index
+// n - (log_writes - log_buffer.size()) while it is in the buffer
+uint32_t log_writes = 0, log_header_writes = 0;
 
-void log_header_printf(const char *format, ...) {
+void push_log(const LogData &value) {
+  log_buffer.push(value);
+  log_writes++;
+}
+
+void push_header_log(const LogData &value) {
+  log_header_buffer.push(value);
+  log_header_writes++;
+}
+
+// The format strings are kept in flash: log_printf() and log_header_printf()
+// take a string literal and pass it with PSTR() to the _P functions, so a
+// format can't end up in RAM by mistake. Messages without arguments go to
+// log_println() with F().
+#define log_header_printf(format, ...)                                         \
+  log_header_printf_P(PSTR(format), ##__VA_ARGS__)
+#define log_printf(format, ...) log_printf_P(PSTR(format), ##__VA_ARGS__)
+
+void log_header_printf_P(PGM_P format, ...) {
   LogData new_value{defaultTZ->now()};
   va_list arg;
   va_start(arg, format);
-  vsnprintf(new_value.message, sizeof(new_value.message), format, arg);
+  vsnprintf_P(new_value.message, sizeof(new_value.message), format, arg);
   va_end(arg);
-  log_header_buffer.push(new_value);
+  push_header_log(new_value);
 }
 
-void log_printf(const char *format, ...) {
+void log_printf_P(PGM_P format, ...) {
   LogData new_value{defaultTZ->now()};
   va_list arg;
   va_start(arg, format);
-  vsnprintf(new_value.message, sizeof(new_value.message), format, arg);
+  vsnprintf_P(new_value.message, sizeof(new_value.message), format, arg);
   va_end(arg);
   Serial.print(new_value.message);
-  log_buffer.push(new_value);
+  push_log(new_value);
 }
 
 void log_print(const char *str) {
   LogData new_value{defaultTZ->now()};
   snprintf(new_value.message, sizeof(new_value.message), "%s", str);
   Serial.print(new_value.message);
-  log_buffer.push(new_value);
+  push_log(new_value);
 }
 // void log_print(const String &str) { log_print(str.c_str()); }
 
@@ -43,6 +64,13 @@ void log_println(const char *str) {
   LogData new_value{defaultTZ->now()};
   snprintf(new_value.message, sizeof(new_value.message), "%s", str);
   Serial.println(new_value.message);
-  log_buffer.push(new_value);
+  push_log(new_value);
 }
 void log_println(const String &str) { log_println(str.c_str()); }
+void log_println(const __FlashStringHelper *str) {
+  LogData new_value{defaultTZ->now()};
+  strncpy_P(new_value.message, (PGM_P)str, sizeof(new_value.message) - 1);
+  new_value.message[sizeof(new_value.message) - 1] = '\0';
+  Serial.println(new_value.message);
+  push_log(new_value);
+}
@@ -0,0 +1,502 @@
+#pragma once
+
+#include "Arduino.h"
+#include "p1_parser.h"
+
+///// P1 data
+// Values of a telegram, stored per field as fixed point integers with the
+// decimals of the field, e.g. kWh with 3 decimals is stored in Wh.
+enum P1Field : uint8_t {
+  p1_consumption_1,
+  p1_consumption_2,
+  p1_delivery_1,
+  p1_delivery_2,
+  p1_actual_tariff,
+  p1_actual_consumption,
+  p1_actual_delivery,
+  p1_power_failures,
+  p1_long_power_failures,
+  p1_voltage_sags_l1,
+  p1_voltage_sags_l2,
+  p1_voltage_sags_l3,
+  p1_voltage_swells_l1,
+  p1_voltage_swells_l2,
+  p1_voltage_swells_l3,
+  p1_voltage_l1,
+  p1_voltage_l2,
+  p1_voltage_l3,
+  p1_current_l1,
+  p1_current_l2,
+  p1_current_l3,
+  p1_power_consumption_l1,
+  p1_power_consumption_l2,
+  p1_power_consumption_l3,
+  p1_power_delivery_l1,
+  p1_power_delivery_l2,
+  p1_power_delivery_l3,
+  p1_gas_consumption,
+  // Derived from the telegrams of a report interval
+  p1_peak_consumption,
+  p1_peak_delivery,
+  num_p1_fields
+};
+static_assert(num_p1_fields <= 32, "P1 fields must fit in a uint32_t mask");
+
+typedef struct {
+  time_t timestamp;     // UTC
+  time_t gas_timestamp; // UTC
+  int32_t values[num_p1_fields];
+} P1Data;
+
+// How the values of a field are reported over an interval
+enum class P1Kind : uint8_t {
+  counter, // cumulative, reported as a snapshot or as the interval delta
+  instant, // reported as the average of the interval
+  state,   // reported as the last value
+  peak,    // maximum of an instant field over the interval
+};
+
+// Magnitude registered on the server for each field. The table is in flash,
+// its fields are read with the accessors below.
+typedef struct {
+  char name[25];
+  char unit[4];
+  uint8_t decimals;
+  P1Kind kind;
+} P1Magnitude;
+
+constexpr P1Magnitude p1_magnitudes[num_p1_fields] PROGMEM = {
+    {"power_consumption_1", "kWh", 3, P1Kind::counter},
+    {"power_consumption_2", "kWh", 3, P1Kind::counter},
+    {"power_delivery_1", "kWh", 3, P1Kind::counter},
+    {"power_delivery_2", "kWh", 3, P1Kind::counter},
+    {"actual_tariff", "", 0, P1Kind::state},
+    {"actual_power_consumption", "kW", 3, P1Kind::instant},
+    {"actual_power_delivery", "kW", 3, P1Kind::instant},
+    {"power_failures", "", 0, P1Kind::counter},
+    {"long_power_failures", "", 0, P1Kind::counter},
+    {"voltage_sags_l1", "", 0, P1Kind::counter},
+    {"voltage_sags_l2", "", 0, P1Kind::counter},
+    {"voltage_sags_l3", "", 0, P1Kind::counter},
+    {"voltage_swells_l1", "", 0, P1Kind::counter},
+    {"voltage_swells_l2", "", 0, P1Kind::counter},
+    {"voltage_swells_l3", "", 0, P1Kind::counter},
+    {"voltage_l1", "V", 1, P1Kind::instant},
+    {"voltage_l2", "V", 1, P1Kind::instant},
+    {"voltage_l3", "V", 1, P1Kind::instant},
+    {"current_l1", "A", 0, P1Kind::instant},
+    {"current_l2", "A", 0, P1Kind::instant},
+    {"current_l3", "A", 0, P1Kind::instant},
+    {"power_consumption_l1", "kW", 3, P1Kind::instant},
+    {"power_consumption_l2", "kW", 3, P1Kind::instant},
+    {"power_consumption_l3", "kW", 3, P1Kind::instant},
+    {"power_delivery_l1", "kW", 3, P1Kind::instant},
+    {"power_delivery_l2", "kW", 3, P1Kind::instant},
+    {"power_delivery_l3", "kW", 3, P1Kind::instant},
+    {"gas_consumption", "m3", 3, P1Kind::counter},
+    {"peak_power_consumption", "kW", 3, P1Kind::peak},
+    {"peak_power_delivery", "kW", 3, P1Kind::peak},
+};
+
+PGM_P p1_name(uint8_t field) { return p1_magnitudes[field].name; }
+PGM_P p1_unit(uint8_t field) { return p1_magnitudes[field].unit; }
+uint8_t p1_decimals(uint8_t field) {
+  return pgm_read_byte(&p1_magnitudes[field].decimals);
+}
+P1Kind p1_kind(uint8_t field) {
+  return (P1Kind)pgm_read_byte(&p1_magnitudes[field].kind);
+}
+
+///// Subscriptions
+// Fields decoded and sent by the station, in magnitude order. Set per env with
+// -DP1_SUBSCRIPTIONS=p1_consumption_1,p1_voltage_l1,... Lines of the other
+// fields are skipped without parsing their values.
+#ifndef P1_SUBSCRIPTIONS
+#define P1_SUBSCRIPTIONS                                                       \
+  p1_consumption_1, p1_consumption_2, p1_delivery_1, p1_delivery_2,            \
+      p1_gas_consumption, p1_actual_consumption, p1_actual_delivery
+#endif
+const P1Field p1_subscriptions[] = {P1_SUBSCRIPTIONS};
+const uint8_t num_p1_subscriptions = sizeof(p1_subscriptions) / sizeof(P1Field);
+
+// Fields to decode, peaks need the power they are taken from
+uint32_t p1_subscription_mask() {
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < num_p1_subscriptions; i++) {
+    mask |= (uint32_t)1 << p1_subscriptions[i];
+  }
+  if (mask & (uint32_t)1 << p1_peak_consumption) {
+    mask |= (uint32_t)1 << p1_actual_consumption;
+  }
+  if (mask & (uint32_t)1 << p1_peak_delivery) {
+    mask |= (uint32_t)1 << p1_actual_delivery;
+  }
+  return mask;
+}
+
+///// OBIS dispatch
+// Each OBIS code maps to the field it is stored in and the type of its value,
+// so decoding a line is a single lookup. To decode an extra code add a field,
+// its magnitude and an entry to the table, keeping it sorted by code.
+enum class P1ValueType : uint8_t {
+  timestamp, // YYMMDDhhmmssX, stored in timestamp
+  fixed,     // number, stored with the decimals of the field
+  gas,       // (timestamp)(number), stored in gas_timestamp and field
+};
+
+typedef struct {
+  uint32_t code;
+  P1Field field;
+  P1ValueType type;
+} ObisEntry;
+
+// Dutch ESMR 4.0 implementation, extended with the DSMR 5.0.2 fields
+// https://www.netbeheernederland.nl/_upload/Files/Slimme_meter_15_32ffe3cc38.pdf
+constexpr ObisEntry obis_table[] PROGMEM = {
+    // 0-0:1.0.0(220821195452S) = Date-time stamp of the P1 message
+    {obis(0, 0, 1, 0, 0), num_p1_fields, P1ValueType::timestamp},
+    // 0-0:96.7.9(00003) = Number of long power failures in any phase
+    {obis(0, 0, 96, 7, 9), p1_long_power_failures, P1ValueType::fixed},
+    // 0-0:96.7.21(00007) = Number of power failures in any phase
+    {obis(0, 0, 96, 7, 21), p1_power_failures, P1ValueType::fixed},
+    // 0-0:96.14.0(0001) = Current tariff (1 or 2)
+    {obis(0, 0, 96, 14, 0), p1_actual_tariff, P1ValueType::fixed},
+    // 0-1:24.2.1(220821190000S)(08385.402*m3) = Last 5-minute value
+    // (temperature converted) of gas delivered to client, with its capture time
+    {obis(0, 1, 24, 2, 1), p1_gas_consumption, P1ValueType::gas},
+    // 1-0:1.7.0(00.378*kW) = Actual electricity power delivered (+P)
+    {obis(1, 0, 1, 7, 0), p1_actual_consumption, P1ValueType::fixed},
+    // 1-0:1.8.1(000992.992*kWh) = Electricity delivered to client (Tariff 1)
+    {obis(1, 0, 1, 8, 1), p1_consumption_1, P1ValueType::fixed},
+    // 1-0:1.8.2(000992.992*kWh) = Electricity delivered to client (Tariff 2)
+    {obis(1, 0, 1, 8, 2), p1_consumption_2, P1ValueType::fixed},
+    // 1-0:2.7.0(00.000*kW) = Actual electricity power received (-P)
+    {obis(1, 0, 2, 7, 0), p1_actual_delivery, P1ValueType::fixed},
+    // 1-0:2.8.1(000560.157*kWh) = Electricity delivered by client (Tariff 1)
+    {obis(1, 0, 2, 8, 1), p1_delivery_1, P1ValueType::fixed},
+    // 1-0:2.8.2(000560.157*kWh) = Electricity delivered by client (Tariff 2)
+    {obis(1, 0, 2, 8, 2), p1_delivery_2, P1ValueType::fixed},
+    // 1-0:21.7.0(00.378*kW) = Instantaneous active power L1 (+P)
+    {obis(1, 0, 21, 7, 0), p1_power_consumption_l1, P1ValueType::fixed},
+    // 1-0:22.7.0(00.000*kW) = Instantaneous active power L1 (-P)
+    {obis(1, 0, 22, 7, 0), p1_power_delivery_l1, P1ValueType::fixed},
+    // 1-0:31.7.0(002*A) = Instantaneous current L1
+    {obis(1, 0, 31, 7, 0), p1_current_l1, P1ValueType::fixed},
+    // 1-0:32.7.0(230.1*V) = Instantaneous voltage L1
+    {obis(1, 0, 32, 7, 0), p1_voltage_l1, P1ValueType::fixed},
+    // 1-0:32.32.0(00002) = Number of voltage sags in phase L1
+    {obis(1, 0, 32, 32, 0), p1_voltage_sags_l1, P1ValueType::fixed},
+    // 1-0:32.36.0(00000) = Number of voltage swells in phase L1
+    {obis(1, 0, 32, 36, 0), p1_voltage_swells_l1, P1ValueType::fixed},
+    // 1-0:41.7.0(00.000*kW) = Instantaneous active power L2 (+P)
+    {obis(1, 0, 41, 7, 0), p1_power_consumption_l2, P1ValueType::fixed},
+    // 1-0:42.7.0(00.000*kW) = Instantaneous active power L2 (-P)
+    {obis(1, 0, 42, 7, 0), p1_power_delivery_l2, P1ValueType::fixed},
+    // 1-0:51.7.0(000*A) = Instantaneous current L2
+    {obis(1, 0, 51, 7, 0), p1_current_l2, P1ValueType::fixed},
+    // 1-0:52.7.0(230.0*V) = Instantaneous voltage L2
+    {obis(1, 0, 52, 7, 0), p1_voltage_l2, P1ValueType::fixed},
+    // 1-0:52.32.0(00001) = Number of voltage sags in phase L2
+    {obis(1, 0, 52, 32, 0), p1_voltage_sags_l2, P1ValueType::fixed},
+    // 1-0:52.36.0(00000) = Number of voltage swells in phase L2
+    {obis(1, 0, 52, 36, 0), p1_voltage_swells_l2, P1ValueType::fixed},
+    // 1-0:61.7.0(00.000*kW) = Instantaneous active power L3 (+P)
+    {obis(1, 0, 61, 7, 0), p1_power_consumption_l3, P1ValueType::fixed},
+    // 1-0:62.7.0(00.000*kW) = Instantaneous active power L3 (-P)
+    {obis(1, 0, 62, 7, 0), p1_power_delivery_l3, P1ValueType::fixed},
+    // 1-0:71.7.0(000*A) = Instantaneous current L3
+    {obis(1, 0, 71, 7, 0), p1_current_l3, P1ValueType::fixed},
+    // 1-0:72.7.0(229.9*V) = Instantaneous voltage L3
+    {obis(1, 0, 72, 7, 0), p1_voltage_l3, P1ValueType::fixed},
+    // 1-0:72.32.0(00001) = Number of voltage sags in phase L3
+    {obis(1, 0, 72, 32, 0), p1_voltage_sags_l3, P1ValueType::fixed},
+    // 1-0:72.36.0(00000) = Number of voltage swells in phase L3
+    {obis(1, 0, 72, 36, 0), p1_voltage_swells_l3, P1ValueType::fixed},
+};
+const uint8_t num_obis_entries = sizeof(obis_table) / sizeof(ObisEntry);
+
+constexpr bool obis_table_sorted(uint8_t i) {
+  return i + 1 >= num_obis_entries ||
+         (obis_table[i].code < obis_table[i + 1].code &&
+          obis_table_sorted(i + 1));
+}
+static_assert(obis_table_sorted(0), "obis_table must be sorted by code");
+
+// Binary search of the table, false if the code is not in it.
+bool find_obis(uint32_t code, ObisEntry &entry) {
+  uint8_t low = 0, high = num_obis_entries;
+  while (low < high) {
+    const uint8_t mid = (low + high) / 2;
+    const uint32_t mid_code = pgm_read_dword(&obis_table[mid].code);
+    if (mid_code == code) {
+      memcpy_P(&entry, &obis_table[mid], sizeof(ObisEntry));
+      return true;
+    } else if (mid_code < code) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return false;
+}
+
+// Parse a decimal number such as 000992.992 straight into a fixed point
+// integer with the given decimals (992992 with 3 decimals), without floating
+// point. Extra decimals are rounded half up. False if it isn't a number or it
+// doesn't fit in an int32_t.
+bool parse_fixed(const char *text, uint8_t decimals, int32_t &value) {
+  const bool negative = *text == '-';
+  if (negative) {
+    text++;
+  }
+
+  uint32_t result = 0;
+  bool has_digits = false, fraction = false, round_up = false;
+  uint8_t num_decimals = 0;
+  for (; *text != '\0'; text++) {
+    const char c = *text;
+    if (c == '.' && !fraction) {
+      fraction = true;
+      continue;
+    }
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    const uint8_t digit = c - '0';
+    if (fraction && num_decimals >= decimals) {
+      // Only the first extra decimal matters for rounding
+      if (num_decimals++ == decimals) {
+        round_up = digit >= 5;
+      }
+      has_digits = true;
+      continue;
+    }
+    if (result > (uint32_t)(INT32_MAX - digit) / 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+    has_digits = true;
+    if (fraction) {
+      num_decimals++;
+    }
+  }
+  if (!has_digits) {
+    return false;
+  }
+
+  for (; num_decimals < decimals; num_decimals++) {
+    if (result > INT32_MAX / 10) {
+      return false;
+    }
+    result *= 10;
+  }
+  if (round_up) {
+    if (result == INT32_MAX) {
+      return false;
+    }
+    result++;
+  }
+  value = negative ? -(int32_t)result : (int32_t)result;
+  return true;
+}
+
+// Dutch meters send local time, CET in winter and CEST in summer
+const time_t p1_winter_offset_s = 3600;
+const time_t p1_summer_offset_s = 7200;
+
+int8_t two_digits(const char *digits) {
+  if (digits[0] < '0' || digits[0] > '9' || digits[1] < '0' ||
+      digits[1] > '9') {
+    return -1;
+  }
+  return (digits[0] - '0') * 10 + (digits[1] - '0');
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar, for
+// years from 2000
+int32_t days_from_civil(int16_t year, uint8_t month, uint8_t day) {
+  year -= month <= 2;
+  const int32_t era = year / 400;
+  const uint32_t year_of_era = year - era * 400;
+  const uint32_t day_of_year =
+      (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const uint32_t day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + (int32_t)day_of_era - 719468;
+}
+
+// Parse YYMMDDhhmmssX to UTC epoch seconds. X is S (summer) or W (winter) and
+// gives the offset of the local time, so the repeated hour at the end of
+// summer time is not ambiguous. False if the timestamp is malformed.
+bool parse_p1_timestamp(const char *text, time_t &utc) {
+  int8_t fields[6];
+  for (uint8_t i = 0; i < 6; i++) {
+    fields[i] = two_digits(text + 2 * i);
+    if (fields[i] < 0) {
+      return false;
+    }
+  }
+  const uint8_t month = fields[1], day = fields[2];
+  const uint8_t hour = fields[3], minute = fields[4], second = fields[5];
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 ||
+      minute > 59 || second > 59) {
+    return false;
+  }
+
+  time_t offset_s;
+  if (text[12] == 'S') {
+    offset_s = p1_summer_offset_s;
+  } else if (text[12] == 'W') {
+    offset_s = p1_winter_offset_s;
+  } else {
+    return false;
+  }
+
+  utc = (time_t)days_from_civil(2000 + fields[0], month, day) * 86400 +
+        hour * 3600 + minute * 60 + second - offset_s;
+  return true;
+}
+
+// Store the values of a line in data, false if its code is not decoded or its
+// field is not in the subscribed mask.
+bool decode_p1_line(const P1Line &line, P1Data &data, uint32_t subscribed) {
+  ObisEntry entry;
+  if (line.obis == 0 || !find_obis(line.obis, entry)) {
+    return false;
+  }
+  if (entry.type != P1ValueType::timestamp &&
+      (subscribed & (uint32_t)1 << entry.field) == 0) {
+    return false;
+  }
+
+  const char *value = line.values[0];
+  switch (entry.type) {
+  case P1ValueType::timestamp:
+    return parse_p1_timestamp(value, data.timestamp);
+  case P1ValueType::fixed:
+    return parse_fixed(value, p1_decimals(entry.field),
+                       data.values[entry.field]);
+  case P1ValueType::gas:
+    if (line.num_groups < 2) {
+      return false;
+    }
+    return parse_p1_timestamp(value, data.gas_timestamp) &&
+           parse_fixed(line.values[1], p1_decimals(entry.field),
+                       data.values[entry.field]);
+  }
+  return true;
+}
+
+///// Report intervals
+// Meters send a telegram every second (DSMR 5) or 10 seconds (DSMR 4). The
+// telegrams of each P1_REPORT_INTERVAL_S window, aligned to UTC, are reduced
+// to a single report: counters as the last snapshot, or with P1_REPORT_DELTAS
+// as the increase since the previous report, instant values as their average
+// and peaks as the maximum power. The report of an interval is ready when the
+// first telegram of the next one arrives.
+#ifndef P1_REPORT_INTERVAL_S
+#define P1_REPORT_INTERVAL_S 60
+#endif
+const time_t p1_report_interval_s = max(P1_REPORT_INTERVAL_S, 1);
+
+#ifdef P1_REPORT_DELTAS
+const char p1_delta_suffix[] = "_delta";
+#else
+const char p1_delta_suffix[] = "";
+#endif
+
+// Counters are registered with p1_delta_suffix when they are sent as deltas.
+// Toggling P1_REPORT_DELTAS or the subscriptions registers new names on the
+// sensor the server already has, it adds them to its magnitudes and keeps the
+// old ones.
+bool p1_magnitude_matches(P1Field field, const char *name) {
+  const size_t length = strlen_P(p1_name(field));
+  if (strncmp_P(name, p1_name(field), length) != 0) {
+    return false;
+  }
+  return strcmp(name + length,
+                p1_kind(field) == P1Kind::counter ? p1_delta_suffix : "") == 0;
+}
+
+class P1Interval {
+public:
+  // True if timestamp starts a new interval and the last one has telegrams
+  bool ends_before(time_t timestamp) const {
+    return num_telegrams > 0 && timestamp / p1_report_interval_s !=
+                                    last.timestamp / p1_report_interval_s;
+  }
+
+  void add(const P1Data &data) {
+    if (!has_reported) {
+      reported = data;
+      has_reported = true;
+#ifdef P1_REPORT_DELTAS
+      // The delta of the capture already there when the station started is
+      // unknown
+      reported_gas_timestamp = data.gas_timestamp;
+#endif
+    }
+    if (num_telegrams == 0) {
+      memset(sums, 0, sizeof(sums));
+      peaks[0] = data.values[p1_actual_consumption];
+      peaks[1] = data.values[p1_actual_delivery];
+    }
+    for (uint8_t field = 0; field < num_p1_fields; field++) {
+      if (p1_kind(field) == P1Kind::instant) {
+        sums[field] += data.values[field];
+      }
+    }
+    peaks[0] = max(peaks[0], data.values[p1_actual_consumption]);
+    peaks[1] = max(peaks[1], data.values[p1_actual_delivery]);
+    last = data;
+    num_telegrams++;
+  }
+
+  // Reduce the telegrams added since the last report and start a new interval
+  void report(P1Data &report) {
+    report.timestamp = last.timestamp;
+    report.gas_timestamp = last.gas_timestamp;
+    // The meter captures gas every 5 minutes or hour, the reports in between
+    // repeat the last capture. Its value only changes with a new capture, so
+    // its delta is the one since the previous capture.
+    new_gas = last.gas_timestamp > reported_gas_timestamp;
+    if (new_gas) {
+      reported_gas_timestamp = last.gas_timestamp;
+    }
+    for (uint8_t field = 0; field < num_p1_fields; field++) {
+      int32_t &value = report.values[field];
+      switch (p1_kind(field)) {
+      case P1Kind::counter:
+#ifdef P1_REPORT_DELTAS
+        value = last.values[field] - reported.values[field];
+#else
+        value = last.values[field];
+#endif
+        break;
+      case P1Kind::instant:
+        value = num_telegrams ? sums[field] / num_telegrams : 0;
+        break;
+      case P1Kind::state:
+        value = last.values[field];
+        break;
+      case P1Kind::peak:
+        value = peaks[field - p1_peak_consumption];
+        break;
+      }
+    }
+    reported = last;
+    num_telegrams = 0;
+  }
+
+  // True if the last report has a gas capture that wasn't reported yet
+  bool has_new_gas() const { return new_gas; }
+
+private:
+  P1Data last, reported;
+  bool has_reported = false;
+  time_t reported_gas_timestamp = 0;
+  bool new_gas = false;
+  uint16_t num_telegrams = 0;
+  int64_t sums[num_p1_fields];
+  int32_t peaks[2];
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "Arduino.h"
+
+///// P1 telegram parser
+// Incremental parser of DSMR telegrams. Bytes are fed one at a time as they
+// come from the UART into a fixed line buffer, the CRC is updated with each
+// byte and complete lines are split in place into OBIS code, values and units.
+// Nothing is allocated on the heap.
+//
+// 1-0:1.8.1(000992.992*kWh) -> code: "1-0:1.8.1", value: "000992.992",
+//                              unit: "kWh"
+// 0-1:24.2.1(220821190000S)(08385.402*m3) -> two value groups
+const uint8_t p1_max_line_length = 128;
+const uint8_t p1_max_groups = 2;
+
+// OBIS code A-B:C.D.E packed in 32 bits, B is at most 15
+constexpr uint32_t obis(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e) {
+  return (uint32_t)a << 28 | (uint32_t)(b & 0x0F) << 24 | (uint32_t)c << 16 |
+         (uint32_t)d << 8 | e;
+}
+
+typedef struct {
+  const char *code;
+  uint32_t obis; // 0 if the code is not a valid OBIS code
+  uint8_t num_groups;
+  const char *values[p1_max_groups];
+  const char *units[p1_max_groups]; // nullptr if the group has no unit
+} P1Line;
+
+// CRC-16/ARC lookup table, kept in flash
+const uint16_t crc16_table[256] PROGMEM = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+};
+
+// CRC-16/ARC (polynomial 0xA001 reflected, initial value 0), one table lookup
+// per byte
+uint16_t p1_crc16(uint16_t crc, char c) {
+  return (crc >> 8) ^ pgm_read_word(&crc16_table[(crc ^ (uint8_t)c) & 0xFF]);
+}
+
+enum class P1Event : uint8_t { none, line, valid_telegram, invalid_telegram };
+
+class P1Parser {
+public:
+  P1Event feed(char c) {
+    switch (state) {
+    case State::wait_start:
+      if (c == '/') {
+        start_telegram();
+      }
+      return P1Event::none;
+
+    case State::telegram:
+      // A start at the beginning of a line means the previous telegram was cut
+      if (c == '/' && length == 0) {
+        start_telegram();
+        return P1Event::none;
+      }
+      crc = p1_crc16(crc, c);
+      if (c == '!' && length == 0) {
+        state = State::checksum;
+        num_crc_digits = 0;
+        received_crc = 0;
+      } else if (c == '\n') {
+        const bool complete = split_line();
+        length = 0;
+        truncated = false;
+        return complete ? P1Event::line : P1Event::none;
+      } else if (c != '\r') {
+        if (length < p1_max_line_length - 1) {
+          buffer[length++] = c;
+        } else {
+          truncated = true;
+        }
+      }
+      return P1Event::none;
+
+    case State::checksum: {
+      const int8_t digit = hex_digit(c);
+      if (digit < 0) {
+        state = State::wait_start;
+        return P1Event::invalid_telegram;
+      }
+      received_crc = received_crc << 4 | digit;
+      if (++num_crc_digits < 4) {
+        return P1Event::none;
+      }
+      state = State::wait_start;
+      return received_crc == crc ? P1Event::valid_telegram
+                                 : P1Event::invalid_telegram;
+    }
+    }
+    return P1Event::none;
+  }
+
+  // Last complete line, valid until the next byte is fed
+  const P1Line &line() const { return current_line; }
+
+private:
+  enum class State : uint8_t { wait_start, telegram, checksum };
+  State state = State::wait_start;
+
+  char buffer[p1_max_line_length];
+  uint8_t length = 0;
+  bool truncated = false;
+  P1Line current_line;
+
+  uint16_t crc = 0, received_crc = 0;
+  uint8_t num_crc_digits = 0;
+
+  void start_telegram() {
+    state = State::telegram;
+    crc = p1_crc16(0x0000, '/');
+    length = 0;
+    truncated = false;
+  }
+
+  // Terminate code, values and units in place. False for lines without
+  // values (header, empty lines) or that didn't fit in the buffer.
+  bool split_line() {
+    if (truncated) {
+      return false;
+    }
+    buffer[length] = '\0';
+    char *open = strchr(buffer, '(');
+    if (open == nullptr) {
+      return false;
+    }
+    *open = '\0';
+    current_line.code = buffer;
+    current_line.obis = parse_obis(buffer);
+    current_line.num_groups = 0;
+
+    while (open != nullptr && current_line.num_groups < p1_max_groups) {
+      char *value = open + 1;
+      char *close = strchr(value, ')');
+      if (close == nullptr) {
+        return false;
+      }
+      *close = '\0';
+      char *star = strchr(value, '*');
+      if (star != nullptr) {
+        *star = '\0';
+      }
+      current_line.values[current_line.num_groups] = value;
+      current_line.units[current_line.num_groups] =
+          star != nullptr ? star + 1 : nullptr;
+      current_line.num_groups++;
+      open = *(close + 1) == '(' ? close + 1 : nullptr;
+    }
+    return true;
+  }
+
+  // A-B:C.D.E, the A and B groups are 4 bits wide
+  static uint32_t parse_obis(const char *code) {
+    static const char separators[] = {'-', ':', '.', '.', '\0'};
+    uint8_t numbers[5];
+    const char *c = code;
+    for (uint8_t i = 0; i < 5; i++) {
+      const char *start = c;
+      uint16_t number = 0;
+      for (; *c >= '0' && *c <= '9'; c++) {
+        number = number * 10 + (*c - '0');
+        if (number > 255) {
+          return 0;
+        }
+      }
+      if (c == start || *c != separators[i]) {
+        return 0;
+      }
+      numbers[i] = number;
+      c++;
+    }
+    if (numbers[0] > 0x0F || numbers[1] > 0x0F) {
+      return 0;
+    }
+    return obis(numbers[0], numbers[1], numbers[2], numbers[3], numbers[4]);
+  }
+
+  static int8_t hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    return -1;
+  }
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Arduino.h"
+#include "common_sensor.h"
+#include "json_arena.h"
+#include "json_keys.h"
+#include <ArduinoJson.h>
+
+///// rest_server documents
+// The documents of the station's requests, built from its list of sensors.
+// The station posts them, the host load generator and benchmarks build theirs
+// with the same functions so they send the same bodies.
+
+// POST /api/stations
+const size_t station_json_capacity = JSON_OBJECT_SIZE(3) + 200;
+
+void build_station_json(JsonDocument &station_json, const char *token,
+                        const char *location, const char *hostname) {
+  station_json[JSON_KEY(token)] = token;
+  station_json[JSON_KEY(location)] = location;
+  station_json[JSON_KEY(hostname)] = hostname;
+}
+
+// PUT sensors, the setup_json() of each sensor
+size_t sensors_json_capacity(Sensor *const *sensors, uint8_t num_sensors) {
+  size_t capacity = JSON_ARRAY_SIZE(num_sensors) + 200;
+  for (uint8_t i = 0; i < num_sensors; i++) {
+    capacity += sensors[i]->capacity;
+  }
+  return capacity;
+}
+
+void build_sensors_json(JsonDocument &sensors_json, Sensor *const *sensors,
+                        uint8_t num_sensors) {
+  for (uint8_t i = 0; i < num_sensors; i++) {
+    JsonObject sensor_json = sensors_json.createNestedObject();
+    sensors[i]->setup_json(sensor_json);
+  }
+}
+
+// GET sensors response, read with parse_sensors_json()
+size_t sensors_response_capacity(Sensor *const *sensors, uint8_t num_sensors) {
+  size_t capacity = JSON_ARRAY_SIZE(num_sensors) + 200;
+  for (uint8_t i = 0; i < num_sensors; i++) {
+    capacity += sensors[i]->response_capacity;
+  }
+  return capacity;
+}
+
+// POST measurements. A posted measurement takes at most an array slot, an
+// object and its value string in the document, and max_measurement_length
+// bytes in the body, e.g.
+// {"sensor_id":255,"magnitude_id":255,"timestamp":-2147483648,
+//  "value":"-2147483.648"},
+const size_t max_value_length = 12;
+const size_t max_measurement_length = 82;
+const uint16_t max_measurements_per_post =
+    min(json_arena_size /
+            (JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(4) + max_value_length),
+        (sizeof(http_body) - 2) / max_measurement_length);
+
+size_t measurements_json_capacity(uint16_t num_measurements) {
+  return JSON_ARRAY_SIZE(num_measurements) +
+         num_measurements * (JSON_OBJECT_SIZE(4) + max_value_length);
+}
+
+// The values of the frames before end_pos, with the ids and decimals of their
+// sensors. Frames of unknown sensors are skipped, and so are the values of
+// magnitudes the server has no id for: the server rejects the whole post for
+// one of them, which would hold back every later batch. Returns the number of
+// values skipped.
+template <uint16_t N>
+uint16_t build_measurements_json(JsonDocument &list_measurement,
+                                 const SensorFrameBuffer<N> &buffer,
+                                 uint16_t end_pos, Sensor *const *sensors,
+                                 uint8_t num_sensors) {
+  SensorFrame frame;
+  char value[max_value_length];
+  uint16_t num_skipped = 0;
+  for (uint16_t pos = 0; pos < end_pos;) {
+    pos = buffer.read(pos, frame);
+    Sensor *sensor = find_sensor(sensors, num_sensors, frame.sensor_id);
+    if (sensor == nullptr) {
+      num_skipped += frame.num_values;
+      continue;
+    }
+    for (uint8_t i = 0; i < frame.num_values; i++) {
+      const uint8_t magnitude = frame.first_magnitude + i;
+      const uint8_t magnitude_id = sensor->magnitude_id(magnitude);
+      if (magnitude_id == 0) {
+        num_skipped++;
+        continue;
+      }
+      format_fixed(frame.values[i], sensor->magnitude_decimals(magnitude),
+                   value, sizeof(value));
+      JsonObject data_0 = list_measurement.createNestedObject();
+      data_0["sensor_id"] = frame.sensor_id;
+      data_0["magnitude_id"] = magnitude_id;
+      data_0["timestamp"] = frame.epoch;
+      data_0["value"] = value;
+    }
+  }
+  return num_skipped;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Arduino.h"
+
+///// Sample frames
+// A frame is one measurement of a sensor: a single timestamp and sensor id
+// shared by up to max_frame_values values. The values are stored in the
+// sensor's magnitude order starting at first_magnitude, as fixed point numbers
+// with the number of decimals of their magnitude.
+const uint8_t max_frame_values = 8;
+
+typedef struct {
+  time_t epoch;
+  uint8_t sensor_id;
+  uint8_t first_magnitude;
+  uint8_t num_values;
+  int32_t values[max_frame_values];
+} SensorFrame;
+
+const uint32_t decimal_scale[] = {1, 10, 100, 1000, 10000, 100000};
+
+int32_t to_fixed(double value, uint8_t decimals) {
+  return lround(value * decimal_scale[decimals]);
+}
+
+// Write a fixed point value as a decimal string, without going through floats.
+int format_fixed(int32_t value, uint8_t decimals, char *buffer, size_t size) {
+  const char *sign = value < 0 ? "-" : "";
+  const uint32_t abs_value = value < 0 ? -(uint32_t)value : value;
+  if (decimals == 0) {
+    return snprintf(buffer, size, "%s%lu", sign, (unsigned long)abs_value);
+  }
+  const uint32_t scale = decimal_scale[decimals];
+  return snprintf(buffer, size, "%s%lu.%0*lu", sign,
+                  (unsigned long)(abs_value / scale), decimals,
+                  (unsigned long)(abs_value % scale));
+}
+
+// Ring buffer of variable length frames. Only the used values of each frame
+// are stored, so a frame takes header_size + 4 bytes per value instead of a
+// full record per value. Pushing to a full buffer drops the oldest frames.
+// Frames are read sequentially: read() takes a position (0 is the oldest frame)
+// and returns the position of the next one, up to end().
+template <uint16_t N> class SensorFrameBuffer {
+public:
+  static const uint16_t header_size = sizeof(time_t) + 3;
+
+  void push(const SensorFrame &frame) {
+    const uint8_t num_values = min(frame.num_values, max_frame_values);
+    const uint16_t frame_size = header_size + num_values * sizeof(int32_t);
+    while (N - used < frame_size) {
+      drop_oldest();
+    }
+
+    uint16_t pos = used;
+    pos = write(pos, &frame.epoch, sizeof(time_t));
+    pos = write(pos, &frame.sensor_id, 1);
+    pos = write(pos, &frame.first_magnitude, 1);
+    pos = write(pos, &num_values, 1);
+    write(pos, frame.values, num_values * sizeof(int32_t));
+
+    used += frame_size;
+    num_frames++;
+    total_values += num_values;
+  }
+
+  uint16_t read(uint16_t pos, SensorFrame &frame) const {
+    pos = copy(pos, &frame.epoch, sizeof(time_t));
+    pos = copy(pos, &frame.sensor_id, 1);
+    pos = copy(pos, &frame.first_magnitude, 1);
+    pos = copy(pos, &frame.num_values, 1);
+    return copy(pos, frame.values, frame.num_values * sizeof(int32_t));
+  }
+
+  // Position after the oldest whole frames holding at most max_values values,
+  // the batch that is posted next. Their number of values is set in
+  // num_values.
+  uint16_t batch_end(uint16_t max_values, uint16_t &num_values) const {
+    SensorFrame frame;
+    uint16_t end_pos = 0;
+    num_values = 0;
+    while (end_pos < used) {
+      const uint16_t next_pos = read(end_pos, frame);
+      if (num_values + frame.num_values > max_values) {
+        break;
+      }
+      num_values += frame.num_values;
+      end_pos = next_pos;
+    }
+    return end_pos;
+  }
+
+  // Remove all frames before pos, a position returned by read().
+  void discard_until(uint16_t pos) {
+    uint16_t discarded = 0;
+    while (discarded < pos && num_frames > 0) {
+      discarded += drop_oldest();
+    }
+  }
+
+  void clear() {
+    head = used = num_frames = total_values = 0;
+  }
+
+  uint16_t end() const { return used; }
+  uint16_t size() const { return num_frames; }
+  uint16_t num_values() const { return total_values; }
+  bool isEmpty() const { return num_frames == 0; }
+
+private:
+  uint8_t data[N];
+  uint16_t head = 0, used = 0;
+  uint16_t num_frames = 0, total_values = 0;
+
+  uint16_t write(uint16_t pos, const void *src, uint16_t len) {
+    const uint8_t *bytes = (const uint8_t *)src;
+    for (uint16_t i = 0; i < len; i++) {
+      data[(head + pos + i) % N] = bytes[i];
+    }
+    return pos + len;
+  }
+
+  uint16_t copy(uint16_t pos, void *dst, uint16_t len) const {
+    uint8_t *bytes = (uint8_t *)dst;
+    for (uint16_t i = 0; i < len; i++) {
+      bytes[i] = data[(head + pos + i) % N];
+    }
+    return pos + len;
+  }
+
+  // Drop the oldest frame and return its size in bytes.
+  uint16_t drop_oldest() {
+    uint8_t num_values;
+    copy(sizeof(time_t) + 2, &num_values, 1);
+    const uint16_t frame_size = header_size + num_values * sizeof(int32_t);
+    head = (head + frame_size) % N;
+    used -= frame_size;
+    num_frames--;
+    total_values -= num_values;
+    return frame_size;
+  }
+};
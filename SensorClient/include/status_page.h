@@ -0,0 +1,275 @@
+#pragma once
+
+#include "Arduino.h"
+#include "heap_trace.h"
+#include "logging.h"
+
+///// Status page
+// The / page is sent with a chunked response, so it is never held whole in
+// the heap. It is rendered part by part straight into each chunk. When a chunk
+// fills up in the middle of a part, the next chunk renders that part again and
+// skips what was already sent. Log entries are picked by message number, so
+// messages logged while the page is sent don't shift it.
+
+// Writes the bytes of a part from skip on into a chunk
+class ChunkWriter {
+public:
+  ChunkWriter(uint8_t *buffer, size_t size) : buffer{buffer}, size{size} {}
+
+  void start_part(size_t skip) {
+    this->skip = skip;
+    position = 0;
+  }
+
+  void put(char c) {
+    if (full) {
+      return;
+    }
+    if (position < skip) {
+      position++;
+      return;
+    }
+    if (length == size) {
+      full = true;
+      return;
+    }
+    buffer[length++] = c;
+    position++;
+  }
+
+  void print(const char *str) {
+    while (*str != '\0') {
+      put(*str++);
+    }
+  }
+
+  void print_P(PGM_P str) {
+    for (char c; (c = pgm_read_byte(str)) != '\0'; str++) {
+      put(c);
+    }
+  }
+
+  // A template in flash, each %s is replaced by the next of args
+  void print_template_P(PGM_P format, const char *const *args) {
+    for (char c; (c = pgm_read_byte(format)) != '\0'; format++) {
+      if (c == '%' && pgm_read_byte(format + 1) == 's') {
+        print(*args++);
+        format++;
+      } else {
+        put(c);
+      }
+    }
+  }
+
+  // Log text as HTML: markup is escaped, pairs of spaces are kept with &nbsp;
+  // and newlines are dropped
+  void print_escaped(const char *text) {
+    for (; *text != '\0'; text++) {
+      switch (*text) {
+      case '&':
+        print_P(PSTR("&amp;"));
+        break;
+      case '<':
+        print_P(PSTR("&lt;"));
+        break;
+      case '>':
+        print_P(PSTR("&gt;"));
+        break;
+      case '\n':
+        break;
+      case ' ':
+        if (text[1] == ' ') {
+          print_P(PSTR("&nbsp;&nbsp;"));
+          text++;
+          break;
+        }
+        put(' ');
+        break;
+      default:
+        put(*text);
+      }
+    }
+  }
+
+  // Bytes of the part produced until the chunk filled up
+  size_t part_position() const { return position; }
+  size_t chunk_length() const { return length; }
+  bool is_full() const { return full; }
+
+private:
+  uint8_t *buffer;
+  size_t size, length = 0;
+  size_t skip = 0, position = 0;
+  bool full = false;
+};
+
+class StatusPage {
+public:
+  // header is a template with the %s of header_args, which must outlive the
+  // response
+  StatusPage(PGM_P header, const char *const *header_args, PGM_P footer)
+      : header{header}, header_args{header_args}, footer{footer} {
+#ifdef HEAP_TRACE
+    memcpy(heap_sites, heap_trace_sites, sizeof(heap_sites));
+    num_heap_sites = heap_trace_num_sites;
+    heap_min_free = heap_trace_min_free;
+    heap_min_max_block = heap_trace_min_max_block;
+    heap_max_fragmentation = heap_trace_max_fragmentation;
+#endif
+  }
+
+  // Fill the next chunk, 0 when the page is done
+  size_t fill(uint8_t *buffer, size_t size) {
+    ChunkWriter out(buffer, size);
+    while (part != Part::done) {
+      out.start_part(part_offset);
+      render_part(out);
+      if (out.is_full()) {
+        part_offset = out.part_position();
+        break;
+      }
+      next_part();
+    }
+    return out.chunk_length();
+  }
+
+private:
+  enum class Part : uint8_t {
+    header,
+    setup_title,
+    setup_entries,
+    live_title,
+    live_entries,
+#ifdef HEAP_TRACE
+    heap_trace,
+#endif
+    end,
+    footer,
+    done,
+  };
+
+  PGM_P header;
+  const char *const *header_args;
+  PGM_P footer;
+  Part part = Part::header;
+  size_t part_offset = 0;
+  // Message number and copy of the log entry being sent
+  uint32_t next_entry = 0;
+  LogData entry;
+#ifdef HEAP_TRACE
+  HeapTraceSite heap_sites[HEAP_TRACE_MAX_SITES];
+  uint8_t num_heap_sites;
+  uint32_t heap_min_free;
+  uint16_t heap_min_max_block;
+  uint8_t heap_max_fragmentation;
+#endif
+
+  void render_part(ChunkWriter &out) {
+    switch (part) {
+    case Part::header:
+      out.print_template_P(header, header_args);
+      break;
+    case Part::setup_title:
+      out.print_P(PSTR("<main><h2>Logs</h2>\n<h3>Setup</h3>\n"
+                       "<ol class='header-log'>\n"));
+      next_entry = log_header_writes - log_header_buffer.size();
+      break;
+    case Part::setup_entries:
+      render_entries(out, log_header_buffer, log_header_writes);
+      break;
+    case Part::live_title:
+      out.print_P(PSTR("</ol>\n<h3>Live</h3>\n<ol class='main-log'>\n"));
+      next_entry = log_writes - log_buffer.size();
+      break;
+    case Part::live_entries:
+      render_entries(out, log_buffer, log_writes);
+      break;
+#ifdef HEAP_TRACE
+    case Part::heap_trace:
+      render_heap_trace(out);
+      break;
+#endif
+    case Part::end:
+      out.print_P(PSTR("</ol>\n</main>\n"));
+      break;
+    case Part::footer:
+      out.print_P(footer);
+      break;
+    case Part::done:
+      break;
+    }
+  }
+
+  void next_part() {
+    part = (Part)((uint8_t)part + 1);
+    part_offset = 0;
+  }
+
+  // The offset is that of the entry being sent, which is kept until it is
+  // done. Entries pushed out of the buffer meanwhile are skipped.
+  template <typename Buffer>
+  void render_entries(ChunkWriter &out, const Buffer &buffer,
+                      uint32_t writes) {
+    while (part_offset > 0 || next_entry < writes) {
+      if (part_offset == 0) {
+        const uint32_t first = writes - buffer.size();
+        next_entry = max(next_entry, first);
+        if (next_entry == writes) {
+          return;
+        }
+        entry = buffer[next_entry - first];
+      }
+      render_entry(out, entry);
+      if (out.is_full()) {
+        return;
+      }
+      next_entry++;
+      part_offset = 0;
+      out.start_part(0);
+    }
+  }
+
+  // The epochs of the log are in local time already
+  void render_entry(ChunkWriter &out, const LogData &data) {
+    struct tm tm;
+    gmtime_r(&data.epoch, &tm);
+    char date[40];
+    strftime(date, sizeof(date), "%A, %d-%b-%Y %H:%M:%S", &tm);
+
+    out.print_P(PSTR("<li class='log-msg'><time class='log-dt'>"));
+    out.print(date);
+    out.print_P(PSTR("</time> <span class='log-text'>"));
+    out.print_escaped(data.message);
+    out.print_P(PSTR("</span></li>\n"));
+  }
+
+#ifdef HEAP_TRACE
+  void render_heap_trace(ChunkWriter &out) {
+    char line[192];
+    snprintf_P(line, sizeof(line),
+               PSTR("</ol>\n<h3>Heap trace</h3>\n<p>Lowest free: %u B, "
+                    "smallest largest block: %u B, worst fragmentation: "
+                    "%u%%.</p>\n<ol class='main-log'>\n"),
+               heap_min_free, heap_min_max_block, heap_max_fragmentation);
+    out.print(line);
+    for (uint8_t i = 0; i < num_heap_sites; i++) {
+      const HeapTraceSite &site = heap_sites[i];
+      snprintf_P(line, sizeof(line),
+                 PSTR("<li class='log-msg'><span class='log-text'>%s: %u "
+                      "allocs, %u frees, %u B, largest %u B</span></li>\n"),
+                 site.name, site.allocs, site.frees, site.bytes,
+                 site.max_size);
+      out.print(line);
+    }
+  }
+#endif
+};
+
+// The page only changes with the logs, which restart on every boot. The boot
+// id is a random number taken at setup.
+uint32_t status_page_boot_id = 0;
+
+void status_page_etag(char *etag, size_t size) {
+  snprintf_P(etag, size, PSTR("\"%x-%x-%x\""), status_page_boot_id,
+             log_header_writes, log_writes);
+}
@@ -0,0 +1,43 @@
+# Static assets of the station web server, a PlatformIO extra script.
+#
+# The sources are in web/, before every build each one is gzipped into data/,
+# which is what `pio run -t uploadfs` puts in LittleFS. Only the .gz files are
+# uploaded: the web server sends them as they are with Content-Encoding: gzip.
+# They are build outputs, data/ isn't in git. The gzip header has no name nor
+# time, so the files only change with their source.
+# STATIC_ASSETS_VERSION is a hash of the assets. The status page puts it in
+# their URLs, so they can be cached for a year.
+import gzip
+import hashlib
+import os
+
+Import("env")
+
+SOURCE_DIR = os.path.join(env.subst("$PROJECT_DIR"), "web")
+DATA_DIR = env.subst("$PROJECT_DATA_DIR")
+
+
+def gzip_assets():
+    os.makedirs(DATA_DIR, exist_ok=True)
+    version = hashlib.sha1()
+    for name in sorted(os.listdir(SOURCE_DIR)):
+        with open(os.path.join(SOURCE_DIR, name), "rb") as source:
+            content = source.read()
+        version.update(name.encode())
+        version.update(content)
+
+        compressed = gzip.compress(content, compresslevel=9, mtime=0)
+        path = os.path.join(DATA_DIR, name + ".gz")
+        if os.path.exists(path):
+            with open(path, "rb") as current:
+                if current.read() == compressed:
+                    continue
+        with open(path, "wb") as target:
+            target.write(compressed)
+        print("Gzipped %s: %d B to %d B" % (name, len(content), len(compressed)))
+    return version.hexdigest()[:8]
+
+
+env.Append(
+    CPPDEFINES=[("STATIC_ASSETS_VERSION", env.StringifyMacro(gzip_assets()))]
+)
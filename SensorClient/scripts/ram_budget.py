@@ -0,0 +1,54 @@
+# RAM budget of the station firmware, a PlatformIO extra script.
+#
+# After every firmware build the static RAM (.data, .rodata and .bss) is
+# checked against the custom_ram_budget of the env and the build fails when it
+# is over. `pio run -e <env> -t ram_budget` prints the report of one env.
+import subprocess
+
+Import("env")
+
+# Data RAM of the ESP8266, what the firmware doesn't take is the heap at boot,
+# before the Wi-Fi stack takes its part
+DRAM_SIZE = 80 * 1024
+DRAM_SECTIONS = (".data", ".rodata", ".bss")
+
+ELF = "$BUILD_DIR/${PROGNAME}.elf"
+
+
+def section_sizes(elf):
+    output = subprocess.check_output([env.subst("$SIZETOOL"), "-A", elf])
+    sizes = dict.fromkeys(DRAM_SECTIONS, 0)
+    for line in output.decode().splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] in DRAM_SECTIONS:
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def ram_budget(target, source, env):
+    sizes = section_sizes(env.subst(ELF))
+    used = sum(sizes.values())
+    budget = int(env.GetProjectOption("custom_ram_budget", DRAM_SIZE))
+
+    print("RAM of %s:" % env.subst("$PIOENV"))
+    for section in DRAM_SECTIONS:
+        print("  %-8s %6d B" % (section, sizes[section]))
+    print(
+        "  %-8s %6d B of %d B, budget %d B" % ("static", used, DRAM_SIZE, budget)
+    )
+    print("  %-8s %6d B" % ("heap", DRAM_SIZE - used))
+
+    if used > budget:
+        print("RAM budget exceeded by %d B" % (used - budget))
+        return 1
+    return 0
+
+
+env.AddPostAction(ELF, ram_budget)
+env.AddCustomTarget(
+    "ram_budget",
+    ELF,
+    ram_budget,
+    title="RAM budget",
+    description="Report the static RAM and heap headroom of the firmware",
+)
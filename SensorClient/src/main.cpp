@@ -16,7 +16,14 @@
 
 #include "common_sensor.h"
 #include "config.h"
+#include "heap_trace.h"
+#include "i2c_scheduler.h"
+#include "json_arena.h"
+#include "latest_measurements.h"
+#include "live_events.h"
 #include "logging.h"
+#include "rest_json.h"
+#include "status_page.h"
 
 #ifdef HAS_AM2320
 #include <AM2320Sensor.h>
@@ -44,6 +51,11 @@ const char *password PROGMEM = STAPSK;
 
 //// Web Server
 AsyncWebServer web_server(80);
+// Set by scripts/gzip_assets.py from the content of the static assets
+#ifndef STATIC_ASSETS_VERSION
+#define STATIC_ASSETS_VERSION "0"
+#endif
+const char *static_assets_version = STATIC_ASSETS_VERSION;
 bool requested_restart = false;
 const char web_server_html_header[] PROGMEM = R"=====(
 <!DOCTYPE HTML>
@@ -51,7 +63,7 @@ const char web_server_html_header[] PROGMEM = R"=====(
 <head>
 <meta charset="utf-8"/>
 <meta name="viewport" content="width=device-width, initial-scale=1">
-<link rel="stylesheet" type="text/css" href="style.css">
+<link rel="stylesheet" type="text/css" href="style.css?v=%s">
 <title>ESP8266 Home Sensor Station %s</title>
 </head>
 <body>
@@ -94,10 +106,17 @@ const char *location PROGMEM = "test";
 //// rest server
 const char *server PROGMEM = SERVER_HOSTNAME;
 const char *stations_endpoint PROGMEM = "/api/stations";
-String station_endpoint, sensors_endpoint;
+// HTTPClient::begin() and addHeader() take Strings. Those of every request
+// are built once, so requests don't make temporary copies on the heap. The
+// client still copies them into its own Strings for every request.
+String server_host(server), sensors_endpoint, measurements_endpoint;
+const String content_type_header("Content-Type");
+const String json_content_type("application/json");
 uint8_t station_id;
 const uint8_t port = 80;
 uint8 num_sending_measurement_errors = 0;
+// Values not sent because the server has no id for their magnitude
+uint32_t num_unregistered_measurements = 0;
 
 //// Time
 Timezone Amsterdam;
@@ -148,11 +167,18 @@ Ticker watchdog_timer(watchdog, int(watchdog_period_s) * 1e3, 0, MILLIS);
 //// Post request
 WiFiClient client;
 HTTPClient http;
-String response;
 const uint32_t send_data_period_s = 5;
 void send_data();
 Ticker send_timer(send_data, int(send_data_period_s) * 1e3, 0, MILLIS);
 
+// Read the P1 meter while the loop is blocked, so its receive ring doesn't
+// overflow
+void drain_p1() {
+#ifdef HAS_P1
+  p1_sensor.measure();
+#endif
+}
+
 ////// Setup functions
 
 void connect_to_wifi() {
@@ -162,7 +188,7 @@ void connect_to_wifi() {
   WiFi.mode(WIFI_STA); // WiFi mode station (connect to wifi router only
   while (!WiFi.isConnected()) {
     delay(1000);
-    Serial.print(".");
+    Serial.print('.');
   }
   Serial.println();
 
@@ -195,6 +221,7 @@ void setup_OTA() {
   ArduinoOTA.onEnd([]() { log_println(F("Finished the OTA update.")); });
 
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+    drain_p1();
     static uint8_t last_perc_progress = 0;
     uint8_t perc_progress = (progress / (total / 100));
     if (((perc_progress % 20) == 0) && (perc_progress > last_perc_progress)) {
@@ -237,8 +264,8 @@ bool connect_to_time() {
   }
   setInterval(60 * 60); // 1h in seconds
 
-  log_println("  UTC: " + UTC.dateTime());
-  log_println("  Amsterdam time: " + Amsterdam.dateTime());
+  log_printf("  UTC: %s\n", UTC.dateTime().c_str());
+  log_printf("  Amsterdam time: %s\n", Amsterdam.dateTime().c_str());
   log_header_printf("Connection stablished with the time server (%s). Using "
                     "Amsterdam time.\n",
                     UTC.dateTime().c_str());
@@ -253,31 +280,32 @@ bool setup_station() {
     return false;
   }
 
-  log_println("setup_station");
+  log_println(F("setup_station"));
 
   // Prepare JSON document
-  const size_t capacity = JSON_OBJECT_SIZE(3);
-  DynamicJsonDocument station_json(capacity + 50);
-
-  station_json["token"] = mac_sha;
-  station_json["location"] = location;
-  station_json["hostname"] = hostname;
+  ArenaJsonDocument station_json(station_json_capacity);
+  build_station_json(station_json, mac_sha.c_str(), location,
+                     hostname.c_str());
 
   // Serialize JSON document
-  String station_data;
-  serializeJson(station_json, station_data);
+  const size_t length = serialize_body(station_json);
+  if (length == 0) {
+    log_println(F("  Station document doesn't fit."));
+    return false;
+  }
 
   // post data, if the response is 201 then it was created
   // If it was 200 then it was already there.
   int post_httpCode;
 
-  http.begin(client, server, port, stations_endpoint);
-  http.addHeader("Content-Type", "application/json");
+  http.begin(client, server_host, port, stations_endpoint);
+  http.addHeader(content_type_header, json_content_type);
   const char *headerNames[] = {"Location"};
   http.collectHeaders(headerNames,
                       sizeof(headerNames) / sizeof(headerNames[0]));
 
-  post_httpCode = http.POST(station_data); // Send the request
+  // Send the request
+  post_httpCode = http.POST((uint8_t *)http_body, length);
   log_printf("  POST HTTP code: %d.\n", post_httpCode);
   switch (post_httpCode) {
   case HTTP_CODE_OK: // Station already existed
@@ -290,8 +318,9 @@ bool setup_station() {
   }
 
   station_id = http.header("Location").toInt();
-  station_endpoint = String(stations_endpoint) + "/" + station_id;
-  sensors_endpoint = String(stations_endpoint) + "/" + station_id + "/sensors";
+  sensors_endpoint = String(stations_endpoint) + "/" + station_id;
+  measurements_endpoint = sensors_endpoint + "/measurements";
+  sensors_endpoint += "/sensors";
 
   log_printf("  station_id: %d.\n", station_id);
   log_header_printf(
@@ -308,41 +337,33 @@ bool setup_sensors() {
     return false;
   }
 
-  log_println("setup_sensors");
+  log_println(F("setup_sensors"));
 
-  // Prepare JSON document
-  size_t capacity = JSON_ARRAY_SIZE(NUM_SENSORS);
-  for (auto sensor : sensors) {
-    capacity += sensor->capacity;
-  }
-  DynamicJsonDocument sensors_json(capacity + 200);
+  // Prepare JSON document, the arena holds it until it is serialized
+  size_t length;
+  {
+    ArenaJsonDocument sensors_json(sensors_json_capacity(sensors, NUM_SENSORS));
+    build_sensors_json(sensors_json, sensors, NUM_SENSORS);
 
-  size_t response_capacity = JSON_ARRAY_SIZE(NUM_SENSORS);
-  for (auto sensor : sensors) {
-    response_capacity += sensor->response_capacity;
+    // Serialize JSON document
+    length = serialize_body(sensors_json);
   }
-  DynamicJsonDocument sensors_json_response(response_capacity + 200);
-
-  for (auto sensor : sensors) {
-    JsonObject sensor_json = sensors_json.createNestedObject();
-    sensor->setup_json(sensor_json);
+  if (length == 0) {
+    log_println(F("  Sensors document doesn't fit."));
+    return false;
   }
 
-  // Serialize JSON document
-  String sensors_data;
-  serializeJson(sensors_json, sensors_data);
-
   // put data, if the response is 204 then it all went well
   int get_httpCode, put_httpCode;
-  http.begin(client, server, port, sensors_endpoint);
-  put_httpCode = http.PUT(sensors_data);
+  http.begin(client, server_host, port, sensors_endpoint);
+  put_httpCode = http.PUT((uint8_t *)http_body, length);
   log_printf("  PUT HTTP code: %d.\n", put_httpCode);
   log_header_printf("Connected to server at %s%s, setup sensors: PUT code: %d.",
                     server, sensors_endpoint.c_str(), put_httpCode);
   switch (put_httpCode) {
   case HTTP_CODE_NO_CONTENT: // OK, GET sensors
     http.end();
-    http.begin(client, server, port, sensors_endpoint);
+    http.begin(client, server_host, port, sensors_endpoint);
     get_httpCode = http.GET();
     log_printf("  GET HTTP code: %d.\n", get_httpCode);
     break;
@@ -351,22 +372,26 @@ bool setup_sensors() {
     return false;
   }
 
-  response = http.getString(); // Get the response payload
+  // Get the response payload
+  length = read_body(http);
   http.end();
-  // log_printf("  rest_server response: %s.\n", response.c_str());
+  if (length == 0) {
+    log_println(F("  Sensors response doesn't fit."));
+    return false;
+  }
+  // log_printf("  rest_server response: %s.\n", http_body);
 
-  deserializeJson(sensors_json_response, response);
-  JsonArray sensors_json_out = sensors_json_response.as<JsonArray>();
+  ArenaJsonDocument sensors_json_response(
+      sensors_response_capacity(sensors, NUM_SENSORS));
 
-  for (JsonObject sensor_json : sensors_json_out) {
-    const char *name = sensor_json["name"];
-    for (auto sensor : sensors) {
-      if (strcmp(name, sensor->name) == 0) {
-        sensor->parse_json(sensor_json);
-        break;
-      }
-    }
+  // Parsed in place, the strings of the document point into http_body
+  if (deserializeJson(sensors_json_response, http_body, length)) {
+    log_println(F("  Sensors response doesn't fit, some ids are missing."));
   }
+  parse_sensors_json(sensors_json_response.as<JsonArray>(), sensors,
+                     NUM_SENSORS);
+  // The latest measurements were kept under the previous ids
+  latest_measurements.clear();
 
   return true;
 }
@@ -381,53 +406,47 @@ bool setup_internal_sensors() {
 
 void setup_web_server() {
   log_println(F("setup_server"));
+  status_page_boot_id = RANDOM_REG32;
 
   // Web server
   web_server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    AsyncResponseStream *response = request->beginResponseStream("text/html");
-    response->printf_P(web_server_html_header, hostname.c_str(),
-                       hostname.c_str(), hostname.c_str(), location,
-                       hostname.c_str(), hostname.c_str());
-
-    response->println(
-        F("<main><h2>Logs</h2>\n<h3>Setup</h3>\n<ol class='header-log'>"));
-
-    if (!log_header_buffer.isEmpty()) {
-      using index_t = decltype(log_header_buffer)::index_t;
-      for (index_t i = 0; i < log_header_buffer.size(); i++) {
-        String msg = String(log_header_buffer[i].message);
-        msg.replace("  ", "&nbsp;&nbsp;");
-        msg.replace("\n", "");
-        response->printf("<li class='log-msg'><time class='log-dt'>%s</time> "
-                         "<span class='log-text'>%s</span></li>\n",
-                         Amsterdam.dateTime(log_header_buffer[i].epoch).c_str(),
-                         msg.c_str());
-      }
-    }
-
-    response->println(F("</ol>\n<h3>Live</h3>\n<ol class='main-log'>"));
-
-    if (!log_buffer.isEmpty()) {
-      using index_t = decltype(log_buffer)::index_t;
-      for (index_t i = 0; i < log_buffer.size(); i++) {
-        String msg = String(log_buffer[i].message);
-        msg.replace("  ", "&nbsp;&nbsp;");
-        msg.replace("\n", "");
-        response->printf("<li class='log-msg'><time class='log-dt'>%s</time> "
-                         "<span class='log-text'>%s</span></li>\n",
-                         Amsterdam.dateTime(log_buffer[i].epoch).c_str(),
-                         msg.c_str());
-      }
+    HEAP_TRACE_SCOPE("web_root");
+#ifndef HEAP_TRACE
+    // The heap trace changes without the logs, so those pages aren't cached
+    char etag[32];
+    status_page_etag(etag, sizeof(etag));
+    AsyncWebHeader *if_none_match = request->getHeader("If-None-Match");
+    if (if_none_match != nullptr && if_none_match->value() == etag) {
+      AsyncWebServerResponse *response = request->beginResponse(304);
+      response->addHeader(F("ETag"), etag);
+      request->send(response);
+      return;
     }
+#endif
 
-    response->println(F("</ol>\n</main>"));
-    response->printf_P(web_server_html_footer);
+    // The hostname doesn't change after setup
+    static const char *const header_args[] = {
+        static_assets_version, hostname.c_str(), hostname.c_str(),
+        hostname.c_str(),      location,         hostname.c_str(),
+        hostname.c_str()};
+    StatusPage page(web_server_html_header, header_args,
+                    web_server_html_footer);
+    AsyncWebServerResponse *response = request->beginChunkedResponse(
+        "text/html", [page](uint8_t *buffer, size_t max_len,
+                            size_t index) mutable {
+          return page.fill(buffer, max_len);
+        });
+#ifndef HEAP_TRACE
+    response->addHeader(F("ETag"), etag);
+#endif
+    response->addHeader(F("Cache-Control"), F("no-cache"));
     request->send(response);
   });
 
-  web_server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/style.css", "text/css");
-  });
+  // Only the gzipped file is uploaded, the URL has the version of the assets
+  // so they can be cached for good
+  web_server.serveStatic("/style.css", LittleFS, "/style.css")
+      .setCacheControl("max-age=31536000, immutable");
 
   web_server.on("/restart", HTTP_GET, [](AsyncWebServerRequest *request) {
     requested_restart = true;
@@ -446,6 +465,20 @@ void setup_web_server() {
     request->send(response);
   });
 
+  web_server.on("/api/latest", HTTP_GET, [](AsyncWebServerRequest *request) {
+    LatestMeasurementsJson json;
+    AsyncWebServerResponse *response = request->beginChunkedResponse(
+        json_content_type,
+        [json](uint8_t *buffer, size_t max_len, size_t index) mutable {
+          return json.fill(buffer, max_len);
+        });
+    response->addHeader(F("Access-Control-Allow-Origin"), F("*"));
+    response->addHeader(F("Cache-Control"), F("no-cache"));
+    request->send(response);
+  });
+
+  setup_live_events(web_server);
+
   web_server.onNotFound([](AsyncWebServerRequest *request) {
     Serial.println(F("404."));
     request->send(404, F("text/plain"), F("Not found"));
@@ -453,7 +486,7 @@ void setup_web_server() {
 
   // Start server
   web_server.begin();
-  log_println("  done.");
+  log_println(F("  done."));
 }
 
 void log_heap_usage() {
@@ -464,20 +497,27 @@ void log_heap_usage() {
   log_printf(
       "Free RAM: %d kB, largest contiguous: %d kB (fragmentation: %d%%).\n",
       hfree / 1024, hmax / 1024, hfrag);
+#ifdef HEAP_TRACE
+  log_printf("  Heap trace: lowest free %u B, smallest largest block %u B, "
+             "worst fragmentation %u%%.\n",
+             heap_trace_min_free, heap_trace_min_max_block,
+             heap_trace_max_fragmentation);
+#endif
 }
 
 ////// Send data functions
-bool post_measurement(String &data, String endpoint) {
+bool post_measurement(size_t length) {
   // Post Data
   if (WiFi.status() != WL_CONNECTED) {
     connect_to_wifi();
     return false;
   }
 
-  http.begin(client, server, port, endpoint);
-  http.addHeader("Content-Type", "application/json");
+  http.begin(client, server_host, port, measurements_endpoint);
+  http.addHeader(content_type_header, json_content_type);
 
-  int httpCode = http.POST(data); // Send the request
+  // Send the request
+  int httpCode = http.POST((uint8_t *)http_body, length);
   http.end();
   switch (httpCode) {
   case HTTP_CODE_CREATED:
@@ -493,6 +533,15 @@ bool post_measurement(String &data, String endpoint) {
   }
 }
 
+// Keep the latest values and push the frame live
+void on_frame_queued(const SensorFrame &frame) {
+  Sensor *sensor = find_sensor(sensors, NUM_SENSORS, frame.sensor_id);
+  if (sensor != nullptr) {
+    latest_measurements.update(frame, *sensor);
+    send_live_event(frame, *sensor);
+  }
+}
+
 #ifdef DONT_SEND_DATA
 void send_data() {}
 #else
@@ -500,37 +549,42 @@ void send_data() {
   if (sensor_buffer.isEmpty()) {
     return;
   }
+  HEAP_TRACE_SCOPE("send_data");
   log_heap_usage();
 
-  using index_t = decltype(sensor_buffer)::index_t;
-
-  const index_t num_measurements = sensor_buffer.size();
+  // Send whole frames, up to max_measurements_per_post values
+  uint16_t num_measurements;
+  const uint16_t end_pos =
+      sensor_buffer.batch_end(max_measurements_per_post, num_measurements);
   log_printf("Sending %d measurements...\n", num_measurements);
 
   // Prepare JSON document
-  const size_t capacity = JSON_ARRAY_SIZE(num_measurements) +
-                          num_measurements * JSON_OBJECT_SIZE(4);
-  DynamicJsonDocument list_measurement(capacity + 200 * num_measurements);
-
-  for (index_t i = 0; i < num_measurements; i++) {
-    sensor_data = sensor_buffer[i];
-    JsonObject data_0 = list_measurement.createNestedObject();
-    data_0["sensor_id"] = sensor_data.sensor_id;
-    data_0["magnitude_id"] = sensor_data.magnitude_id;
-    data_0["timestamp"] = sensor_data.epoch;
-    data_0["value"] = sensor_data.value;
+  ArenaJsonDocument list_measurement(
+      measurements_json_capacity(num_measurements));
+  const uint16_t num_skipped = build_measurements_json(
+      list_measurement, sensor_buffer, end_pos, sensors, NUM_SENSORS);
+  if (num_skipped > 0) {
+    log_printf("  %d measurements of unregistered magnitudes skipped.\n",
+               num_skipped);
+    num_unregistered_measurements += num_skipped;
+  }
+  if (num_skipped == num_measurements) {
+    sensor_buffer.discard_until(end_pos);
+    return;
   }
 
   // Serialize JSON document
-  String post_data;
-  serializeJson(list_measurement, post_data);
+  const size_t length = serialize_body(list_measurement);
+  if (length == 0) {
+    log_println(F("  Measurements don't fit, data was not sent."));
+    return;
+  }
 
-  const bool success =
-      post_measurement(post_data, station_endpoint + "/measurements");
+  const bool success = post_measurement(length);
 
   if (success) {
     log_println(F("  Data sent successfully."));
-    sensor_buffer.clear();
+    sensor_buffer.discard_until(end_pos);
   } else {
     log_println(F("  Data was not sent."));
   }
@@ -541,6 +595,7 @@ void watchdog() {
   for (auto sensor : sensors) {
     sensor->watchdog();
   }
+  i2c_scheduler.log_stats();
 }
 
 void retry(std::function<bool()> func, const __FlashStringHelper *info,
@@ -555,6 +610,7 @@ void retry(std::function<bool()> func, const __FlashStringHelper *info,
       }
       ArduinoOTA.handle();
       delay(1000);
+      drain_p1();
       num_tries++;
     } else {
 #ifdef ALLOW_SENSOR_FAILURES
@@ -589,6 +645,7 @@ void setup() {
   connect_to_wifi();
 
   setup_web_server();
+  on_queue_frame = &on_frame_queued;
 
   setup_OTA();
 
@@ -638,6 +695,7 @@ void loop() {
   for (auto sensor_timer : sensor_timers) {
     sensor_timer->update();
   }
+  i2c_scheduler.update();
   send_timer.update();
   watchdog_timer.update();
 }
@@ -57,6 +57,22 @@ def create_sensor(db: Session, sensor: schemas.SensorCreate) -> models.Sensor:
     return db_sensor
 
 
+def add_sensor_magnitudes(
+    db: Session, db_sensor: models.Sensor, magnitudes: List[schemas.MagnitudeCreate]
+) -> models.Sensor:
+    """Add the magnitudes the sensor doesn't have yet, by name. Existing ones are kept
+    with their ids, the measurements stored under them still refer to them."""
+    db_magnitude_names = {db_magnitude.name for db_magnitude in db_sensor.magnitudes}
+    for magnitude_in in magnitudes:
+        if magnitude_in.name not in db_magnitude_names:
+            db_sensor.magnitudes.append(create_magnitude(db, magnitude_in))
+            db_magnitude_names.add(magnitude_in.name)
+
+    db.commit()
+    db.refresh(db_sensor)
+    return db_sensor
+
+
 # Stations
 def get_station(db: Session, station_id: int) -> Optional[models.Station]:
     return db.query(models.Station).get(station_id)
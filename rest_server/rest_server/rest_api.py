@@ -81,10 +81,12 @@ def create_station_sensor(
     if not db_station:
         raise HTTPException(404, "Station not found")
 
-    # if sensor already exists in sensors, don't duplicate it
+    # if sensor already exists in sensors, don't duplicate it, add the magnitudes it misses
     db_sensor = crud.get_sensor_by_name_and_tag(db, sensor.name, sensor.tag)
     if not db_sensor:
         db_sensor = crud.create_sensor(db, sensor)
+    else:
+        crud.add_sensor_magnitudes(db, db_sensor, sensor.magnitudes)
 
     # if sensor is already a sensor in this station, don't duplicate it either
     db_station_sensor = crud.get_station_sensor(db, db_station, db_sensor)
@@ -104,7 +106,8 @@ def set_station_sensors(
     response: Response,
     db: Session = Depends(get_db),
 ):
-    """Sets the station's sensors to sensors"""
+    """Sets the station's sensors to sensors. Sensors that already exist get the
+    magnitudes they miss, a new firmware may measure more than the one that created them."""
 
     db_station = crud.get_station(db, station_id)
     if not db_station:
@@ -121,12 +124,14 @@ def set_station_sensors(
         if sensor.name in db_sensor_names_delete
     ]
 
-    for sensor in sensors_add:
+    for sensor in sensors:
         db_sensor = crud.get_sensor_by_name_and_tag(db, sensor.name, sensor.tag)
-        if db_sensor:
-            crud.add_station_sensor(db, db_station, db_sensor)
-        else:
+        if not db_sensor:
             crud.create_station_sensor(db, db_station, sensor)
+            continue
+        crud.add_sensor_magnitudes(db, db_sensor, sensor.magnitudes)
+        if sensor.name in sensor_names_add:
+            crud.add_station_sensor(db, db_station, db_sensor)
 
     for db_sensor in db_sensors_delete:
         crud.delete_station_sensor(db, db_station, db_sensor)
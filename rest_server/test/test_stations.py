@@ -197,3 +197,66 @@ def test_modify_station_sensors(client, db_session, station_one, sensor_one, sen
     response = client.get("/api/stations/1/sensors")
     assert response.status_code == 200
     assert response.json() == [sensor2_out]
+
+
+def test_modify_station_sensor_magnitudes(client, db_session, station_one, sensor_one):
+    """A sensor set again with more magnitudes keeps its ids and gets the new ones"""
+    station_in, station_out = station_one
+    sensor1_in, sensor1_out = sensor_one
+    mag3 = dict(name="dew_point", unit="C", precision=0.1)
+    sensor1_more_in = dict(sensor1_in, magnitudes=sensor1_in["magnitudes"] + [mag3])
+    sensor1_more_out = dict(
+        sensor1_out, magnitudes=sensor1_out["magnitudes"] + [dict(id=3, **mag3)]
+    )
+
+    client.post("/api/stations", json=station_in)
+    client.post("/api/stations/1/sensors", json=sensor1_in)
+
+    response = client.put("/api/stations/1/sensors", json=[sensor1_more_in])
+    assert response.status_code == 204
+
+    response = client.get("/api/stations/1/sensors")
+    assert response.status_code == 200
+    assert response.json() == [sensor1_more_out]
+
+    # Setting the first magnitudes again doesn't remove the new one
+    response = client.put("/api/stations/1/sensors", json=[sensor1_in])
+    assert response.status_code == 204
+
+    response = client.get("/api/stations/1/sensors")
+    assert response.status_code == 200
+    assert response.json() == [sensor1_more_out]
+
+
+def test_modify_station_sensor_delta_magnitudes(client, db_session, station_one):
+    """A P1 sensor registered with snapshots gets the delta and peak names of a station
+    that reports deltas, the snapshot ones stay for the measurements stored under them"""
+    station_in, station_out = station_one
+    snapshot = [
+        dict(name="power_consumption_1", unit="kWh", precision=0.001),
+        dict(name="gas_consumption", unit="m3", precision=0.001),
+    ]
+    deltas = [
+        dict(name="power_consumption_1_delta", unit="kWh", precision=0.001),
+        dict(name="gas_consumption_delta", unit="m3", precision=0.001),
+        dict(name="peak_power_consumption", unit="kW", precision=0.001),
+    ]
+
+    client.post("/api/stations", json=station_in)
+    client.put("/api/stations/1/sensors", json=[dict(name="P1", magnitudes=snapshot)])
+
+    response = client.put("/api/stations/1/sensors", json=[dict(name="P1", magnitudes=deltas)])
+    assert response.status_code == 204
+
+    response = client.get("/api/stations/1/sensors")
+    assert response.status_code == 200
+    assert response.json() == [
+        dict(
+            id=1,
+            name="P1",
+            tag=None,
+            magnitudes=[
+                dict(id=id, **magnitude) for id, magnitude in enumerate(snapshot + deltas, 1)
+            ],
+        )
+    ]